@@ -12,7 +12,7 @@ mkdir -p /succ/inv &&
 mkdir -p /succ/log && \
 mkdir -p /succ/rootback && \
 echo "Copying files..." && \
-cp /tmp/succ/init /succ/bin/init && \
+cp /tmp/succ/successor-init /succ/bin/successor-init && \
 cp /tmp/succ/successor /succ/bin/successor && \
 cp /tmp/succ/uninstall /succ/bin/uninstall && \
 chmod +x /succ/bin/* && \
@@ -26,12 +26,12 @@ fi
 
 ln -s ../succ/bin/successor /sbin/successor 
 if [ -f /sbin/init2 ] ; then
-  echo "Init script already installed"
+  echo "Init already installed"
   exit 1
 else
-  echo "Installing init script..."
+  echo "Installing init..."
   mv /sbin/init /sbin/init2 && \
-  ln -s ../succ/bin/init /sbin/init
+  ln -s ../succ/bin/successor-init /sbin/init
 fi
 
 echo "Done!"
\ No newline at end of file
@@ -0,0 +1,259 @@
+// Switch-latency benchmark. Runs the whole runner::run flow, pivot_root and rollback included, against a
+// synthetic host in fresh user, mount and PID namespaces, so that it needs neither root nor a reboot:
+//
+//   make bench BENCH_ARGS="--iterations 500 --binds 100"
+//
+// The host is a tmpfs holding an inventory with a single version, bench/1, and a mount table of --binds bind
+// mounts and --tmpfs tmpfs mounts that every switch has to migrate and every rollback has to move back.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <filesystem>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+
+#include "../core/runner.hpp"
+#include "../interfaces/stats.hpp"
+
+struct options_t
+{
+  int iterations = 200;
+  int warmup = 10;
+  int binds = 50;
+  int tmpfs = 10;
+  int files = 1000;
+  bool temporary = false;
+};
+
+void usage()
+{
+  std::cout << "Usage: bench [--iterations N] [--warmup N] [--binds N] [--tmpfs N] [--files N] [--temporary]\n"
+            << "\n"
+            << "  --iterations N   Number of measured switches, 200 by default\n"
+            << "  --warmup N       Number of switches run before measuring, 10 by default\n"
+            << "  --binds N        Number of bind mounts of the host, 50 by default\n"
+            << "  --tmpfs N        Number of tmpfs mounts of the host, 10 by default\n"
+            << "  --files N        Number of files in the image, 1000 by default\n"
+            << "  --temporary      Switch in temporary mode, in a new mount namespace every time" << std::endl;
+}
+
+options_t parse(int argc, char **argv)
+{
+  options_t options;
+  std::map<std::string, int *> numbers = {{"--iterations", &options.iterations}, {"--warmup", &options.warmup},
+                                          {"--binds", &options.binds}, {"--tmpfs", &options.tmpfs},
+                                          {"--files", &options.files}};
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--temporary")
+      options.temporary = true;
+    else if (arg == "--help" || arg == "-h")
+    {
+      usage();
+      exit(0);
+    }
+    else if (numbers.count(arg) && i + 1 < argc)
+      *numbers[arg] = std::stoi(argv[++i]);
+    else
+      throw std::runtime_error("Unknown argument " + arg);
+  }
+  if (options.iterations < 1 || options.warmup < 0 || options.binds < 0 || options.tmpfs < 0 || options.files < 0)
+    throw std::runtime_error("Counts must not be negative and there must be at least one iteration");
+  return options;
+}
+
+void write_file(const std::filesystem::path &path, const std::string &content)
+{
+  std::ofstream file(path);
+  file << content;
+  if (!file)
+    throw std::runtime_error("Cannot write " + path.string());
+}
+
+// Maps the calling user to root of a new user namespace, which owns the new PID namespace and the mount
+// namespace the benchmark creates later.
+void enter_namespaces()
+{
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  if (unshare(CLONE_NEWUSER | CLONE_NEWPID) != 0)
+    throw sys::system_error("Cannot create namespaces. Error code: " + std::string(std::strerror(errno)));
+  write_file("/proc/self/setgroups", "deny");
+  write_file("/proc/self/uid_map", "0 " + std::to_string(uid) + " 1");
+  write_file("/proc/self/gid_map", "0 " + std::to_string(gid) + " 1");
+}
+
+// Builds the synthetic host on a tmpfs over the host directory and makes it the root of a new mount namespace,
+// leaving nothing of the real host mounted.
+void make_host(const std::filesystem::path &host, const options_t &options)
+{
+  if (unshare(CLONE_NEWNS) != 0)
+    throw sys::system_error("Cannot create mount namespace. Error code: " + std::string(std::strerror(errno)));
+  if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0)
+    throw sys::system_error("Cannot make / private. Error code: " + std::string(std::strerror(errno)));
+  sys::mnt::tmpfs(host, "50%");
+
+  std::filesystem::path image = host / runner::DEFAULT_ROOTBACK.parent_path().relative_path() / "inv" / "bench" / "1";
+  for (auto dir : {"bin", "etc", "usr/lib", "proc", "succ", "data", "mnt"})
+    std::filesystem::create_directories(image / dir);
+  for (int i = 0; i < options.files; i++)
+    write_file(image / (i % 2 ? "usr/lib" : "etc") / ("file-" + std::to_string(i)), std::string(i % 4096, 'x'));
+
+  std::filesystem::create_directories(host / runner::DEFAULT_ROOTBACK.relative_path());
+  std::filesystem::create_directories(host / "proc");
+  std::filesystem::create_directories(host / "oldroot");
+  for (int i = 0; i < options.binds; i++)
+  {
+    std::filesystem::path source = host / "data" / std::to_string(i);
+    std::filesystem::path target = host / "mnt" / ("bind-" + std::to_string(i));
+    std::filesystem::create_directories(source);
+    std::filesystem::create_directories(target);
+    std::filesystem::create_directories(image / "mnt" / ("bind-" + std::to_string(i)));
+    sys::mnt::bind(source, target);
+  }
+  for (int i = 0; i < options.tmpfs; i++)
+  {
+    std::filesystem::path target = host / "mnt" / ("tmpfs-" + std::to_string(i));
+    std::filesystem::create_directories(target);
+    std::filesystem::create_directories(image / "mnt" / ("tmpfs-" + std::to_string(i)));
+    sys::mnt::tmpfs(target, "1M");
+  }
+
+  // before the old root goes, as a user namespace may only mount a proc that is already fully visible in it
+  if (mount("proc", (host / "proc").c_str(), "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, nullptr) != 0)
+    throw sys::system_error("Cannot mount /proc. Error code: " + std::string(std::strerror(errno)));
+
+  sys::pivot_root(host, host / "oldroot");
+  std::filesystem::current_path("/");
+  if (umount2("/oldroot", MNT_DETACH) != 0)
+    throw sys::system_error("Cannot detach the old root. Error code: " + std::string(std::strerror(errno)));
+  std::filesystem::remove("/oldroot");
+}
+
+void report(const std::string &name, std::vector<uint64_t> samples)
+{
+  std::sort(samples.begin(), samples.end());
+  uint64_t total = 0;
+  for (auto sample : samples)
+    total += sample;
+  std::cout << std::left << std::setw(12) << name << std::right
+            << std::setw(10) << samples.front()
+            << std::setw(10) << stats::percentile(samples, 50)
+            << std::setw(10) << stats::percentile(samples, 90)
+            << std::setw(10) << stats::percentile(samples, 99)
+            << std::setw(10) << samples.back()
+            << std::setw(10) << total / samples.size() << std::endl;
+}
+
+int bench(const std::filesystem::path &host, const options_t &options)
+{
+  make_host(host, options);
+
+  logging::quiet_logger logger;
+  runner::run_mode_t mode = options.temporary ? runner::RUN_MODE_TEMPORARY : runner::RUN_MODE_PERMANENT;
+  std::filesystem::path sysroot = runner::DEFAULT_ROOTBACK.parent_path() / "inv" / "bench" / "1";
+  std::vector<uint64_t> totals, switches, rollbacks;
+  std::map<std::string, std::vector<uint64_t>> phases;
+
+  for (int i = 0; i < options.warmup + options.iterations; i++)
+  {
+    int64_t switch_us = 0;
+    std::vector<std::pair<std::string, int64_t>> switch_phases;
+    runner::run_options_t run_options;
+    run_options.on_switched = [&](int64_t us, const std::vector<std::pair<std::string, int64_t>> &p)
+    {
+      switch_us = us;
+      switch_phases = p;
+    };
+
+    // a temporary run leaves its mount namespace behind, so it runs in a child like `successor run` would
+    auto start = std::chrono::steady_clock::now();
+    if (options.temporary)
+    {
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        runner::run(logger, mode, sysroot, runner::DEFAULT_ROOTBACK, {"/succ"}, std::nullopt, run_options);
+        _exit(0);
+      }
+      if (sys::wait(pid) != 0)
+        throw std::runtime_error("Switch " + std::to_string(i) + " failed");
+    }
+    else
+      runner::run(logger, mode, sysroot, runner::DEFAULT_ROOTBACK, {"/succ"}, std::nullopt, run_options);
+    int64_t total_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (i < options.warmup)
+      continue;
+    totals.push_back(total_us);
+    // the phases are only known in the process that switched
+    if (options.temporary)
+      continue;
+    switches.push_back(switch_us);
+    rollbacks.push_back(total_us - switch_us);
+    for (auto &[phase, us] : switch_phases)
+      phases[phase].push_back(us);
+  }
+
+  std::cout << options.iterations << " switches, " << options.binds << " bind mounts, " << options.tmpfs
+            << " tmpfs mounts, " << options.files << " files, " << (options.temporary ? "temporary" : "permanent")
+            << " mode" << std::endl
+            << std::endl;
+  std::cout << std::left << std::setw(12) << "us" << std::right << std::setw(10) << "min" << std::setw(10) << "p50"
+            << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+  report("total", totals);
+  if (!switches.empty())
+  {
+    report("switch", switches);
+    report("rollback", rollbacks);
+    for (auto &[phase, samples] : phases)
+      report("  " + phase, samples);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  try
+  {
+    options_t options = parse(argc, argv);
+    char pattern[] = "/tmp/successor-bench-XXXXXX";
+    if (mkdtemp(pattern) == nullptr)
+      throw sys::system_error("Cannot create host directory. Error code: " + std::string(std::strerror(errno)));
+    std::filesystem::path host = pattern;
+    enter_namespaces();
+    // the first child of a new PID namespace is its init, which /proc has to belong to
+    pid_t pid = fork();
+    if (pid == -1)
+      throw sys::system_error("Cannot fork. Error code: " + std::string(std::strerror(errno)));
+    if (pid == 0)
+    {
+      try
+      {
+        _exit(bench(host, options));
+      }
+      catch (const std::exception &e)
+      {
+        std::cerr << "Error: " << e.what() << std::endl;
+        _exit(1);
+      }
+    }
+    int result = sys::wait(pid);
+    std::filesystem::remove(host);
+    return result;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,666 @@
+#ifndef agent_hpp
+#define agent_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <functional>
+#include <condition_variable>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/config.hpp"
+#include "../interfaces/log.hpp"
+#include "inventory.hpp"
+#include "lazy.hpp"
+#include "tier.hpp"
+#include "data.hpp"
+
+// The agent, a long-running `successor agent` that answers queries from an inventory model kept in memory and
+// invalidated through inotify, and runs builds and removes as queued jobs, one at a time. Other successor
+// processes talk to it when it is running and work on their own otherwise.
+//
+// The protocol is line based over a Unix socket, so that the output of a job is forwarded as it is written, line
+// by line, without framing it. A request is a single line of space separated fields, in which backslashes,
+// spaces and newlines are escaped as \\, \s and \n. The reply is any number of data lines, each starting with
+// "> ", followed by "ok" or "error MESSAGE". Requests:
+//   list                      > IMAGE VERSION FLAGS, FLAGS being - or a comma separated subset of
+//                               current,next,archived,lazy, and > IMAGE - - for an image without versions
+//   current                   > IMAGE VERSION, unless the host runs no version of the inventory
+//   resolve IMAGE [VERSION]   > IMAGE VERSION
+//   logs [INDEX]              > LINE for every line of the log, the latest one by default
+//   job DIRECTORY ARGS...     queues `successor ARGS...`, ARGS starting with build or remove, run in DIRECTORY,
+//                             then streams > queued ID and its output, ending with its result
+//   follow ID                 streams the output of a job from its start, ending with its result
+//   jobs                      > ID STATE ARGS...
+namespace agent
+{
+  const std::filesystem::path SOCKET_PATH = "/succ/agent.sock";
+  // set in the agent, and inherited by its jobs, so that they do not queue themselves again
+  const char *DIRECT_ENV = "SUCCESSOR_NO_AGENT";
+  const size_t MAX_REQUEST = 1 << 16;
+
+  std::string escape(const std::string &field)
+  {
+    std::string escaped;
+    for (char c : field)
+      if (c == '\\')
+        escaped += "\\\\";
+      else if (c == ' ')
+        escaped += "\\s";
+      else if (c == '\n')
+        escaped += "\\n";
+      else
+        escaped += c;
+    return escaped;
+  }
+
+  std::string unescape(const std::string &field)
+  {
+    std::string unescaped;
+    for (size_t i = 0; i < field.size(); i++)
+      if (field[i] == '\\' && i + 1 < field.size())
+      {
+        char c = field[++i];
+        unescaped += c == 's' ? ' ' : c == 'n' ? '\n'
+                                                : c;
+      }
+      else
+        unescaped += field[i];
+    return unescaped;
+  }
+
+  std::vector<std::string> split(const std::string &line)
+  {
+    std::vector<std::string> fields;
+    if (line.empty())
+      return fields;
+    size_t start = 0;
+    for (size_t end = line.find(' '); end != std::string::npos; start = end + 1, end = line.find(' ', start))
+      fields.push_back(unescape(line.substr(start, end - start)));
+    fields.push_back(unescape(line.substr(start)));
+    return fields;
+  }
+
+  std::string join(const std::vector<std::string> &fields, size_t from = 0)
+  {
+    std::string line;
+    for (size_t i = from; i < fields.size(); i++)
+      line += (i > from ? " " : "") + escape(fields[i]);
+    return line;
+  }
+
+  // Writes the whole text, false once the peer is gone.
+  bool send_all(int fd, const std::string &text)
+  {
+    for (size_t sent = 0; sent < text.size();)
+    {
+      ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      sent += n;
+    }
+    return true;
+  }
+
+  class line_reader_t
+  {
+    int fd;
+    std::string buffer;
+
+  public:
+    line_reader_t(int fd) : fd(fd) {}
+
+    bool next(std::string &line)
+    {
+      while (true)
+      {
+        size_t end = buffer.find('\n');
+        if (end != std::string::npos)
+        {
+          line = buffer.substr(0, end);
+          buffer.erase(0, end + 1);
+          return true;
+        }
+        if (buffer.size() > MAX_REQUEST)
+          return false;
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+        {
+          // a last line without a newline, e.g. the output of a job that died
+          if (buffer.empty())
+            return false;
+          line = buffer;
+          buffer.clear();
+          return true;
+        }
+        buffer.append(chunk, n);
+      }
+    }
+  };
+
+  struct version_info_t
+  {
+    entity_t entity;
+    bool current = false;
+    bool next = false;
+    bool archived = false;
+    bool lazy = false;
+  };
+
+  struct image_info_t
+  {
+    std::string name;
+    std::vector<version_info_t> versions;
+  };
+
+  // What `successor list` shows of the inventory. Called with the inventory lock held.
+  std::vector<image_info_t> describe(const config_t &config)
+  {
+    std::vector<image_info_t> images;
+    if (!std::filesystem::exists(inventory::INVENTORY_PATH))
+      return images;
+    std::optional<entity_t> current = inventory::current(), next;
+    if (config.default_image_name.has_value())
+      next = inventory::resolve(config.default_image_name.value(), config.default_image_version.value_or(version_latest));
+    for (auto &image : inventory::list_images())
+    {
+      image_info_t info = {.name = image};
+      for (auto version : inventory::list_versions(image))
+      {
+        version_info_t v = {.entity = {.name = image, .version = version}};
+        v.current = current.has_value() && current.value() == v.entity;
+        v.next = next.has_value() && next.value() == v.entity;
+        v.archived = tier::is_archived(v.entity);
+        v.lazy = lazy::is_lazy(v.entity);
+        info.versions.push_back(v);
+      }
+      images.push_back(info);
+    }
+    return images;
+  }
+
+  // The data lines of a list reply, IMAGE - - for an image without versions.
+  std::string encode_list(const std::vector<image_info_t> &images)
+  {
+    std::string reply;
+    for (auto &image : images)
+    {
+      if (image.versions.empty())
+        reply += "> " + escape(image.name) + " - -\n";
+      for (auto &v : image.versions)
+      {
+        std::string flags;
+        for (auto &[flag, set] : std::vector<std::pair<std::string, bool>>{{"current", v.current}, {"next", v.next}, {"archived", v.archived}, {"lazy", v.lazy}})
+          if (set)
+            flags += (flags.empty() ? "" : ",") + flag;
+        reply += "> " + escape(image.name) + " " + std::to_string(v.entity.version) + " " + (flags.empty() ? "-" : flags) + "\n";
+      }
+    }
+    return reply;
+  }
+
+  // Adds a data line of a list reply to the images.
+  void decode_list(const std::vector<std::string> &fields, std::vector<image_info_t> &images)
+  {
+    if (fields.size() != 3)
+      throw std::runtime_error("Invalid list reply");
+    if (images.empty() || images.back().name != fields[0])
+      images.push_back({.name = fields[0]});
+    if (fields[1] == "-")
+      return;
+    version_info_t v = {.entity = {.name = fields[0], .version = std::stoi(fields[1])}};
+    std::string flags = "," + fields[2] + ",";
+    v.current = flags.find(",current,") != std::string::npos;
+    v.next = flags.find(",next,") != std::string::npos;
+    v.archived = flags.find(",archived,") != std::string::npos;
+    v.lazy = flags.find(",lazy,") != std::string::npos;
+    images.back().versions.push_back(v);
+  }
+
+  // Prints the images like `successor list`, with whatever extra prints at the end of every version line.
+  void print_list(const std::vector<image_info_t> &images, const std::function<void(const version_info_t &)> &extra = nullptr)
+  {
+    for (auto &image : images)
+    {
+      std::cout << "Image Name: " << image.name << std::endl;
+      for (auto &v : image.versions)
+      {
+        std::cout << "  Version: " << v.entity.version;
+        if (v.current)
+          std::cout << " (current)";
+        if (v.next)
+          std::cout << " (next)";
+        if (v.archived)
+          std::cout << " (archived)";
+        if (v.lazy)
+          std::cout << " (lazy)";
+        if (extra)
+          extra(v);
+        std::cout << std::endl;
+      }
+    }
+  }
+
+  // The version of the image a resolve request names, the latest one unless VERSION is given.
+  entity_t resolve(const std::vector<image_info_t> &images, const std::string &name, const std::string &version = "latest")
+  {
+    std::optional<int> found;
+    for (auto &image : images)
+      if (image.name == name)
+        for (auto &v : image.versions)
+          if (version == "latest" || std::to_string(v.entity.version) == version)
+            found = std::max(found.value_or(0), v.entity.version);
+    if (!found.has_value())
+      throw std::runtime_error("Image " + name + ":" + version + " does not exist");
+    return {.name = name, .version = found.value()};
+  }
+
+  enum job_state_t
+  {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_SUCCEEDED,
+    JOB_FAILED,
+  };
+
+  struct job_t
+  {
+    int id;
+    std::vector<std::string> args;
+    std::filesystem::path directory;
+    job_state_t state = JOB_QUEUED;
+    int exit_code = 0;
+    std::vector<std::string> output;
+  };
+
+  class server_t
+  {
+    // the inventory model, rebuilt on the first query after inotify reported a change
+    std::mutex model_mutex;
+    std::atomic<bool> dirty = true;
+    std::vector<image_info_t> images;
+    int inotify_fd = -1;
+    int config_watch = -1;
+
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_changed;
+    std::deque<std::shared_ptr<job_t>> jobs;
+    int next_job = 1;
+
+    int watch(const std::filesystem::path &path, uint32_t mask)
+    {
+      // watching a path twice just returns its watch
+      int wd = inotify_add_watch(inotify_fd, path.c_str(), mask);
+      if (wd == -1 && errno != ENOENT)
+        throw sys::system_error("Cannot watch " + path.string() + ". Error code: " + std::string(std::strerror(errno)));
+      return wd;
+    }
+
+    void rebuild()
+    {
+      config_t config = load_config();
+      inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+      if (std::filesystem::exists(inventory::INVENTORY_PATH))
+      {
+        watch(inventory::INVENTORY_PATH, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+        // archiving and rehydrating replace the version directory, so its markers need no watch of their own
+        for (auto &image : inventory::list_images())
+          watch(inventory::INVENTORY_PATH / image, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+      }
+      images = describe(config);
+    }
+
+    void watch_changes()
+    {
+      std::vector<char> buffer(64 << 10);
+      while (true)
+      {
+        ssize_t n = read(inotify_fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return;
+        for (ssize_t offset = 0; offset < n;)
+        {
+          auto *event = (inotify_event *)(buffer.data() + offset);
+          std::string name = event->len ? event->name : "";
+          // the parent of the inventory is only watched for the config and the inventory itself appearing, an
+          // overflow may have lost anything
+          bool relevant = event->wd != config_watch || name == CONFIG_PATH.filename().string() ||
+                          name == inventory::INVENTORY_PATH.filename().string();
+          if (event->mask & IN_Q_OVERFLOW || (relevant && !(event->mask & IN_IGNORED)))
+            dirty = true;
+          offset += sizeof(inotify_event) + event->len;
+        }
+      }
+    }
+
+    std::vector<image_info_t> snapshot()
+    {
+      std::lock_guard<std::mutex> lock(model_mutex);
+      // cleared first, so that a change during the rebuild triggers another one
+      if (dirty.exchange(false))
+        try
+        {
+          rebuild();
+        }
+        catch (...)
+        {
+          dirty = true;
+          throw;
+        }
+      return images;
+    }
+
+    void work()
+    {
+      while (true)
+      {
+        std::shared_ptr<job_t> job;
+        {
+          std::unique_lock<std::mutex> lock(jobs_mutex);
+          jobs_changed.wait(lock, [&]()
+                            { return std::any_of(jobs.begin(), jobs.end(), [](auto &job)
+                                                 { return job->state == JOB_QUEUED; }); });
+          job = *std::find_if(jobs.begin(), jobs.end(), [](auto &job)
+                              { return job->state == JOB_QUEUED; });
+          job->state = JOB_RUNNING;
+        }
+        jobs_changed.notify_all();
+
+        int exit_code = 1;
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0)
+          append(job, std::string("Cannot create pipe: ") + std::strerror(errno));
+        else
+          try
+          {
+            std::vector<std::string> command = {"/proc/self/exe"};
+            command.insert(command.end(), job->args.begin(), job->args.end());
+            pid_t pid = sys::spawn(command, -1, fds[1], job->directory.string());
+            close(fds[1]);
+            line_reader_t reader(fds[0]);
+            std::string line;
+            while (reader.next(line))
+              append(job, line);
+            close(fds[0]);
+            exit_code = sys::wait(pid);
+          }
+          catch (const std::exception &e)
+          {
+            close(fds[0]);
+            append(job, e.what());
+          }
+
+        {
+          std::lock_guard<std::mutex> lock(jobs_mutex);
+          job->exit_code = exit_code;
+          job->state = exit_code == 0 ? JOB_SUCCEEDED : JOB_FAILED;
+          // finished jobs are kept for a while, for those following them late
+          while (jobs.size() > 64 && jobs.front()->state >= JOB_SUCCEEDED)
+            jobs.pop_front();
+        }
+        jobs_changed.notify_all();
+      }
+    }
+
+    void append(const std::shared_ptr<job_t> &job, const std::string &line)
+    {
+      {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        job->output.push_back(line);
+      }
+      jobs_changed.notify_all();
+    }
+
+    // Streams the output of the job until it is done and returns the final line.
+    std::string follow(int fd, const std::shared_ptr<job_t> &job)
+    {
+      size_t sent = 0;
+      while (true)
+      {
+        std::vector<std::string> lines;
+        bool done;
+        {
+          std::unique_lock<std::mutex> lock(jobs_mutex);
+          jobs_changed.wait(lock, [&]()
+                            { return job->output.size() > sent || job->state >= JOB_SUCCEEDED; });
+          lines.assign(job->output.begin() + sent, job->output.end());
+          sent = job->output.size();
+          done = job->state >= JOB_SUCCEEDED && lines.empty();
+        }
+        if (done)
+          break;
+        std::string text;
+        for (auto &line : lines)
+          text += "> " + escape(line) + "\n";
+        if (!send_all(fd, text))
+          return "";
+      }
+      if (job->state == JOB_SUCCEEDED)
+        return "ok";
+      return "error Job " + std::to_string(job->id) + " failed with exit code " + std::to_string(job->exit_code);
+    }
+
+    // Answers the request, returning the final line.
+    std::string answer(int fd, const std::vector<std::string> &request)
+    {
+      if (request.empty())
+        throw std::runtime_error("Empty request");
+      const std::string &command = request[0];
+      std::string reply;
+
+      if (command == "list" || command == "current" || command == "resolve")
+      {
+        auto images = snapshot();
+        if (command == "list")
+          reply = encode_list(images);
+        else if (command == "current")
+        {
+          for (auto &image : images)
+            for (auto &v : image.versions)
+              if (v.current)
+                reply += "> " + escape(image.name) + " " + std::to_string(v.entity.version) + "\n";
+        }
+        else
+        {
+          if (request.size() < 2 || !std::regex_match(request[1], image_name_regex()))
+            throw std::runtime_error("Invalid image name");
+          entity_t entity = resolve(images, request[1], request.size() > 2 ? request[2] : "latest");
+          reply += "> " + escape(entity.name) + " " + std::to_string(entity.version) + "\n";
+        }
+      }
+      else if (command == "logs")
+      {
+        std::ifstream is = logging::read_log(request.size() > 1 ? std::stoi(request[1]) - 1 : 0);
+        std::string line;
+        while (std::getline(is, line))
+          reply += "> " + escape(line) + "\n";
+      }
+      else if (command == "jobs")
+      {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        const char *states[] = {"queued", "running", "succeeded", "failed"};
+        for (auto &job : jobs)
+          reply += "> " + std::to_string(job->id) + " " + states[job->state] + " " + join(job->args) + "\n";
+      }
+      else if (command == "job")
+      {
+        if (request.size() < 3 || (request[2] != "build" && request[2] != "remove"))
+          throw std::runtime_error("Only build and remove run as jobs");
+        auto job = std::make_shared<job_t>();
+        job->directory = request[1];
+        job->args.assign(request.begin() + 2, request.end());
+        {
+          std::lock_guard<std::mutex> lock(jobs_mutex);
+          job->id = next_job++;
+          jobs.push_back(job);
+        }
+        jobs_changed.notify_all();
+        if (!send_all(fd, "> queued " + std::to_string(job->id) + "\n"))
+          return "";
+        return follow(fd, job);
+      }
+      else if (command == "follow")
+      {
+        if (request.size() < 2)
+          throw std::runtime_error("No job specified");
+        std::shared_ptr<job_t> job;
+        {
+          std::lock_guard<std::mutex> lock(jobs_mutex);
+          for (auto &candidate : jobs)
+            if (std::to_string(candidate->id) == request[1])
+              job = candidate;
+        }
+        if (!job)
+          throw std::runtime_error("Unknown job " + request[1]);
+        return follow(fd, job);
+      }
+      else
+        throw std::runtime_error("Unknown request " + command);
+
+      if (!send_all(fd, reply))
+        return "";
+      return "ok";
+    }
+
+    void serve(int fd)
+    {
+      line_reader_t reader(fd);
+      std::string line;
+      if (reader.next(line))
+      {
+        std::string status;
+        try
+        {
+          status = answer(fd, split(line));
+        }
+        catch (const std::exception &e)
+        {
+          status = "error " + escape(e.what());
+        }
+        if (!status.empty())
+          send_all(fd, status + "\n");
+      }
+      close(fd);
+    }
+
+  public:
+    // Serves until the process is killed.
+    void run()
+    {
+      setenv(DIRECT_ENV, "1", 1);
+      inotify_fd = inotify_init1(IN_CLOEXEC);
+      if (inotify_fd == -1)
+        throw sys::system_error("Cannot initialize inotify. Error code: " + std::string(std::strerror(errno)));
+      // the config lives next to the inventory
+      config_watch = watch(CONFIG_PATH.parent_path(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+
+      int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listener == -1)
+        throw sys::system_error("Cannot create socket. Error code: " + std::string(std::strerror(errno)));
+      sockaddr_un address = {.sun_family = AF_UNIX};
+      std::strncpy(address.sun_path, SOCKET_PATH.c_str(), sizeof(address.sun_path) - 1);
+      if (connect(listener, (sockaddr *)&address, sizeof(address)) == 0)
+        throw std::runtime_error("Another agent is listening on " + SOCKET_PATH.string());
+      // left behind by an agent that was killed
+      std::filesystem::remove(SOCKET_PATH);
+      if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || chmod(SOCKET_PATH.c_str(), 0600) != 0 || listen(listener, 64) != 0)
+        throw sys::system_error("Cannot listen on " + SOCKET_PATH.string() + ". Error code: " + std::string(std::strerror(errno)));
+
+      std::thread([this]()
+                  { watch_changes(); })
+          .detach();
+      std::thread([this]()
+                  { work(); })
+          .detach();
+      std::cout << "Listening on " << SOCKET_PATH.string() << std::endl;
+      while (true)
+      {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+            continue;
+          throw sys::system_error("Cannot accept connection. Error code: " + std::string(std::strerror(errno)));
+        }
+        std::thread([this, fd]()
+                    { serve(fd); })
+            .detach();
+      }
+    }
+  };
+
+  class client_t
+  {
+    int fd;
+
+  public:
+    client_t(int fd) : fd(fd) {}
+    client_t(const client_t &) = delete;
+    client_t &operator=(const client_t &) = delete;
+
+    ~client_t()
+    {
+      close(fd);
+    }
+
+    // Sends the request and calls on_line with the fields of every data line of the reply. Throws the error of
+    // the agent.
+    void request(const std::vector<std::string> &fields, const std::function<void(const std::vector<std::string> &)> &on_line)
+    {
+      if (!send_all(fd, join(fields) + "\n"))
+        throw sys::system_error("Cannot talk to the agent. Error code: " + std::string(std::strerror(errno)));
+      line_reader_t reader(fd);
+      std::string line;
+      while (reader.next(line))
+      {
+        if (line.rfind("> ", 0) == 0)
+          on_line(split(line.substr(2)));
+        else if (line == "ok")
+          return;
+        else if (line.rfind("error ", 0) == 0)
+          throw std::runtime_error(unescape(line.substr(6)));
+      }
+      throw std::runtime_error("The agent closed the connection");
+    }
+  };
+
+  // The agent, if one is running and this process is not one of its jobs.
+  std::unique_ptr<client_t> connect()
+  {
+    if (getenv(DIRECT_ENV) != nullptr)
+      return nullptr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return nullptr;
+    sockaddr_un address = {.sun_family = AF_UNIX};
+    std::strncpy(address.sun_path, SOCKET_PATH.c_str(), sizeof(address.sun_path) - 1);
+    if (::connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+      close(fd);
+      return nullptr;
+    }
+    return std::make_unique<client_t>(fd);
+  }
+}
+
+#endif
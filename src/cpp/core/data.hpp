@@ -25,8 +25,18 @@ struct entity_t
   {
     return !(*this == other);
   }
+
+  bool operator<(const entity_t &other) const
+  {
+    return name < other.name || (name == other.name && version < other.version);
+  }
 };
 
-const std::regex IMAGE_NAME_REGEX("^[a-zA-Z0-9_-]+$");
+// built on first use rather than during static initialization, which successor-init cannot afford
+const std::regex &image_name_regex()
+{
+  static const std::regex regex("^[a-zA-Z0-9_-]+$");
+  return regex;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,252 @@
+#ifndef delta_hpp
+#define delta_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <regex>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <filesystem>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../interfaces/system.hpp"
+#include "inventory.hpp"
+#include "manifest.hpp"
+#include "lazy.hpp"
+#include "tier.hpp"
+#include "data.hpp"
+
+// A delta pack is a zstd compressed tar archive holding the added and modified files of the target version,
+// at their own paths, plus a .succ-delta directory with:
+//   base      the image name and version the pack applies to
+//   manifest  the full manifest of the target version
+//   changed   the paths of added and modified entries
+//   removed   the paths that exist in the base but not in the target
+namespace delta
+{
+  const std::string DELTA_DIR = ".succ-delta";
+
+  void write_paths(const std::vector<std::string> &paths, const std::filesystem::path &file)
+  {
+    std::ofstream os(file);
+    for (auto &p : paths)
+      os << manifest::escape(p) << "\n";
+  }
+
+  // The path of a pack entry, refused unless it is relative and free of `..`, so that a crafted pack cannot
+  // remove or write files of the host.
+  std::filesystem::path relative_path(const std::string &p)
+  {
+    std::filesystem::path relative = std::filesystem::path(p).lexically_normal();
+    bool valid = !p.empty() && relative.is_relative() && !relative.empty() && relative != ".";
+    for (auto &component : relative)
+      valid = valid && component != "..";
+    if (!valid)
+      throw std::runtime_error("Invalid path in delta pack: " + p);
+    return relative;
+  }
+
+  // Refuses the path if one of its existing parents below root is a symlink or not a directory, as following it
+  // would leave the root.
+  void check_parents(const std::filesystem::path &root, const std::filesystem::path &relative)
+  {
+    std::filesystem::path parent = root;
+    for (auto &component : relative.parent_path())
+    {
+      parent /= component;
+      struct stat st;
+      if (lstat(parent.c_str(), &st) == 0 && !S_ISDIR(st.st_mode))
+        throw std::runtime_error("Delta pack entry " + relative.string() + " is below a non-directory");
+    }
+  }
+
+  std::vector<std::string> read_paths(const std::filesystem::path &file)
+  {
+    std::vector<std::string> paths;
+    std::ifstream is(file);
+    std::string line;
+    while (std::getline(is, line))
+      paths.push_back(manifest::unescape(line));
+    return paths;
+  }
+
+  // Streams the delta pack from `from` to `to` to the standard output. Both must be rehydrated.
+  void create(entity_t from, entity_t to)
+  {
+    for (auto &entity : {from, to})
+    {
+      if (!std::filesystem::exists(inventory::path(entity)))
+        throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " does not exist");
+      if (lazy::is_lazy(entity))
+        throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " is lazy, its files are in its blob store");
+    }
+    if (!sys::binary_exists("zstd"))
+      throw std::runtime_error("Cannot find zstd. Install it to create delta packs");
+
+    // stored manifests are streamed, versions built before manifests existed are scanned instead
+    std::ifstream files[2];
+    std::vector<manifest::entry_t> scanned[2];
+    manifest::source_t sources[2];
+    for (int i = 0; i < 2; i++)
+    {
+      entity_t entity = i == 0 ? from : to;
+      files[i].open(inventory::manifest_path(entity));
+      if (files[i].is_open())
+        sources[i] = manifest::from_stream(files[i]);
+      else
+      {
+        scanned[i] = manifest::generate(inventory::path(entity));
+        sources[i] = manifest::from_vector(scanned[i]);
+      }
+    }
+
+    std::vector<std::string> changed, removed;
+    uint64_t changed_bytes = 0;
+    manifest::diff(
+        sources[0], sources[1],
+        [&](const manifest::entry_t &e)
+        { changed.push_back(e.path); changed_bytes += e.size; },
+        [&](const manifest::entry_t &e)
+        { removed.push_back(e.path); },
+        [&](const manifest::entry_t &, const manifest::entry_t &e)
+        { changed.push_back(e.path); changed_bytes += e.size; });
+
+    std::filesystem::path meta = inventory::stage("delta");
+    try
+    {
+      std::filesystem::create_directory(meta / DELTA_DIR);
+      std::ofstream(meta / DELTA_DIR / "base") << from.name << " " << from.version << "\n";
+      if (files[1].is_open())
+        std::filesystem::copy_file(inventory::manifest_path(to), meta / DELTA_DIR / "manifest");
+      else
+      {
+        std::ofstream os(meta / DELTA_DIR / "manifest");
+        manifest::write(scanned[1], os);
+      }
+      write_paths(changed, meta / DELTA_DIR / "changed");
+      write_paths(removed, meta / DELTA_DIR / "removed");
+      {
+        std::ofstream os(meta / "members", std::ios::binary);
+        for (auto &p : changed)
+          os << p << '\0';
+      }
+
+      std::cerr << changed.size() << " changed entries (" << changed_bytes << " bytes), " << removed.size() << " removed entries" << std::endl;
+      if (sys::execute_pipeline({{"tar", "--xattrs", "--xattrs-include=*", "--acls", "--numeric-owner", "-cf", "-",
+                                  "-C", meta.string(), DELTA_DIR,
+                                  "-C", inventory::path(to).string(), "--no-recursion", "--null", "-T", (meta / "members").string()},
+                                 {"zstd", "-T0", "-q", "-c"}}) != 0)
+        throw std::runtime_error("Cannot write delta pack");
+    }
+    catch (const std::exception &e)
+    {
+      std::filesystem::remove_all(meta);
+      throw;
+    }
+    std::filesystem::remove_all(meta);
+  }
+
+  // Reads a delta pack from the standard input, reconstructs the target version on top of a clone of the base
+  // version, verifies it against the target manifest and publishes it as the next version of the image.
+  entity_t apply(std::optional<std::string> image)
+  {
+    if (!sys::binary_exists("zstd"))
+      throw std::runtime_error("Cannot find zstd. Install it to apply delta packs");
+
+    std::filesystem::path pack = inventory::stage("delta-pack");
+    std::filesystem::path data = pack / "data", target = pack / "target";
+    try
+    {
+      std::filesystem::create_directory(data);
+      if (sys::execute_pipeline({{"zstd", "-d", "-q", "-c"},
+                                 {"tar", "--xattrs", "--xattrs-include=*", "--acls", "--numeric-owner", "--same-owner", "-C", data.string(), "-xf", "-"}}) != 0)
+        throw std::runtime_error("Cannot read delta pack");
+
+      entity_t base;
+      // the name becomes a path under the inventory, so it must not be able to leave it
+      if (!(std::ifstream(data / DELTA_DIR / "base") >> base.name >> base.version) ||
+          !std::regex_match(base.name, image_name_regex()) || base.version < 1)
+        throw std::runtime_error("Invalid delta pack");
+      base.name = image.value_or(base.name);
+      if (!std::filesystem::exists(inventory::path(base)))
+        throw std::runtime_error("Base image " + base.name + ":" + std::to_string(base.version) + " does not exist");
+      if (lazy::is_lazy(base))
+        throw std::runtime_error("Base image " + base.name + ":" + std::to_string(base.version) + " is lazy, its files are in its blob store");
+      tier::rehydrate(base);
+
+      std::cout << "Cloning base image " << base.name << ":" << base.version << std::endl;
+      inventory::clone(base, target);
+
+      auto removed = read_paths(data / DELTA_DIR / "removed");
+      auto changed = read_paths(data / DELTA_DIR / "changed");
+      // all of them before touching anything
+      for (auto &p : removed)
+        relative_path(p);
+      for (auto &p : changed)
+        relative_path(p);
+
+      // children come after their parents, so walking backwards never removes a directory before its content
+      for (auto it = removed.rbegin(); it != removed.rend(); it++)
+      {
+        std::filesystem::path relative = relative_path(*it);
+        check_parents(target, relative);
+        std::filesystem::remove_all(target / relative);
+      }
+
+      for (auto &p : changed)
+      {
+        std::filesystem::path relative = relative_path(p);
+        check_parents(data, relative);
+        check_parents(target, relative);
+        std::filesystem::path source = data / relative, dest = target / relative;
+        auto status = std::filesystem::symlink_status(source);
+        if (std::filesystem::is_directory(status))
+        {
+          if (!std::filesystem::is_directory(std::filesystem::symlink_status(dest)))
+          {
+            std::filesystem::remove_all(dest);
+            std::filesystem::create_directory(dest);
+          }
+          struct stat st;
+          if (lstat(source.c_str(), &st) != 0 || chmod(dest.c_str(), st.st_mode & 07777) != 0 || lchown(dest.c_str(), st.st_uid, st.st_gid) != 0)
+            throw sys::system_error("Cannot update directory " + p + ". Error code: " + std::string(std::strerror(errno)));
+        }
+        else
+        {
+          std::filesystem::remove_all(dest);
+          std::filesystem::rename(source, dest);
+        }
+      }
+
+      std::cout << "Verifying " << changed.size() << " changed and " << removed.size() << " removed entries" << std::endl;
+      std::ifstream is(data / DELTA_DIR / "manifest");
+      auto expected = manifest::read(is);
+      std::set<std::string> to_hash(changed.begin(), changed.end());
+      auto actual = manifest::generate(target, &to_hash);
+      std::vector<std::string> mismatches;
+      auto mismatch = [&mismatches](const manifest::entry_t &e)
+      { mismatches.push_back(e.path); };
+      manifest::diff(expected, actual, mismatch, mismatch, [&mismatch](const manifest::entry_t &, const manifest::entry_t &e)
+                     { mismatch(e); });
+      if (!mismatches.empty())
+        throw std::runtime_error("Applied image does not match the target manifest, first mismatch: " + mismatches.front());
+
+      // verified above, so it describes the published version
+      entity_t entity = inventory::publish(target, base.name, expected);
+      std::filesystem::remove_all(pack);
+      return entity;
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(target))
+        inventory::destroy(target);
+      std::filesystem::remove_all(pack);
+      throw;
+    }
+  }
+}
+
+#endif
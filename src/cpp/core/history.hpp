@@ -0,0 +1,250 @@
+#ifndef history_hpp
+#define history_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <ctime>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "data.hpp"
+
+// Append-only boot history. Every boot adds a line
+//   B TIMESTAMP BOOT NAME VERSION SWITCH_US EXEC_US
+// and, once the readiness marker shows up, a line
+//   R BOOT READY_US
+// referring to the boot with the same BOOT id, and a line with the duration of every switch phase
+//   P BOOT PHASE=US...
+// BOOT is the kernel boot id and the microseconds since the kernel booted, unique even for soft switches that
+// keep the kernel. Lines written before boot ids existed use the timestamp in their place.
+// A switch that failed and was rolled back adds
+//   F TIMESTAMP NAME VERSION
+// Lines are written with a single O_APPEND write, so concurrent writers never interleave.
+namespace history
+{
+  const std::filesystem::path HISTORY_PATH = "/succ/history";
+  const std::filesystem::path KERNEL_BOOT_ID_PATH = "/proc/sys/kernel/random/boot_id";
+  const int DEFAULT_READY_TIMEOUT = 300;
+  const int DEFAULT_REGRESSION_THRESHOLD = 20;
+
+  // taken during static initialization, as close to the process start as we can get
+  const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+
+  struct record_t
+  {
+    int64_t timestamp;
+    std::string boot;
+    std::string name;
+    int version;
+    int64_t switch_us;
+    int64_t exec_us;
+    std::optional<int64_t> ready_us;
+  };
+
+  struct summary_t
+  {
+    size_t boots;
+    int64_t switch_us;
+    int64_t exec_us;
+    std::optional<int64_t> ready_us;
+  };
+
+  int64_t since_start_us()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - process_start).count();
+  }
+
+  std::string boot_id()
+  {
+    std::string kernel = "-";
+    std::ifstream(KERNEL_BOOT_ID_PATH) >> kernel;
+    struct timespec since_boot;
+    clock_gettime(CLOCK_BOOTTIME, &since_boot);
+    return kernel + "." + std::to_string(int64_t(since_boot.tv_sec) * 1000000 + since_boot.tv_nsec / 1000);
+  }
+
+  void append_line(const std::string &line, const std::filesystem::path &path = HISTORY_PATH)
+  {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+      throw std::runtime_error("Cannot open boot history. Error code: " + std::string(std::strerror(errno)));
+    ssize_t written = write(fd, line.data(), line.size());
+    close(fd);
+    if (written != (ssize_t)line.size())
+      throw std::runtime_error("Cannot write boot history");
+  }
+
+  void append(const record_t &record, const std::filesystem::path &path = HISTORY_PATH)
+  {
+    append_line("B " + std::to_string(record.timestamp) + " " + record.boot + " " + record.name + " " + std::to_string(record.version) + " " +
+                    std::to_string(record.switch_us) + " " + std::to_string(record.exec_us) + "\n",
+                path);
+  }
+
+  void append_phases(const std::string &boot, const std::vector<std::pair<std::string, int64_t>> &phases, const std::filesystem::path &path = HISTORY_PATH)
+  {
+    std::string line = "P " + boot;
+    for (auto &[phase, us] : phases)
+      line += " " + phase + "=" + std::to_string(us);
+    append_line(line + "\n", path);
+  }
+
+  void append_failure(int64_t timestamp, const std::string &name, int version, const std::filesystem::path &path = HISTORY_PATH)
+  {
+    append_line("F " + std::to_string(timestamp) + " " + name + " " + std::to_string(version) + "\n", path);
+  }
+
+  // Forks a detached process that waits up to timeout seconds for the marker to appear and records the time
+  // it took, measured from the process start.
+  void watch_readiness(const std::string &boot, std::filesystem::path marker, int timeout, const std::filesystem::path &path = HISTORY_PATH)
+  {
+    pid_t pid = fork();
+    if (pid != 0)
+      return;
+
+    setsid();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+      if (access(marker.c_str(), F_OK) == 0)
+      {
+        try
+        {
+          append_line("R " + boot + " " + std::to_string(since_start_us()) + "\n", path);
+        }
+        catch (...)
+        {
+        }
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    _exit(0);
+  }
+
+  std::vector<record_t> load(const std::filesystem::path &path = HISTORY_PATH)
+  {
+    std::vector<record_t> records;
+    std::map<std::string, size_t> by_boot;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream is(line);
+      std::string kind;
+      std::vector<std::string> fields;
+      is >> kind;
+      for (std::string field; is >> field;)
+        fields.push_back(field);
+      if (kind == "B" && (fields.size() == 5 || fields.size() == 6))
+      {
+        // without a boot id, the timestamp stands in for it
+        if (fields.size() == 5)
+          fields.insert(fields.begin() + 1, fields[0]);
+        try
+        {
+          record_t record = {.timestamp = std::stoll(fields[0]), .boot = fields[1], .name = fields[2], .version = std::stoi(fields[3]),
+                             .switch_us = std::stoll(fields[4]), .exec_us = std::stoll(fields[5])};
+          by_boot[record.boot] = records.size();
+          records.push_back(record);
+        }
+        catch (const std::exception &e)
+        {
+          // a line cut short by a crash
+        }
+      }
+      else if (kind == "R" && fields.size() == 2 && by_boot.count(fields[0]))
+        try
+        {
+          records[by_boot[fields[0]]].ready_us = std::stoll(fields[1]);
+        }
+        catch (const std::exception &e)
+        {
+        }
+    }
+    return records;
+  }
+
+  // The phases of the last switch that recorded them.
+  std::vector<std::pair<std::string, int64_t>> last_phases(const std::filesystem::path &path = HISTORY_PATH)
+  {
+    std::vector<std::pair<std::string, int64_t>> phases;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      if (line.rfind("P ", 0) != 0)
+        continue;
+      phases.clear();
+      std::istringstream is(line.substr(2));
+      std::string field;
+      is >> field; // boot
+      while (is >> field)
+        if (field.find('=') != std::string::npos)
+          phases.push_back({field.substr(0, field.find('=')), std::stoll(field.substr(field.find('=') + 1))});
+    }
+    return phases;
+  }
+
+  size_t count_failures(const std::filesystem::path &path = HISTORY_PATH)
+  {
+    size_t failures = 0;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+      if (line.rfind("F ", 0) == 0)
+        failures++;
+    return failures;
+  }
+
+  int64_t median(std::vector<int64_t> values)
+  {
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+  }
+
+  // Per version medians of the boots of an image.
+  std::map<int, summary_t> summarize(const std::vector<record_t> &records, const std::string &image)
+  {
+    std::map<int, std::vector<const record_t *>> by_version;
+    for (auto &record : records)
+      if (record.name == image)
+        by_version[record.version].push_back(&record);
+
+    std::map<int, summary_t> summaries;
+    for (auto &[version, boots] : by_version)
+    {
+      std::vector<int64_t> switches, execs, readies;
+      for (auto *boot : boots)
+      {
+        switches.push_back(boot->switch_us);
+        execs.push_back(boot->exec_us);
+        if (boot->ready_us.has_value())
+          readies.push_back(boot->ready_us.value());
+      }
+      summaries[version] = {.boots = boots.size(), .switch_us = median(switches), .exec_us = median(execs),
+                            .ready_us = readies.empty() ? std::nullopt : std::make_optional(median(readies))};
+    }
+    return summaries;
+  }
+
+  // The boot times to compare two versions by: readiness if both know it, otherwise the time until the init is
+  // executed.
+  std::pair<int64_t, int64_t> boot_times(const summary_t &before, const summary_t &now)
+  {
+    if (before.ready_us.has_value() && now.ready_us.has_value())
+      return {before.ready_us.value(), now.ready_us.value()};
+    return {before.exec_us, now.exec_us};
+  }
+}
+
+#endif
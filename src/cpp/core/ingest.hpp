@@ -0,0 +1,532 @@
+#ifndef ingest_hpp
+#define ingest_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <iostream>
+#include <functional>
+#include <filesystem>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/parallel.hpp"
+#include "../interfaces/tar.hpp"
+#include "inventory.hpp"
+#include "manifest.hpp"
+#include "data.hpp"
+
+// Builds an image from the tar stream of a container builder in a single pass. Three threads connected by
+// bounded queues parse the archive, hash the file contents and write the tree, so every byte of the image is
+// read from the pipe and written to the disk exactly once, and the manifest comes out of the same pass.
+// Files whose content was already written are cloned instead where the filesystem supports reflinks.
+namespace ingest
+{
+  const size_t CHUNK_SIZE = 1 << 20;
+  const size_t QUEUE_DEPTH = 16;
+  // files up to this size are hashed before they are written, so that duplicates are never written at all
+  const uint64_t INLINE_LIMIT = 1 << 20;
+
+  enum item_kind_t
+  {
+    ITEM_BEGIN, // an entry, carrying the whole content of inline files
+    ITEM_DATA,  // a chunk of the content of the current file
+    ITEM_END,   // the end of the current file, carrying its hash
+  };
+
+  struct item_t
+  {
+    item_kind_t kind;
+    tar::header_t header;
+    std::string data;
+    bool inline_content = false;
+    std::string hash;
+  };
+
+  struct result_t
+  {
+    std::vector<manifest::entry_t> manifest;
+    size_t files = 0;
+    uint64_t bytes = 0;
+    size_t cloned = 0;
+    uint64_t cloned_bytes = 0;
+  };
+
+  // Makes an archive path relative to the root, rejecting anything that could escape it. The root itself is "".
+  std::string normalize(const std::string &name)
+  {
+    std::string result;
+    size_t start = 0;
+    while (start <= name.size())
+    {
+      size_t end = name.find('/', start);
+      if (end == std::string::npos)
+        end = name.size();
+      std::string component = name.substr(start, end - start);
+      if (component == "..")
+        throw std::runtime_error("Archive entry " + name + " escapes the image root");
+      if (!component.empty() && component != ".")
+        result += (result.empty() ? "" : "/") + component;
+      start = end + 1;
+    }
+    return result;
+  }
+
+  class writer_t
+  {
+    std::filesystem::path root;
+    // directories known to be real directories below the root, so that their parents need no more checks
+    std::set<std::string> directories;
+    std::vector<std::pair<std::string, tar::header_t>> deferred;
+    std::unordered_map<std::string, std::string> written; // hash and size of written contents, to their path
+    bool reflink = true;
+
+    int fd = -1;
+    std::string current;
+    tar::header_t current_header;
+
+  public:
+    std::map<std::string, std::string> hashes;
+    result_t result;
+
+  private:
+    void fail(const std::string &action, const std::string &relative)
+    {
+      throw sys::system_error("Cannot " + action + " " + relative + ". Error code: " + std::string(std::strerror(errno)));
+    }
+
+    // Creates the missing parents of the entry and makes sure that none of them is a symlink, which would let
+    // the archive write outside of the root.
+    void prepare_parents(const std::string &relative)
+    {
+      size_t slash = 0;
+      while ((slash = relative.find('/', slash)) != std::string::npos)
+      {
+        std::string dir = relative.substr(0, slash++);
+        if (directories.count(dir))
+          continue;
+        struct stat st;
+        std::filesystem::path full = root / dir;
+        if (lstat(full.c_str(), &st) == 0)
+        {
+          if (!S_ISDIR(st.st_mode))
+            throw std::runtime_error("Archive entry " + relative + " is below a non-directory");
+        }
+        else if (mkdir(full.c_str(), 0755) != 0)
+          fail("create directory", dir);
+        directories.insert(dir);
+      }
+    }
+
+    // Removes whatever an earlier entry left at the path, later entries win like in tar.
+    void clear(const std::string &relative)
+    {
+      struct stat st;
+      std::filesystem::path full = root / relative;
+      if (lstat(full.c_str(), &st) != 0)
+        return;
+      if (S_ISDIR(st.st_mode))
+      {
+        std::filesystem::remove_all(full);
+        directories.clear();
+      }
+      else if (unlink(full.c_str()) != 0)
+        fail("replace", relative);
+    }
+
+    void set_xattrs(const std::filesystem::path &full, const tar::header_t &header, int file = -1)
+    {
+      for (auto &[name, value] : header.xattrs)
+      {
+        int result = file != -1 ? fsetxattr(file, name.c_str(), value.data(), value.size(), 0)
+                                : lsetxattr(full.c_str(), name.c_str(), value.data(), value.size(), 0);
+        // e.g. security.selinux on a host without SELinux
+        if (result != 0 && errno != ENOTSUP)
+          fail("set extended attribute " + name + " of", full.lexically_relative(root).string());
+      }
+    }
+
+    void set_metadata(const std::string &relative, const tar::header_t &header)
+    {
+      std::filesystem::path full = root / relative;
+      struct timespec times[2] = {{header.mtime, 0}, {header.mtime, 0}};
+      if (lchown(full.c_str(), header.uid, header.gid) != 0)
+        fail("change the owner of", relative);
+      if (header.type != tar::TYPE_SYMLINK && chmod(full.c_str(), header.mode) != 0)
+        fail("change the mode of", relative);
+      set_xattrs(full, header);
+      if (utimensat(AT_FDCWD, full.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+        fail("change the modification time of", relative);
+    }
+
+    void open_file(const std::string &relative)
+    {
+      prepare_parents(relative);
+      clear(relative);
+      fd = open((root / relative).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if (fd == -1)
+        fail("create", relative);
+      current = relative;
+    }
+
+    void write_data(const std::string &data)
+    {
+      size_t done = 0;
+      while (done < data.size())
+      {
+        ssize_t count = ::write(fd, data.data() + done, data.size() - done);
+        if (count == -1 && errno == EINTR)
+          continue;
+        if (count == -1)
+          fail("write", current);
+        done += count;
+      }
+      result.bytes += data.size();
+    }
+
+    // Shares the extents of an identical file written earlier instead of writing the data again.
+    bool clone_data(const std::string &key)
+    {
+      auto it = written.find(key);
+      if (!reflink || it == written.end())
+        return false;
+      int source = open((root / it->second).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (source == -1)
+        return false;
+      bool cloned = ioctl(fd, FICLONE, source) == 0;
+      if (!cloned && (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY))
+        reflink = false;
+      close(source);
+      return cloned;
+    }
+
+    void close_file(const tar::header_t &header, const std::string &hash)
+    {
+      struct timespec times[2] = {{header.mtime, 0}, {header.mtime, 0}};
+      if (fchown(fd, header.uid, header.gid) != 0 || fchmod(fd, header.mode) != 0)
+        fail("change the owner and mode of", current);
+      set_xattrs(root / current, header, fd);
+      if (futimens(fd, times) != 0)
+        fail("change the modification time of", current);
+      if (close(fd) != 0)
+        fail("close", current);
+      fd = -1;
+
+      hashes[current] = hash;
+      written.emplace(hash + ":" + std::to_string(header.size), current);
+      result.files++;
+    }
+
+    void write_entry(const std::string &relative, const tar::header_t &header)
+    {
+      std::filesystem::path full = root / relative;
+      if (header.type == tar::TYPE_DIRECTORY)
+      {
+        if (!relative.empty())
+        {
+          prepare_parents(relative);
+          struct stat st;
+          if (lstat(full.c_str(), &st) == 0 && !S_ISDIR(st.st_mode))
+            clear(relative);
+          if (lstat(full.c_str(), &st) != 0 && mkdir(full.c_str(), 0700) != 0)
+            fail("create directory", relative);
+          directories.insert(relative);
+        }
+        // creating the content would change the modification time again
+        deferred.emplace_back(relative, header);
+        return;
+      }
+
+      if (relative.empty())
+        throw std::runtime_error("Archive replaces the image root with a non-directory");
+      prepare_parents(relative);
+      clear(relative);
+      if (header.type == tar::TYPE_HARDLINK)
+      {
+        std::string target = normalize(header.link);
+        prepare_parents(target);
+        if (link((root / target).c_str(), full.c_str()) != 0)
+          fail("create hardlink", relative);
+        if (hashes.count(target))
+          hashes[relative] = hashes[target];
+        return;
+      }
+      if (header.type == tar::TYPE_SYMLINK)
+      {
+        if (symlink(header.link.c_str(), full.c_str()) != 0)
+          fail("create symlink", relative);
+        manifest::hasher_t hasher;
+        hasher.update(header.link.data(), header.link.size());
+        hashes[relative] = hasher.digest();
+      }
+      else
+      {
+        mode_t kind = header.type == tar::TYPE_CHAR ? S_IFCHR : header.type == tar::TYPE_BLOCK ? S_IFBLK
+                                                            : header.type == tar::TYPE_FIFO    ? S_IFIFO
+                                                                                               : 0;
+        if (kind == 0)
+        {
+          std::cout << "Warning: skipping " << relative << " of unsupported archive entry type " << header.type << std::endl;
+          return;
+        }
+        if (mknod(full.c_str(), kind | 0600, makedev(header.devmajor, header.devminor)) != 0)
+          fail("create device", relative);
+      }
+      set_metadata(relative, header);
+    }
+
+  public:
+    writer_t(const std::filesystem::path &root) : root(root) {}
+
+    ~writer_t()
+    {
+      if (fd != -1)
+        close(fd);
+    }
+
+    void consume(item_t &item)
+    {
+      switch (item.kind)
+      {
+      case ITEM_BEGIN:
+      {
+        std::string relative = normalize(item.header.path);
+        if (item.header.type != tar::TYPE_FILE)
+        {
+          write_entry(relative, item.header);
+          break;
+        }
+        open_file(relative);
+        current_header = item.header;
+        if (item.inline_content)
+        {
+          if (item.header.size > 0 && clone_data(item.hash + ":" + std::to_string(item.header.size)))
+          {
+            result.cloned++;
+            result.cloned_bytes += item.header.size;
+          }
+          else
+            write_data(item.data);
+          close_file(item.header, item.hash);
+        }
+        break;
+      }
+      case ITEM_DATA:
+        write_data(item.data);
+        break;
+      case ITEM_END:
+        close_file(current_header, item.hash);
+        break;
+      }
+    }
+
+    void finish()
+    {
+      for (auto it = deferred.rbegin(); it != deferred.rend(); it++)
+        set_metadata(it->first, it->second);
+    }
+  };
+
+  // Extracts the archive read from fd into root. on_failure is called as soon as any stage fails, so that the
+  // producer of the archive can be stopped instead of filling the pipe for nothing.
+  result_t extract(int fd, const std::filesystem::path &root, const std::function<void()> &on_failure = {})
+  {
+    parallel::queue_t<item_t> parsed(QUEUE_DEPTH), hashed(QUEUE_DEPTH);
+    std::exception_ptr error = nullptr;
+    std::mutex error_mutex;
+    auto guard = [&](const std::function<void()> &stage)
+    {
+      try
+      {
+        stage();
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+        {
+          error = std::current_exception();
+          if (on_failure)
+            on_failure();
+        }
+        parsed.close();
+        hashed.close();
+      }
+    };
+
+    std::thread reader([&]()
+                       {
+                         guard([&]()
+                               {
+                                 tar::reader_t archive(fd);
+                                 tar::header_t header;
+                                 while (archive.next(header))
+                                 {
+                                   item_t item = {.kind = ITEM_BEGIN, .header = header};
+                                   if (header.type != tar::TYPE_FILE || header.size <= INLINE_LIMIT)
+                                   {
+                                     item.inline_content = header.type == tar::TYPE_FILE;
+                                     item.data.resize(header.size);
+                                     if (archive.read(item.data.data(), header.size) != header.size)
+                                       throw std::runtime_error("Truncated archive");
+                                     if (!parsed.push(std::move(item)))
+                                       return;
+                                     continue;
+                                   }
+                                   if (!parsed.push(std::move(item)))
+                                     return;
+                                   while (true)
+                                   {
+                                     item_t chunk = {.kind = ITEM_DATA};
+                                     chunk.data.resize(CHUNK_SIZE);
+                                     chunk.data.resize(archive.read(chunk.data.data(), CHUNK_SIZE));
+                                     if (chunk.data.empty())
+                                       break;
+                                     if (!parsed.push(std::move(chunk)))
+                                       return;
+                                   }
+                                   if (!parsed.push({.kind = ITEM_END}))
+                                     return;
+                                 } });
+                         parsed.close();
+                       });
+
+    std::thread hasher([&]()
+                       {
+                         guard([&]()
+                               {
+                                 manifest::hasher_t hasher;
+                                 while (auto item = parsed.pop())
+                                 {
+                                   if (item->kind == ITEM_BEGIN && item->inline_content)
+                                   {
+                                     manifest::hasher_t whole;
+                                     whole.update(item->data.data(), item->data.size());
+                                     item->hash = whole.digest();
+                                   }
+                                   else if (item->kind == ITEM_BEGIN)
+                                     hasher = manifest::hasher_t();
+                                   else if (item->kind == ITEM_DATA)
+                                     hasher.update(item->data.data(), item->data.size());
+                                   else
+                                     item->hash = hasher.digest();
+                                   if (!hashed.push(std::move(item.value())))
+                                     return;
+                                 } });
+                         hashed.close();
+                       });
+
+    writer_t writer(root);
+    guard([&]()
+          {
+            while (auto item = hashed.pop())
+              writer.consume(item.value());
+            // the queue also ends when another stage fails
+            bool failed;
+            {
+              std::lock_guard<std::mutex> lock(error_mutex);
+              failed = error != nullptr;
+            }
+            if (!failed)
+              writer.finish(); });
+    reader.join();
+    hasher.join();
+    if (error)
+      std::rethrow_exception(error);
+
+    // only metadata is read back, the hashes were taken on the way in
+    std::set<std::string> none, missing;
+    writer.result.manifest = manifest::generate(root, &none);
+    for (auto &entry : writer.result.manifest)
+      if ((entry.type == 'f' || entry.type == 'l') && !writer.hashes.count(entry.path))
+        missing.insert(entry.path);
+    // e.g. hardlinks to files that were replaced later in the archive
+    if (!missing.empty())
+      writer.result.manifest = manifest::generate(root, &missing);
+    for (auto &entry : writer.result.manifest)
+      if ((entry.type == 'f' || entry.type == 'l') && writer.hashes.count(entry.path))
+        entry.hash = writer.hashes[entry.path];
+    return writer.result;
+  }
+
+  // Builds the version entity with the first container builder found, streaming its output into the inventory.
+  void build(entity_t entity, std::filesystem::path source, const inventory::before_publish_t &before_publish = nullptr)
+  {
+    auto command = inventory::builder_command(entity, source, "type=tar,dest=/dev/fd/3");
+
+    std::filesystem::path staging = inventory::stage("ingest");
+    std::filesystem::path root = staging / "root";
+    int fds[2] = {-1, -1};
+    pid_t pid = -1;
+    try
+    {
+      inventory::create(root);
+      if (pipe2(fds, O_CLOEXEC) != 0)
+        throw sys::system_error("Cannot create pipe. Error code: " + std::string(std::strerror(errno)));
+
+      std::cout << "Building image using command ";
+      for (auto &arg : command)
+        std::cout << arg << " ";
+      std::cout << std::endl;
+      pid = sys::spawn(command, fds[1]);
+      close(fds[1]);
+      fds[1] = -1;
+
+      result_t result;
+      try
+      {
+        result = extract(fds[0], root, [pid]()
+                         { kill(pid, SIGTERM); });
+      }
+      catch (const std::exception &e)
+      {
+        close(fds[0]);
+        fds[0] = -1;
+        int code = sys::wait(pid);
+        pid = -1;
+        // a broken archive is most likely the consequence of a failed build
+        if (code != 0 && code != 128 + SIGTERM)
+          throw std::runtime_error("Cannot build image");
+        throw;
+      }
+      close(fds[0]);
+      fds[0] = -1;
+      int code = sys::wait(pid);
+      pid = -1;
+      if (code != 0)
+        throw std::runtime_error("Cannot build image");
+
+      std::optional<std::vector<manifest::entry_t>> entries;
+      if (before_publish)
+        entries = before_publish(root);
+      inventory::publish(root, entity, entries.has_value() ? entries : result.manifest);
+      std::cout << "Ingested " << result.files << " files, wrote " << result.bytes / (1 << 20) << " MiB and cloned "
+                << result.cloned << " duplicates (" << result.cloned_bytes / (1 << 20) << " MiB)" << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+      for (int fd : fds)
+        if (fd != -1)
+          close(fd);
+      if (pid != -1)
+        sys::wait(pid);
+      if (std::filesystem::exists(root))
+        inventory::destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+  }
+}
+
+#endif
@@ -7,59 +7,303 @@
 #include <vector>
 #include <set>
 #include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "../interfaces/system.hpp"
+#include "../interfaces/cgroup.hpp"
 #include "data.hpp"
+#include "manifest.hpp"
 
 namespace inventory
 {
 
   const std::filesystem::path INVENTORY_PATH("/succ/inv");
+  // must live on the same filesystem as INVENTORY_PATH, so that publishing is a rename
+  const std::filesystem::path STAGING_PATH("/succ/stage");
+  // per version data that must not end up inside the image, like build records
+  const std::filesystem::path METADATA_PATH("/succ/meta");
+
+  // Taken shared by readers that walk the inventory and exclusive by whatever adds or removes its entries. Those
+  // only ever rename fully written trees in or out, so the exclusive lock is held for a moment, never for a build.
+  const std::filesystem::path LOCK_PATH("/succ/inv.lock");
+
+  enum lock_mode_t
+  {
+    LOCK_MODE_SHARED,
+    LOCK_MODE_EXCLUSIVE,
+  };
+
+  // flock based, so it goes away with the process. Locks are not reentrant: a process holding one must not take
+  // another.
+  class lock_t
+  {
+    int fd = -1;
+
+  public:
+    lock_t(lock_mode_t mode)
+    {
+      fd = open(LOCK_PATH.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      // nothing changes on a read-only /succ, so there is nothing to lock against
+      if (fd == -1 && errno == EROFS)
+        return;
+      if (fd == -1)
+        throw sys::system_error("Cannot open " + LOCK_PATH.string() + ". Error code: " + std::string(std::strerror(errno)));
+      if (flock(fd, mode == LOCK_MODE_SHARED ? LOCK_SH : LOCK_EX) != 0)
+      {
+        close(fd);
+        throw sys::system_error("Cannot lock the inventory. Error code: " + std::string(std::strerror(errno)));
+      }
+    }
+
+    lock_t(const lock_t &) = delete;
+    lock_t &operator=(const lock_t &) = delete;
+
+    ~lock_t()
+    {
+      if (fd != -1)
+        close(fd);
+    }
+  };
+
+  // Taken shared on the root of a version by whatever runs it, for as long as it does, so that no archive pass
+  // moves the tree away from under it. Returns the descriptor holding the lock.
+  int lock_in_use(const std::filesystem::path &root)
+  {
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+      throw sys::system_error("Cannot open " + root.string() + ". Error code: " + std::string(std::strerror(errno)));
+    if (flock(fd, LOCK_SH) != 0)
+    {
+      close(fd);
+      throw sys::system_error("Cannot lock " + root.string() + ". Error code: " + std::string(std::strerror(errno)));
+    }
+    // an archive pass may have moved it while we waited
+    struct stat held, current;
+    if (fstat(fd, &held) != 0 || stat(root.c_str(), &current) != 0 || held.st_dev != current.st_dev || held.st_ino != current.st_ino)
+    {
+      close(fd);
+      throw std::runtime_error(root.string() + " was archived meanwhile");
+    }
+    return fd;
+  }
+
+  // Takes the root of a version exclusive unless something runs it, returning -1 then. The lock is held until the
+  // returned descriptor is closed.
+  int lock_unused(const std::filesystem::path &root)
+  {
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+      return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
 
   std::filesystem::path inline path(entity_t entity)
   {
     return INVENTORY_PATH / entity.name / std::to_string(entity.version);
   }
 
-  void build(entity_t entity, std::filesystem::path source)
+  std::filesystem::path inline metadata_path(entity_t entity)
+  {
+    return METADATA_PATH / entity.name / std::to_string(entity.version);
+  }
+
+  std::filesystem::path inline manifest_path(entity_t entity)
   {
-    std::string builder = "";
-    std::vector<std::string> args;
-    if (sys::binary_exists("buildah")) {
-      builder = "buildah";
-      args = {"bud", "-t", entity.name + ":" + std::to_string(entity.version), "-o", "type=local,dest=" + path(entity).string(), "-f", source.string(), "."}; 
+    return metadata_path(entity) / "manifest";
+  }
+
+  // Stores the manifest of a freshly published version, generating it if not given.
+  void write_manifest(entity_t entity, std::optional<std::vector<manifest::entry_t>> entries = std::nullopt)
+  {
+    if (!entries.has_value())
+      entries = manifest::generate(path(entity));
+    std::filesystem::create_directories(metadata_path(entity));
+    std::filesystem::path tmp = manifest_path(entity).string() + ".tmp";
+    {
+      std::ofstream os(tmp);
+      manifest::write(entries.value(), os);
+      if (!os)
+        throw std::runtime_error("Cannot write manifest of " + entity.name + ":" + std::to_string(entity.version));
     }
-    if (builder == "" && sys::binary_exists("podman")) {
-      builder = "podman";
-      args = {"build", "-t", entity.name + ":" + std::to_string(entity.version), "-o", "type=local,dest=" + path(entity).string(), "-f", source.string(), "."};
+    std::filesystem::rename(tmp, manifest_path(entity));
+  }
+
+  // Apparent size of the files of the version, read from its manifest if it has one.
+  uint64_t size(entity_t entity)
+  {
+    uint64_t total = 0;
+    std::ifstream is(manifest_path(entity));
+    if (is.is_open())
+    {
+      manifest::entry_t entry;
+      while (manifest::read_entry(is, entry))
+        total += entry.size;
+      return total;
     }
-    if (builder == "" && sys::binary_exists("docker")) {
-      builder = "docker";
-      args = {"buildx", "build", "-t", entity.name + ":" + std::to_string(entity.version), "-o", "type=local,dest=" + path(entity).string(), "-f", source.string(), "."};
+    for (auto it = std::filesystem::recursive_directory_iterator(path(entity)); it != std::filesystem::recursive_directory_iterator(); it++)
+      if (it->is_regular_file() && !it->is_symlink())
+        total += it->file_size();
+    return total;
+  }
+
+  struct build_record_t
+  {
+    int64_t timestamp;
+    bool succeeded;
+    int64_t duration_ms;
+    uint64_t cpu_usec;
+    uint64_t memory_peak;
+    uint64_t bytes_written;
+  };
+
+  // Stores the record next to the version if the build succeeded, and as the last build in any case.
+  void save_build_record(entity_t entity, const build_record_t &record)
+  {
+    auto write = [&entity, &record](const std::filesystem::path &file)
+    {
+      std::filesystem::create_directories(file.parent_path());
+      std::ofstream os(file);
+      os << "image: " << entity.name << "\n"
+         << "version: " << entity.version << "\n"
+         << "timestamp: " << record.timestamp << "\n"
+         << "result: " << (record.succeeded ? "ok" : "failed") << "\n"
+         << "duration_ms: " << record.duration_ms << "\n"
+         << "cpu_usec: " << record.cpu_usec << "\n"
+         << "memory_peak: " << record.memory_peak << "\n"
+         << "bytes_written: " << record.bytes_written << "\n";
+    };
+    if (record.succeeded)
+      write(metadata_path(entity) / "build");
+    write(METADATA_PATH / "last_build");
+  }
+
+  enum backend_t
+  {
+    BACKEND_DIRECTORY,
+    BACKEND_BTRFS, // versions are subvolumes, cloned by snapshot and removed by subvolume delete
+  };
+
+  backend_t backend()
+  {
+    std::filesystem::path probe = std::filesystem::exists(INVENTORY_PATH) ? INVENTORY_PATH : INVENTORY_PATH.parent_path();
+    switch (sys::fs::type(probe))
+    {
+    case BTRFS_SUPER_MAGIC:
+      return BACKEND_BTRFS;
+    default:
+      return BACKEND_DIRECTORY;
     }
+  }
+
+  // Creates an empty directory for a new version, a subvolume on btrfs. Returns false if it already exists.
+  bool create(std::filesystem::path dest)
+  {
+    if (std::filesystem::exists(dest))
+      return false;
+    std::filesystem::create_directories(dest.parent_path());
+    if (backend() == BACKEND_BTRFS)
+      sys::fs::btrfs_subvolume_create(dest);
+    else
+      std::filesystem::create_directory(dest);
+    return true;
+  }
+
+  // Removes a version or a staging directory, in constant time if it is a btrfs subvolume.
+  void destroy(std::filesystem::path target)
+  {
+    if (sys::fs::is_btrfs_subvolume(target))
+      try
+      {
+        sys::fs::btrfs_subvolume_delete(target);
+        return;
+      }
+      catch (const sys::system_error &e)
+      {
+        // e.g. nested subvolumes, fall back to removing the files one by one
+      }
+    std::filesystem::remove_all(target);
+  }
 
-    if (builder == "")
-      throw std::runtime_error("Cannot find any container builder. Install buildah, podman or docker");
+  // The command of the first container builder found, with output as its --output / -o value.
+  std::vector<std::string> builder_command(entity_t entity, std::filesystem::path source, std::string output)
+  {
+    // also tagged latest, so that other images can be built FROM it
+    std::string tag = entity.name + ":" + std::to_string(entity.version), latest = entity.name + ":latest";
+    if (sys::binary_exists("buildah"))
+      return {"buildah", "bud", "-t", tag, "-t", latest, "-o", output, "-f", source.string(), "."};
+    if (sys::binary_exists("podman"))
+      return {"podman", "build", "-t", tag, "-t", latest, "-o", output, "-f", source.string(), "."};
+    if (sys::binary_exists("docker"))
+      return {"docker", "buildx", "build", "-t", tag, "-t", latest, "-o", output, "-f", source.string(), "."};
+    throw std::runtime_error("Cannot find any container builder. Install buildah, podman or docker");
+  }
 
-    if (!std::filesystem::create_directories(path(entity)))
-      throw std::runtime_error("Cannot create inventory directory");
 
-    try
+  // Runs a build step in a transient cgroup with the given limits, so that it cannot starve the rest of the
+  // host, and records its duration and resource usage.
+  void isolate_build(entity_t entity, const cgroup::limits_t &limits, const std::function<void()> &step)
+  {
+    std::unique_ptr<cgroup::scope_t> scope;
+    if (cgroup::available())
+      try
+      {
+        scope = std::make_unique<cgroup::scope_t>("successor-build", limits);
+      }
+      catch (const std::exception &e)
+      {
+        std::cout << "Warning: cannot isolate the build: " << e.what() << std::endl;
+      }
+    else
+      std::cout << "Warning: cgroup v2 is not available, the build runs without cgroup limits" << std::endl;
+    cgroup::set_priority(limits);
+
+    auto start = std::chrono::steady_clock::now();
+    build_record_t record = {.timestamp = std::time(nullptr), .succeeded = false};
+    auto finish = [&]()
     {
-      std::cout << "Building image using command " << builder << " ";
-      for (auto &arg : args)
-        std::cout << arg << " ";
-      std::cout << std::endl;
-      if (sys::execute(builder, args) != 0)
+      record.duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+      if (scope)
       {
-        throw std::runtime_error("Cannot build image");
+        auto usage = scope->usage();
+        record.cpu_usec = usage.cpu_usec;
+        record.memory_peak = usage.memory_peak;
+        record.bytes_written = usage.bytes_written;
+      }
+      try
+      {
+        save_build_record(entity, record);
+      }
+      catch (const std::exception &e)
+      {
+        std::cout << "Warning: cannot record the build: " << e.what() << std::endl;
       }
+    };
+
+    try
+    {
+      step();
     }
-    catch (const std::runtime_error &e)
+    catch (const std::exception &e)
     {
-      std::filesystem::remove_all(path(entity));
-      throw e;
+      finish();
+      throw;
     }
+    record.succeeded = true;
+    finish();
+    std::cout << "Build took " << record.duration_ms << " ms, " << record.cpu_usec / 1000 << " ms of CPU, "
+              << record.memory_peak / (1 << 20) << " MiB of memory at peak and wrote " << record.bytes_written / (1 << 20) << " MiB" << std::endl;
   }
 
   std::vector<std::string> list_images()
@@ -79,7 +323,12 @@ namespace inventory
       {
         std::set<int> versions;
         for (auto &subentry : std::filesystem::directory_iterator(entry))
-          versions.insert(std::stoi(subentry.path().filename().string()));
+        {
+          // anything else is not a version, e.g. left behind by hand or by an older successor
+          std::string name = subentry.path().filename().string();
+          if (!name.empty() && name.size() < 10 && name.find_first_not_of("0123456789") == std::string::npos)
+            versions.insert(std::stoi(name));
+        }
         return versions;
       }
 
@@ -96,27 +345,186 @@ namespace inventory
     return std::nullopt;
   }
 
+  std::filesystem::path stage(std::string purpose)
+  {
+    std::filesystem::path staging = STAGING_PATH / (purpose + "-" + std::to_string(getpid()));
+    if (std::filesystem::exists(staging))
+      std::filesystem::remove_all(staging);
+    std::filesystem::create_directories(staging);
+    return staging;
+  }
+
+  // Moves the versions out of the inventory under the lock and deletes them after releasing it, so that readers
+  // wait for a rename at most.
   void remove(const std::vector<entity_t> &entities)
   {
-    for (auto &entity : entities)
-      if (entity.name == current()->name && entity.version == current()->version)
-        throw std::runtime_error("Cannot remove current entity");
-      else
-        std::filesystem::remove_all(path(entity));
+    std::filesystem::path trash = stage("remove");
+    std::vector<std::filesystem::path> removed;
+    {
+      lock_t lock(LOCK_MODE_EXCLUSIVE);
+      auto running = current();
+      for (auto &entity : entities)
+        if (running.has_value() && entity == running.value())
+          throw std::runtime_error("Cannot remove current entity");
 
-    for (auto &image : list_images())
-      if (list_versions(image).empty())
-        std::filesystem::remove_all(INVENTORY_PATH / image);
+      for (auto &entity : entities)
+      {
+        if (!std::filesystem::exists(path(entity)))
+          continue;
+        removed.push_back(trash / (entity.name + "-" + std::to_string(entity.version)));
+        std::filesystem::rename(path(entity), removed.back());
+        std::filesystem::remove_all(metadata_path(entity));
+      }
+
+      for (auto &image : list_images())
+        if (list_versions(image).empty())
+        {
+          std::filesystem::remove_all(INVENTORY_PATH / image);
+          std::filesystem::remove_all(METADATA_PATH / image);
+        }
+    }
+
+    for (auto &target : removed)
+      destroy(target);
+    std::filesystem::remove_all(trash);
   }
 
   entity_t resolve(std::string image, version_t version)
   {
-    int latest_version = list_versions(image).empty() ? 0 : (*list_versions(image).rend());
+    auto versions = list_versions(image);
+    int latest_version = versions.empty() ? 0 : (*versions.rbegin());
     if (std::holds_alternative<version_latest_t>(version))
       return {.name = image, .version = latest_version};
     else
       return {.name = image, .version = std::get<int>(version)};
   }
+
+  // Creates dest as a copy of the version: a snapshot on btrfs, reflinks where the filesystem supports them and
+  // a full copy otherwise, so that nothing done to dest can reach the files of the base version.
+  void clone(entity_t base, std::filesystem::path dest)
+  {
+    if (std::filesystem::exists(dest))
+      throw std::runtime_error("Clone destination " + dest.string() + " already exists");
+    std::filesystem::create_directories(dest.parent_path());
+    if (backend() == BACKEND_BTRFS && sys::fs::is_btrfs_subvolume(path(base)))
+    {
+      sys::fs::btrfs_snapshot(path(base), dest);
+      return;
+    }
+
+    create(dest);
+    // cp reflinks where the filesystem can, e.g. XFS or bcachefs, and copies the data otherwise
+    if (sys::execute("cp", {"-a", "--reflink=auto", path(base).string() + "/.", dest.string()}) != 0)
+      throw std::runtime_error("Cannot clone image " + base.name + ":" + std::to_string(base.version));
+  }
+
+  // Moves a fully written staging directory into the inventory as the given version, which must not exist yet.
+  // The manifest, if given, is stored first, so that the version never shows up without it.
+  void publish(std::filesystem::path staging, entity_t entity, const std::optional<std::vector<manifest::entry_t>> &entries = std::nullopt)
+  {
+    lock_t lock(LOCK_MODE_EXCLUSIVE);
+    std::filesystem::create_directories(INVENTORY_PATH / entity.name);
+    if (std::filesystem::exists(path(entity)))
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " already exists");
+    if (entries.has_value())
+      write_manifest(entity, entries);
+    std::filesystem::rename(staging, path(entity));
+  }
+
+  // Moves a fully written staging directory into the inventory as the next version of the image. The manifest and
+  // whatever write_metadata stores for the new version are in place before it shows up.
+  entity_t publish(std::filesystem::path staging, std::string image, const std::optional<std::vector<manifest::entry_t>> &entries = std::nullopt,
+                   const std::function<void(entity_t)> &write_metadata = nullptr)
+  {
+    lock_t lock(LOCK_MODE_EXCLUSIVE);
+    entity_t entity = resolve(image, version_latest);
+    entity.version++;
+    std::filesystem::create_directories(INVENTORY_PATH / image);
+    if (entries.has_value())
+      write_manifest(entity, entries);
+    if (write_metadata)
+      write_metadata(entity);
+    std::filesystem::rename(staging, path(entity));
+    return entity;
+  }
+
+  // Called by the builds with the staged root right before it is published, e.g. to optimize it. Returns the
+  // manifest of the root if it changed it, the build generates it otherwise.
+  typedef std::function<std::optional<std::vector<manifest::entry_t>>(const std::filesystem::path &root)> before_publish_t;
+
+  // Builds into a staging directory and publishes the result as the given version, along with its manifest, once
+  // the builder succeeded, so that nobody ever sees a partial tree in the inventory.
+  void build(entity_t entity, std::filesystem::path source, const before_publish_t &before_publish = nullptr)
+  {
+    std::filesystem::path staging = stage("build");
+    std::filesystem::path root = staging / "root";
+    auto command = builder_command(entity, source, "type=local,dest=" + root.string());
+
+    try
+    {
+      if (!create(root))
+        throw std::runtime_error("Cannot create staging directory");
+      std::cout << "Building image using command ";
+      for (auto &arg : command)
+        std::cout << arg << " ";
+      std::cout << std::endl;
+      if (sys::execute(command[0], std::vector<std::string>(command.begin() + 1, command.end())) != 0)
+        throw std::runtime_error("Cannot build image");
+      std::optional<std::vector<manifest::entry_t>> entries;
+      if (before_publish)
+        entries = before_publish(root);
+      publish(root, entity, entries.has_value() ? entries : manifest::generate(root));
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(root))
+        destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+  }
+
+  // Streams the version as a zstd compressed tar archive to the standard output.
+  void export_version(entity_t entity)
+  {
+    if (!std::filesystem::exists(path(entity)))
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " does not exist");
+    if (!sys::binary_exists("zstd"))
+      throw std::runtime_error("Cannot find zstd. Install it to export images");
+
+    if (sys::execute_pipeline({{"tar", "--xattrs", "--xattrs-include=*", "--acls", "--numeric-owner", "-C", path(entity).string(), "-cf", "-", "."},
+                               {"zstd", "-T0", "-q", "-c"}}) != 0)
+      throw std::runtime_error("Cannot export image");
+  }
+
+  // Reads an archive produced by export_version from the standard input and publishes it as the next version.
+  entity_t import_version(std::string image)
+  {
+    if (!sys::binary_exists("zstd"))
+      throw std::runtime_error("Cannot find zstd. Install it to import images");
+
+    std::filesystem::path staging = stage("import");
+    std::filesystem::path root = staging / "root";
+    entity_t entity;
+    try
+    {
+      create(root);
+      if (sys::execute_pipeline({{"zstd", "-d", "-q", "-c"},
+                                 {"tar", "--xattrs", "--xattrs-include=*", "--acls", "--numeric-owner", "--same-owner", "-C", root.string(), "-xf", "-"}}) != 0)
+        throw std::runtime_error("Cannot import image");
+      entity = publish(root, image, manifest::generate(root));
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(root))
+        destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+    return entity;
+  }
 }
 
 #endif
\ No newline at end of file
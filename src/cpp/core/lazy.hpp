@@ -0,0 +1,696 @@
+#ifndef lazy_hpp
+#define lazy_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+#include <condition_variable>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <linux/fuse.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/parallel.hpp"
+#include "inventory.hpp"
+#include "manifest.hpp"
+#include "data.hpp"
+
+// Lazy versions. A lazy version is an empty directory in the inventory and a manifest, whose contents live in a
+// content-addressed blob store: a directory, local or mounted from wherever the images are built, holding
+//   blobs/HH/HASH-SIZE      the contents of a regular file or the target of a symlink, HH being the first two
+//                           characters of the hash
+//   manifests/NAME/VERSION  the manifest of a version
+// `successor export --store` fills a store and `successor import --store` adds a lazy version from it. The runner
+// mounts a lazy version as a read-only FUSE filesystem served from the manifest, which copies a file into the
+// cache on its first open, under an overlay whose upper layer keeps the writes. The files an image opened before
+// are fetched in parallel as soon as it is mounted.
+//
+// The FUSE protocol is spoken over /dev/fuse directly. Once the root is switched, the server runs inside the tree
+// it serves, so it only ever touches the store and the cache through file descriptors opened beforehand.
+namespace lazy
+{
+  const std::filesystem::path CACHE_PATH = "/succ/cache";
+  const int SERVER_THREADS = 4;
+  const int PREFETCH_THREADS = 8;
+  // the kernel caches entries and attributes for this long, nothing ever changes below a manifest
+  const uint64_t CACHE_TIMEOUT = 86400;
+  const uint32_t MAX_WRITE = 128 << 10;
+
+  struct source_t
+  {
+    std::filesystem::path manifest;
+    std::filesystem::path store;
+    std::filesystem::path cache;
+    // paths opened by earlier runs of the image, in the order they were first opened
+    std::filesystem::path hot_list;
+    // the FUSE mount, and the upper and work directories of the overlay on top of it
+    std::filesystem::path lower;
+    std::filesystem::path upper;
+    std::filesystem::path work;
+  };
+
+  std::string blob_name(const std::string &hash, uint64_t size)
+  {
+    return hash.substr(0, 2) + "/" + hash + "-" + std::to_string(size);
+  }
+
+  std::filesystem::path marker_path(entity_t entity)
+  {
+    return inventory::metadata_path(entity) / "lazy";
+  }
+
+  // the paths opened by earlier runs of any version of the image, one per line, escaped like in manifests
+  std::filesystem::path hot_list_path(const std::string &image)
+  {
+    return inventory::METADATA_PATH / image / "hot";
+  }
+
+  bool is_lazy(entity_t entity)
+  {
+    return std::filesystem::exists(marker_path(entity));
+  }
+
+  source_t source_of(entity_t entity)
+  {
+    std::ifstream marker(marker_path(entity));
+    std::string store;
+    if (!std::getline(marker, store) || store.empty())
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " has no blob store");
+    std::filesystem::path meta = inventory::metadata_path(entity);
+    return {.manifest = inventory::manifest_path(entity), .store = store, .cache = CACHE_PATH,
+            .hot_list = hot_list_path(entity.name),
+            .lower = meta / "lower", .upper = meta / "upper", .work = meta / "work"};
+  }
+
+  // Copies the contents of the version into the store, skipping blobs it already holds, and adds its manifest.
+  void push(entity_t entity, const std::filesystem::path &store)
+  {
+    std::filesystem::path root = inventory::path(entity);
+    if (is_lazy(entity) || !std::filesystem::exists(root))
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " is not in the inventory");
+    std::vector<manifest::entry_t> entries;
+    std::ifstream is(inventory::manifest_path(entity));
+    if (is.is_open())
+      entries = manifest::read(is);
+    else
+      entries = manifest::generate(root);
+
+    std::atomic<uint64_t> blobs(0), bytes(0);
+    parallel::for_each(entries.size(), [&](size_t i)
+                       {
+                         const manifest::entry_t &entry = entries[i];
+                         if (entry.type != 'f' && entry.type != 'l')
+                           return;
+                         if (entry.hash == "-")
+                           throw std::runtime_error("The manifest of " + entity.name + ":" + std::to_string(entity.version) + " lacks hashes");
+                         std::filesystem::path blob = store / "blobs" / blob_name(entry.hash, entry.size);
+                         if (std::filesystem::exists(blob))
+                           return;
+                         std::filesystem::create_directories(blob.parent_path());
+                         std::filesystem::path tmp = blob.string() + ".tmp." + std::to_string(getpid()) + "." + std::to_string(i);
+                         if (entry.type == 'l')
+                         {
+                           std::ofstream os(tmp);
+                           os << std::filesystem::read_symlink(root / entry.path).string();
+                           if (!os)
+                             throw std::runtime_error("Cannot write " + tmp.string());
+                         }
+                         else
+                           std::filesystem::copy_file(root / entry.path, tmp, std::filesystem::copy_options::overwrite_existing);
+                         std::filesystem::rename(tmp, blob);
+                         blobs++;
+                         bytes += entry.size; });
+
+    std::filesystem::path manifest_file = store / "manifests" / entity.name / std::to_string(entity.version);
+    std::filesystem::create_directories(manifest_file.parent_path());
+    std::filesystem::path tmp = manifest_file.string() + ".tmp." + std::to_string(getpid());
+    {
+      std::ofstream os(tmp);
+      manifest::write(entries, os);
+      if (!os)
+        throw std::runtime_error("Cannot write " + tmp.string());
+    }
+    std::filesystem::rename(tmp, manifest_file);
+    std::cout << "Pushed " << blobs << " new blobs (" << (bytes >> 20) << " MiB) and the manifest of " << entity.name << ":"
+              << entity.version << " to " << store.string() << std::endl;
+  }
+
+  // Adds a version of the image in the store as the next, lazy, version of the image in the inventory.
+  entity_t import(const std::string &image, version_t version, const std::filesystem::path &store)
+  {
+    int number = 0;
+    if (std::holds_alternative<int>(version))
+      number = std::get<int>(version);
+    else if (std::filesystem::exists(store / "manifests" / image))
+      for (auto &entry : std::filesystem::directory_iterator(store / "manifests" / image))
+      {
+        std::string name = entry.path().filename().string();
+        if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit))
+          number = std::max(number, std::stoi(name));
+      }
+    std::filesystem::path manifest_file = store / "manifests" / image / std::to_string(number);
+    std::ifstream is(manifest_file);
+    if (!is.is_open())
+      throw std::runtime_error("Cannot open " + manifest_file.string());
+    auto entries = manifest::read(is);
+
+    std::filesystem::path staging = inventory::stage("lazy");
+    entity_t entity;
+    try
+    {
+      std::filesystem::create_directory(staging / "root");
+      // an empty root without its marker would pass for a regular, empty version
+      entity = inventory::publish(staging / "root", image, entries, [&store](entity_t entity)
+                                  {
+                                    std::ofstream marker(marker_path(entity));
+                                    marker << std::filesystem::absolute(store).string() << "\n";
+                                    if (!marker)
+                                      throw std::runtime_error("Cannot write " + marker_path(entity).string()); });
+    }
+    catch (const std::exception &e)
+    {
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+    return entity;
+  }
+
+  class server_t
+  {
+    struct node_t
+    {
+      manifest::entry_t entry;
+      uint64_t parent;
+      // sorted by name
+      std::vector<std::pair<std::string, uint64_t>> children;
+    };
+
+    // indexed by inode number, 1 being the root
+    std::vector<node_t> nodes;
+    std::unordered_map<std::string, uint64_t> by_path;
+    int fuse_fd, store_fd, cache_fd, hot_fd;
+
+    std::mutex mutex;
+    std::condition_variable fetched;
+    std::set<std::string> fetching;
+    std::set<uint64_t> recorded;
+
+    static mode_t type_bits(char type)
+    {
+      switch (type)
+      {
+      case 'f':
+        return S_IFREG;
+      case 'd':
+        return S_IFDIR;
+      case 'l':
+        return S_IFLNK;
+      case 'c':
+        return S_IFCHR;
+      case 'b':
+        return S_IFBLK;
+      case 'p':
+        return S_IFIFO;
+      default:
+        return S_IFSOCK;
+      }
+    }
+
+    void fill_attr(uint64_t ino, fuse_attr &attr)
+    {
+      const manifest::entry_t &entry = nodes[ino].entry;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.ino = ino;
+      attr.size = entry.size;
+      attr.blocks = (entry.size + 511) / 512;
+      attr.atime = attr.mtime = attr.ctime = entry.mtime;
+      attr.mode = type_bits(entry.type) | entry.mode;
+      attr.nlink = entry.type == 'd' ? 2 : 1;
+      attr.uid = entry.uid;
+      attr.gid = entry.gid;
+      attr.blksize = 4096;
+    }
+
+    // Copies the blob into the cache, verifying it on the way, unless it is there already. Concurrent fetches of
+    // the same blob wait for the first one.
+    std::string fetch(uint64_t ino, bool on_demand)
+    {
+      const manifest::entry_t &entry = nodes[ino].entry;
+      std::string name = blob_name(entry.hash, entry.size);
+      if (faccessat(cache_fd, name.c_str(), F_OK, 0) == 0)
+        return name;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        fetched.wait(lock, [&]()
+                     { return fetching.count(name) == 0; });
+        if (faccessat(cache_fd, name.c_str(), F_OK, 0) == 0)
+          return name;
+        fetching.insert(name);
+      }
+      auto done = [&]()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        fetching.erase(name);
+        fetched.notify_all();
+      };
+      try
+      {
+        copy_blob(name, entry);
+      }
+      catch (const std::exception &e)
+      {
+        done();
+        throw;
+      }
+      done();
+
+      if (on_demand && hot_fd != -1)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (recorded.insert(ino).second)
+        {
+          std::string line = manifest::escape(entry.path) + "\n";
+          if (write(hot_fd, line.data(), line.size()) != (ssize_t)line.size())
+            hot_fd = -1;
+        }
+      }
+      return name;
+    }
+
+    void copy_blob(const std::string &name, const manifest::entry_t &entry)
+    {
+      mkdirat(cache_fd, name.substr(0, 2).c_str(), 0755);
+      int in = openat(store_fd, ("blobs/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+      if (in == -1)
+        throw sys::system_error("Cannot open blob " + name + ". Error code: " + std::string(std::strerror(errno)));
+      std::string tmp = name + ".tmp." + std::to_string(gettid());
+      int out = openat(cache_fd, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (out == -1)
+      {
+        close(in);
+        throw sys::system_error("Cannot create " + tmp + " in the cache. Error code: " + std::string(std::strerror(errno)));
+      }
+      manifest::hasher_t hasher;
+      std::vector<char> buffer(1 << 20);
+      uint64_t total = 0;
+      ssize_t n;
+      bool ok = true;
+      while ((n = read(in, buffer.data(), buffer.size())) > 0)
+      {
+        hasher.update(buffer.data(), n);
+        total += n;
+        if (write(out, buffer.data(), n) != n)
+        {
+          ok = false;
+          break;
+        }
+      }
+      close(in);
+      ok = close(out) == 0 && ok && n == 0;
+      if (!ok || total != entry.size || hasher.digest() != entry.hash)
+      {
+        unlinkat(cache_fd, tmp.c_str(), 0);
+        throw std::runtime_error("Blob " + name + " is missing or corrupt");
+      }
+      if (renameat(cache_fd, tmp.c_str(), cache_fd, name.c_str()) != 0)
+        throw sys::system_error("Cannot add " + name + " to the cache. Error code: " + std::string(std::strerror(errno)));
+    }
+
+    void reply(uint64_t unique, int error, const void *data = nullptr, size_t size = 0)
+    {
+      fuse_out_header out = {.len = (uint32_t)(sizeof(out) + size), .error = -error, .unique = unique};
+      iovec iov[2] = {{&out, sizeof(out)}, {(void *)data, size}};
+      // fails if the request was interrupted meanwhile, which the kernel has already dealt with
+      writev(fuse_fd, iov, size ? 2 : 1);
+    }
+
+    std::optional<uint64_t> child(uint64_t parent, const std::string &name)
+    {
+      auto &children = nodes[parent].children;
+      auto it = std::lower_bound(children.begin(), children.end(), name, [](const std::pair<std::string, uint64_t> &child, const std::string &name)
+                                 { return child.first < name; });
+      if (it == children.end() || it->first != name)
+        return std::nullopt;
+      return it->second;
+    }
+
+    // Returns false once the filesystem is gone.
+    bool handle(const fuse_in_header *in, const char *arg, std::vector<char> &buffer)
+    {
+      if (in->opcode != FUSE_INIT && (in->nodeid == 0 || in->nodeid >= nodes.size()))
+      {
+        if (in->opcode != FUSE_FORGET && in->opcode != FUSE_BATCH_FORGET && in->opcode != FUSE_INTERRUPT)
+          reply(in->unique, ESTALE);
+        return true;
+      }
+      const node_t &node = nodes[in->nodeid];
+
+      switch (in->opcode)
+      {
+      case FUSE_INIT:
+      {
+        auto *init = (const fuse_init_in *)arg;
+        if (init->major != FUSE_KERNEL_VERSION)
+        {
+          reply(in->unique, EPROTO);
+          return false;
+        }
+        fuse_init_out out = {};
+        out.major = FUSE_KERNEL_VERSION;
+        out.minor = FUSE_KERNEL_MINOR_VERSION;
+        out.max_readahead = init->max_readahead;
+        out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_CACHE_SYMLINKS | FUSE_PARALLEL_DIROPS);
+        out.max_background = 16;
+        out.congestion_threshold = 12;
+        out.max_write = MAX_WRITE;
+        out.time_gran = 1000000000;
+        reply(in->unique, 0, &out, init->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+        return true;
+      }
+      case FUSE_DESTROY:
+        reply(in->unique, 0);
+        return false;
+      case FUSE_FORGET:
+      case FUSE_BATCH_FORGET:
+      case FUSE_INTERRUPT:
+        // inodes live as long as the server, and requests are short
+        return true;
+      case FUSE_LOOKUP:
+      {
+        if (node.entry.type != 'd')
+        {
+          reply(in->unique, ENOTDIR);
+          return true;
+        }
+        // a miss is cached as well, as a boot looks up lots of paths that do not exist
+        fuse_entry_out out = {};
+        out.entry_valid = out.attr_valid = CACHE_TIMEOUT;
+        if (auto ino = child(in->nodeid, arg))
+        {
+          out.nodeid = ino.value();
+          fill_attr(ino.value(), out.attr);
+        }
+        reply(in->unique, 0, &out, sizeof(out));
+        return true;
+      }
+      case FUSE_GETATTR:
+      {
+        fuse_attr_out out = {};
+        out.attr_valid = CACHE_TIMEOUT;
+        fill_attr(in->nodeid, out.attr);
+        reply(in->unique, 0, &out, sizeof(out));
+        return true;
+      }
+      case FUSE_READLINK:
+      {
+        if (node.entry.type != 'l')
+        {
+          reply(in->unique, EINVAL);
+          return true;
+        }
+        int fd = openat(cache_fd, fetch(in->nodeid, true).c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd == -1 ? -1 : read(fd, buffer.data(), buffer.size());
+        int error = errno;
+        if (fd != -1)
+          close(fd);
+        if (n < 0)
+          reply(in->unique, error);
+        else
+          reply(in->unique, 0, buffer.data(), n);
+        return true;
+      }
+      case FUSE_OPEN:
+      {
+        auto *open_in = (const fuse_open_in *)arg;
+        if (node.entry.type != 'f')
+        {
+          reply(in->unique, node.entry.type == 'd' ? EISDIR : EACCES);
+          return true;
+        }
+        if ((open_in->flags & O_ACCMODE) != O_RDONLY)
+        {
+          reply(in->unique, EROFS);
+          return true;
+        }
+        int fd = openat(cache_fd, fetch(in->nodeid, true).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+          reply(in->unique, errno);
+          return true;
+        }
+        fuse_open_out out = {.fh = (uint64_t)fd, .open_flags = FOPEN_KEEP_CACHE};
+        reply(in->unique, 0, &out, sizeof(out));
+        return true;
+      }
+      case FUSE_READ:
+      {
+        auto *read_in = (const fuse_read_in *)arg;
+        size_t size = std::min<size_t>(read_in->size, buffer.size());
+        ssize_t n = pread((int)read_in->fh, buffer.data(), size, read_in->offset);
+        if (n < 0)
+          reply(in->unique, errno);
+        else
+          reply(in->unique, 0, buffer.data(), n);
+        return true;
+      }
+      case FUSE_RELEASE:
+        close((int)((const fuse_release_in *)arg)->fh);
+        reply(in->unique, 0);
+        return true;
+      case FUSE_OPENDIR:
+      {
+        if (node.entry.type != 'd')
+        {
+          reply(in->unique, ENOTDIR);
+          return true;
+        }
+        fuse_open_out out = {.open_flags = FOPEN_KEEP_CACHE | FOPEN_CACHE_DIR};
+        reply(in->unique, 0, &out, sizeof(out));
+        return true;
+      }
+      case FUSE_READDIR:
+      {
+        auto *read_in = (const fuse_read_in *)arg;
+        size_t size = std::min<size_t>(read_in->size, buffer.size()), used = 0;
+        for (uint64_t i = read_in->offset; i < node.children.size() + 2; i++)
+        {
+          std::string name = i == 0 ? "." : i == 1 ? ".." : node.children[i - 2].first;
+          uint64_t ino = i == 0 ? in->nodeid : i == 1 ? node.parent : node.children[i - 2].second;
+          size_t record = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + name.size());
+          if (used + record > size)
+            break;
+          auto *dirent = (fuse_dirent *)(buffer.data() + used);
+          std::memset(dirent, 0, record);
+          dirent->ino = ino;
+          dirent->off = i + 1;
+          dirent->namelen = name.size();
+          dirent->type = type_bits(nodes[ino].entry.type) >> 12;
+          std::memcpy(dirent->name, name.data(), name.size());
+          used += record;
+        }
+        reply(in->unique, 0, buffer.data(), used);
+        return true;
+      }
+      case FUSE_RELEASEDIR:
+      case FUSE_FLUSH:
+      case FUSE_ACCESS:
+        reply(in->unique, 0);
+        return true;
+      case FUSE_STATFS:
+      {
+        fuse_statfs_out out = {};
+        out.st.bsize = out.st.frsize = 4096;
+        out.st.namelen = 255;
+        out.st.files = nodes.size() - 1;
+        for (auto &node : nodes)
+          out.st.blocks += (node.entry.size + 4095) / 4096;
+        reply(in->unique, 0, &out, sizeof(out));
+        return true;
+      }
+      default:
+        // including xattrs, which the kernel then stops asking for
+        reply(in->unique, ENOSYS);
+        return true;
+      }
+    }
+
+    void serve()
+    {
+      // a request carries at most MAX_WRITE bytes, a reply at most the read size, both capped to 32 pages
+      std::vector<char> request(MAX_WRITE + 4096), buffer(MAX_WRITE);
+      while (true)
+      {
+        ssize_t n = read(fuse_fd, request.data(), request.size());
+        if (n < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+            continue;
+          // ENODEV once unmounted
+          return;
+        }
+        if ((size_t)n < sizeof(fuse_in_header))
+          continue;
+        auto *in = (const fuse_in_header *)request.data();
+        try
+        {
+          if (!handle(in, request.data() + sizeof(fuse_in_header), buffer))
+            return;
+        }
+        catch (const std::exception &e)
+        {
+          std::cerr << "Warning: lazy image: " << e.what() << std::endl;
+          reply(in->unique, EIO);
+        }
+      }
+    }
+
+    void prefetch(const std::filesystem::path &hot_list)
+    {
+      std::vector<uint64_t> inos;
+      std::set<uint64_t> seen;
+      std::ifstream is(hot_list);
+      std::string line;
+      while (std::getline(is, line))
+      {
+        auto it = by_path.find(manifest::unescape(line));
+        if (it != by_path.end() && seen.insert(it->second).second)
+        {
+          inos.push_back(it->second);
+          // requests may already be served by other threads
+          std::lock_guard<std::mutex> lock(mutex);
+          recorded.insert(it->second);
+        }
+      }
+      parallel::for_each(inos.size(), [&](size_t i)
+                         {
+                           try
+                           {
+                             fetch(inos[i], false);
+                           }
+                           catch (const std::exception &e)
+                           {
+                             // opening it will report the error
+                           } },
+                         PREFETCH_THREADS);
+    }
+
+  public:
+    server_t(const std::vector<manifest::entry_t> &entries, int fuse_fd, int store_fd, int cache_fd, int hot_fd)
+        : fuse_fd(fuse_fd), store_fd(store_fd), cache_fd(cache_fd), hot_fd(hot_fd)
+    {
+      nodes.resize(2);
+      nodes[1].entry = {.path = "", .type = 'd', .mode = 0755};
+      nodes[1].parent = 1;
+      by_path[""] = 1;
+      for (auto &entry : entries)
+      {
+        size_t slash = entry.path.rfind('/');
+        auto parent = by_path.find(slash == std::string::npos ? "" : entry.path.substr(0, slash));
+        if (parent == by_path.end() || nodes[parent->second].entry.type != 'd')
+          continue;
+        uint64_t ino = nodes.size();
+        nodes.push_back({.entry = entry, .parent = parent->second});
+        nodes[parent->second].children.push_back({entry.path.substr(slash + 1), ino});
+        by_path[entry.path] = ino;
+      }
+      for (auto &node : nodes)
+        std::sort(node.children.begin(), node.children.end());
+    }
+
+    // Serves until the filesystem is unmounted, prefetching the hot list meanwhile.
+    void run(const std::filesystem::path &hot_list)
+    {
+      std::thread prefetcher([this, hot_list]()
+                             { prefetch(hot_list); });
+      std::vector<std::thread> threads;
+      for (int i = 1; i < SERVER_THREADS; i++)
+        threads.emplace_back([this]()
+                             { serve(); });
+      serve();
+      for (auto &thread : threads)
+        thread.join();
+      prefetcher.detach();
+    }
+  };
+
+  // Mounts the version at source.lower and serves it from a child process, whose pid it returns.
+  pid_t start(const source_t &source)
+  {
+    std::ifstream is(source.manifest);
+    if (!is.is_open())
+      throw std::runtime_error("Cannot open " + source.manifest.string());
+    auto entries = manifest::read(is);
+    std::filesystem::create_directories(source.cache);
+    std::filesystem::create_directories(source.lower);
+    std::filesystem::create_directories(source.hot_list.parent_path());
+
+    int store_fd = open(source.store.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store_fd == -1)
+      throw sys::system_error("Cannot open blob store " + source.store.string() + ". Error code: " + std::string(std::strerror(errno)));
+    int cache_fd = open(source.cache.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int hot_fd = open(source.hot_list.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    int fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    auto close_all = [&]()
+    {
+      for (int fd : {store_fd, cache_fd, hot_fd, fuse_fd})
+        if (fd != -1)
+          close(fd);
+    };
+    if (cache_fd == -1 || fuse_fd == -1)
+    {
+      int error = errno;
+      close_all();
+      throw sys::system_error("Cannot open " + std::string(cache_fd == -1 ? source.cache.string() : "/dev/fuse") + ". Error code: " + std::string(std::strerror(error)));
+    }
+
+    std::string options = "fd=" + std::to_string(fuse_fd) + ",rootmode=40000,user_id=0,group_id=0,allow_other,default_permissions";
+    try
+    {
+      sys::mnt::mount_fs("fuse.successor", source.lower, options, "successor", MS_RDONLY);
+    }
+    catch (const std::exception &e)
+    {
+      close_all();
+      throw;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      server_t server(entries, fuse_fd, store_fd, cache_fd, hot_fd);
+      server.run(source.hot_list);
+      _exit(0);
+    }
+    close_all();
+    if (pid == -1)
+    {
+      umount2(source.lower.c_str(), MNT_DETACH);
+      throw sys::system_error("Cannot fork lazy image server. Error code: " + std::string(std::strerror(errno)));
+    }
+    return pid;
+  }
+
+  void stop(pid_t pid, const std::filesystem::path &lower)
+  {
+    sys::mnt::detach_lazily(lower);
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+}
+
+#endif
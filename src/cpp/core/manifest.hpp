@@ -0,0 +1,340 @@
+#ifndef manifest_hpp
+#define manifest_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/parallel.hpp"
+
+// A manifest describes every file of a tree, one line per file, sorted by path:
+//   TYPE MODE UID GID SIZE MTIME HASH PATH
+// TYPE is one of f (regular), d (directory), l (symlink), c, b, p, s. PATH is relative to the root, with
+// backslashes and newlines escaped. HASH is the SHA-256 of the content of regular files and of the target of
+// symlinks, and "-" if it is not known.
+namespace manifest
+{
+
+  struct entry_t
+  {
+    std::string path;
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    int64_t mtime;
+    std::string hash;
+
+    // mtime is deliberately left out, rebuilding an image touches every file
+    bool same_content(const entry_t &other) const
+    {
+      return type == other.type && mode == other.mode && uid == other.uid && gid == other.gid && size == other.size &&
+             (hash == "-" || other.hash == "-" || hash == other.hash);
+    }
+  };
+
+  // SHA-256, as manifests are what delta packs are verified against and what the blob store of lazy versions is
+  // addressed by.
+  class hasher_t
+  {
+    static constexpr uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char tail[64];
+    size_t tail_size = 0;
+    uint64_t length = 0;
+
+    static uint32_t rotr(uint32_t x, int n)
+    {
+      return (x >> n) | (x << (32 - n));
+    }
+
+    void block(const unsigned char *data)
+    {
+      uint32_t w[64];
+      for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+      for (int i = 16; i < 64; i++)
+      {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+      for (int i = 0; i < 64; i++)
+      {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+      }
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+    }
+
+  public:
+    void update(const void *data, size_t size)
+    {
+      const unsigned char *bytes = (const unsigned char *)data;
+      length += size;
+      if (tail_size > 0)
+      {
+        size_t n = std::min(size, 64 - tail_size);
+        std::memcpy(tail + tail_size, bytes, n);
+        tail_size += n;
+        bytes += n;
+        size -= n;
+        if (tail_size < 64)
+          return;
+        block(tail);
+        tail_size = 0;
+      }
+      for (; size >= 64; bytes += 64, size -= 64)
+        block(bytes);
+      std::memcpy(tail, bytes, size);
+      tail_size = size;
+    }
+
+    // Finishes the hash, the hasher must not be updated afterwards.
+    std::string digest()
+    {
+      uint64_t bits = length * 8;
+      unsigned char padding[72] = {0x80};
+      size_t pad = (tail_size < 56 ? 56 : 120) - tail_size;
+      for (int i = 0; i < 8; i++)
+        padding[pad + i] = (unsigned char)(bits >> (56 - i * 8));
+      update(padding, pad + 8);
+
+      std::ostringstream os;
+      for (auto word : state)
+        os << std::hex << std::setw(8) << std::setfill('0') << word;
+      return os.str();
+    }
+  };
+
+  std::string hash_file(const std::filesystem::path &path)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      throw sys::system_error("Cannot open " + path.string() + ". Error code: " + std::string(std::strerror(errno)));
+    hasher_t hasher;
+    std::vector<char> buffer(1 << 20);
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0)
+      hasher.update(buffer.data(), n);
+    close(fd);
+    if (n < 0)
+      throw sys::system_error("Cannot read " + path.string() + ". Error code: " + std::string(std::strerror(errno)));
+    return hasher.digest();
+  }
+
+  std::string escape(const std::string &path)
+  {
+    std::string escaped;
+    for (char c : path)
+      if (c == '\\')
+        escaped += "\\\\";
+      else if (c == '\n')
+        escaped += "\\n";
+      else
+        escaped += c;
+    return escaped;
+  }
+
+  std::string unescape(const std::string &path)
+  {
+    std::string unescaped;
+    for (size_t i = 0; i < path.size(); i++)
+      if (path[i] == '\\' && i + 1 < path.size())
+        unescaped += path[++i] == 'n' ? '\n' : path[i];
+      else
+        unescaped += path[i];
+    return unescaped;
+  }
+
+  char type_of(mode_t mode)
+  {
+    if (S_ISREG(mode))
+      return 'f';
+    if (S_ISDIR(mode))
+      return 'd';
+    if (S_ISLNK(mode))
+      return 'l';
+    if (S_ISCHR(mode))
+      return 'c';
+    if (S_ISBLK(mode))
+      return 'b';
+    if (S_ISFIFO(mode))
+      return 'p';
+    return 's';
+  }
+
+  entry_t stat_entry(const std::filesystem::path &root, const std::string &relative)
+  {
+    struct stat st;
+    std::filesystem::path full = root / relative;
+    if (lstat(full.c_str(), &st) != 0)
+      throw sys::system_error("Cannot stat " + full.string() + ". Error code: " + std::string(std::strerror(errno)));
+    return {.path = relative, .type = type_of(st.st_mode), .mode = st.st_mode & 07777, .uid = st.st_uid, .gid = st.st_gid,
+            .size = S_ISDIR(st.st_mode) ? 0 : (uint64_t)st.st_size, .mtime = st.st_mtim.tv_sec, .hash = "-"};
+  }
+
+  // Walks the tree and hashes the regular files in parallel. If only is given, just those paths are hashed.
+  std::vector<entry_t> generate(const std::filesystem::path &root, const std::set<std::string> *only = nullptr)
+  {
+    std::vector<entry_t> entries;
+    for (auto it = std::filesystem::recursive_directory_iterator(root); it != std::filesystem::recursive_directory_iterator(); it++)
+      entries.push_back(stat_entry(root, it->path().lexically_relative(root).string()));
+    std::sort(entries.begin(), entries.end(), [](const entry_t &a, const entry_t &b)
+              { return a.path < b.path; });
+
+    parallel::for_each(entries.size(), [&](size_t i)
+                       {
+                         entry_t &entry = entries[i];
+                         if (only && only->count(entry.path) == 0)
+                           return;
+                         if (entry.type == 'f')
+                           entry.hash = hash_file(root / entry.path);
+                         else if (entry.type == 'l')
+                         {
+                           hasher_t hasher;
+                           std::string target = std::filesystem::read_symlink(root / entry.path).string();
+                           hasher.update(target.data(), target.size());
+                           entry.hash = hasher.digest();
+                         } });
+    return entries;
+  }
+
+  void write(const std::vector<entry_t> &entries, std::ostream &os)
+  {
+    for (auto &e : entries)
+      os << e.type << " " << std::oct << e.mode << std::dec << " " << e.uid << " " << e.gid << " " << e.size << " "
+         << e.mtime << " " << e.hash << " " << escape(e.path) << "\n";
+  }
+
+  bool read_entry(std::istream &is, entry_t &entry)
+  {
+    std::string line;
+    if (!std::getline(is, line))
+      return false;
+    std::istringstream ls(line);
+    if (!(ls >> entry.type >> std::oct >> entry.mode >> std::dec >> entry.uid >> entry.gid >> entry.size >> entry.mtime >> entry.hash))
+      throw std::runtime_error("Malformed manifest line: " + line);
+    ls.get();
+    std::string path;
+    std::getline(ls, path);
+    entry.path = unescape(path);
+    return true;
+  }
+
+  std::vector<entry_t> read(std::istream &is)
+  {
+    std::vector<entry_t> entries;
+    entry_t entry;
+    while (read_entry(is, entry))
+      entries.push_back(entry);
+    return entries;
+  }
+
+  // yields the entries of a manifest one by one, returns false at the end
+  typedef std::function<bool(entry_t &)> source_t;
+
+  source_t from_vector(const std::vector<entry_t> &entries)
+  {
+    return [&entries, i = size_t(0)](entry_t &entry) mutable
+    {
+      if (i >= entries.size())
+        return false;
+      entry = entries[i++];
+      return true;
+    };
+  }
+
+  source_t from_stream(std::istream &is)
+  {
+    return [&is](entry_t &entry)
+    { return read_entry(is, entry); };
+  }
+
+  // Merge-joins two sorted manifests in a single pass and reports every entry that was added, removed or
+  // modified. Only one entry of each side is held in memory.
+  void diff(source_t from, source_t to,
+            const std::function<void(const entry_t &)> &on_added,
+            const std::function<void(const entry_t &)> &on_removed,
+            const std::function<void(const entry_t &, const entry_t &)> &on_modified)
+  {
+    entry_t a, b;
+    std::string last_a, last_b;
+    auto next = [](source_t &source, entry_t &entry, std::string &last)
+    {
+      if (!source(entry))
+        return false;
+      if (!last.empty() && entry.path <= last)
+        throw std::runtime_error("Manifest is not sorted at " + entry.path);
+      last = entry.path;
+      return true;
+    };
+
+    bool has_a = next(from, a, last_a), has_b = next(to, b, last_b);
+    while (has_a || has_b)
+      if (!has_b || (has_a && a.path < b.path))
+      {
+        on_removed(a);
+        has_a = next(from, a, last_a);
+      }
+      else if (!has_a || b.path < a.path)
+      {
+        on_added(b);
+        has_b = next(to, b, last_b);
+      }
+      else
+      {
+        if (!a.same_content(b))
+          on_modified(a, b);
+        has_a = next(from, a, last_a);
+        has_b = next(to, b, last_b);
+      }
+  }
+
+  void diff(const std::vector<entry_t> &from, const std::vector<entry_t> &to,
+            const std::function<void(const entry_t &)> &on_added,
+            const std::function<void(const entry_t &)> &on_removed,
+            const std::function<void(const entry_t &, const entry_t &)> &on_modified)
+  {
+    diff(from_vector(from), from_vector(to), on_added, on_removed, on_modified);
+  }
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <ctime>
+#include <cstring>
+#include <unistd.h>
+
+#include "../interfaces/config.hpp"
+#include "../interfaces/log.hpp"
+#include "../interfaces/stats.hpp"
+#include "inventory.hpp"
+#include "history.hpp"
+#include "data.hpp"
+
+// Prometheus metrics in the text exposition format, written for the textfile collector of node_exporter.
+namespace metrics
+{
+  class writer_t
+  {
+    std::ostringstream os;
+
+  public:
+    void family(const std::string &name, const std::string &type, const std::string &help)
+    {
+      os << "# HELP " << name << " " << help << "\n"
+         << "# TYPE " << name << " " << type << "\n";
+    }
+
+    template <typename T>
+    void sample(const std::string &name, const std::map<std::string, std::string> &labels, T value)
+    {
+      os << name;
+      if (!labels.empty())
+      {
+        os << "{";
+        bool first = true;
+        for (auto &[key, label] : labels)
+        {
+          os << (first ? "" : ",") << key << "=\"";
+          for (char c : label)
+            if (c == '\\' || c == '"')
+              os << '\\' << c;
+            else if (c == '\n')
+              os << "\\n";
+            else
+              os << c;
+          os << "\"";
+          first = false;
+        }
+        os << "}";
+      }
+      os << " " << value << "\n";
+    }
+
+    std::string str() const
+    {
+      return os.str();
+    }
+  };
+
+  // the key: value lines of a build record
+  std::map<std::string, std::string> read_record(const std::filesystem::path &path)
+  {
+    std::map<std::string, std::string> record;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+      if (line.find(':') != std::string::npos)
+        record[trim(line.substr(0, line.find(':')))] = trim(line.substr(line.find(':') + 1));
+    return record;
+  }
+
+  std::string render(const config_t &config)
+  {
+    writer_t w;
+    inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+    auto current = inventory::current();
+    auto images = std::filesystem::exists(inventory::INVENTORY_PATH) ? inventory::list_images() : std::vector<std::string>{};
+
+    w.family("successor_image_size_bytes", "gauge", "Apparent size of the files of an image version.");
+    for (auto &image : images)
+      for (auto version : inventory::list_versions(image))
+        w.sample("successor_image_size_bytes", {{"image", image}, {"version", std::to_string(version)}}, inventory::size({image, version}));
+
+    w.family("successor_current_version", "gauge", "Version of the image the host is running.");
+    if (current.has_value())
+      w.sample("successor_current_version", {{"image", current->name}}, current->version);
+
+    w.family("successor_next_version", "gauge", "Version of the image the next boot will run.");
+    if (config.default_image_name.has_value())
+    {
+      entity_t next = inventory::resolve(config.default_image_name.value(), config.default_image_version.value_or(version_latest));
+      w.sample("successor_next_version", {{"image", next.name}}, next.version);
+    }
+
+    auto build = read_record(inventory::METADATA_PATH / "last_build");
+    if (!build.empty())
+    {
+      std::map<std::string, std::string> labels = {{"image", build["image"]}};
+      w.family("successor_last_build_success", "gauge", "Whether the last build succeeded.");
+      w.sample("successor_last_build_success", labels, build["result"] == "ok" ? 1 : 0);
+      w.family("successor_last_build_duration_seconds", "gauge", "Duration of the last build.");
+      w.sample("successor_last_build_duration_seconds", labels, std::stoll(build["duration_ms"]) / 1e3);
+      w.family("successor_last_build_timestamp_seconds", "gauge", "Unix time the last build started at.");
+      w.sample("successor_last_build_timestamp_seconds", labels, build["timestamp"]);
+    }
+
+    auto records = history::load();
+    w.family("successor_boots_total", "counter", "Switches into an image that reached the init executable.");
+    w.sample("successor_boots_total", {}, records.size());
+    w.family("successor_switch_failures_total", "counter", "Switches that failed and were rolled back.");
+    w.sample("successor_switch_failures_total", {}, history::count_failures());
+    if (!records.empty())
+    {
+      w.family("successor_last_switch_duration_seconds", "gauge", "Duration of the last switch until the init executable started.");
+      w.sample("successor_last_switch_duration_seconds", {}, records.back().switch_us / 1e6);
+      w.family("successor_last_switch_phase_seconds", "gauge", "Duration of each phase of the last switch.");
+      for (auto &[phase, us] : history::last_phases())
+        w.sample("successor_last_switch_phase_seconds", {{"phase", phase}}, us / 1e6);
+    }
+
+    uint64_t log_bytes = 0;
+    if (std::filesystem::exists(logging::LOG_PATH))
+      for (auto &entry : std::filesystem::recursive_directory_iterator(logging::LOG_PATH))
+        if (entry.is_regular_file())
+          log_bytes += entry.file_size();
+    w.family("successor_log_directory_bytes", "gauge", "Size of the successor log directory.");
+    w.sample("successor_log_directory_bytes", {}, log_bytes);
+
+    return w.str();
+  }
+
+  // Replaces the file atomically, so that the collector never reads half of it.
+  void write(const std::filesystem::path &file, const config_t &config)
+  {
+    std::string content = render(config);
+    std::filesystem::path tmp = file.string() + ".tmp." + std::to_string(getpid());
+    {
+      std::ofstream os(tmp);
+      os << content;
+      if (!os)
+        throw std::runtime_error("Cannot write " + tmp.string());
+    }
+    std::filesystem::permissions(tmp, std::filesystem::perms(0644));
+    std::filesystem::rename(tmp, file);
+  }
+
+  // Writes the metrics file of the config, if it has one. A failure is only a warning, it never fails a command.
+  void refresh(const config_t &config, logging::logger_t &logger)
+  {
+    if (config.metrics_file.has_value())
+      try
+      {
+        write(config.metrics_file.value(), config);
+      }
+      catch (const std::exception &e)
+      {
+        logger.warn() << "Warning: cannot write metrics: " << e.what() << std::endl;
+      }
+  }
+
+  // Like refresh, in a detached process, so that walking the versions without a manifest for their size stays off
+  // the boot of callers that are about to exec an init.
+  void refresh_in_background(const config_t &config, logging::logger_t &logger)
+  {
+    if (!config.metrics_file.has_value())
+      return;
+    // or the child would print what is still buffered once more
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == -1)
+      logger.warn() << "Warning: cannot write metrics. Error code: " << std::strerror(errno) << std::endl;
+    if (pid != 0)
+      return;
+
+    setsid();
+    refresh(config, logger);
+    _exit(0);
+  }
+
+  // Records a permanent switch for `list --timings`, `successor stats` and the metrics. Called by successor and
+  // successor-init once the root is switched, as the init of the image replaces them right after.
+  history::record_t record_switch(const config_t &config, const entity_t &entity, int64_t switch_us,
+                                  const std::vector<std::pair<std::string, int64_t>> &phases, logging::logger_t &logger)
+  {
+    history::record_t record = {.timestamp = std::time(nullptr), .boot = history::boot_id(), .name = entity.name, .version = entity.version,
+                                .switch_us = switch_us, .exec_us = history::since_start_us()};
+    try
+    {
+      history::append(record);
+      history::append_phases(record.boot, phases);
+      if (config.ready_marker.has_value())
+        history::watch_readiness(record.boot, config.ready_marker.value(), config.ready_timeout.value_or(history::DEFAULT_READY_TIMEOUT));
+    }
+    catch (const std::exception &e)
+    {
+      logger.warn() << "Warning: cannot record boot timings: " << e.what() << std::endl;
+    }
+    try
+    {
+      stats::save("switch");
+    }
+    catch (const std::exception &e)
+    {
+      logger.warn() << "Warning: cannot store statistics: " << e.what() << std::endl;
+    }
+    refresh_in_background(config, logger);
+    return record;
+  }
+
+  // Records a switch that failed before the init of the image ran, counted by the metrics.
+  void record_failure(const config_t &config, const entity_t &entity, logging::logger_t &logger)
+  {
+    try
+    {
+      history::append_failure(std::time(nullptr), entity.name, entity.version);
+    }
+    catch (const std::exception &e)
+    {
+      logger.warn() << "Warning: cannot record the failed switch: " << e.what() << std::endl;
+    }
+    refresh(config, logger);
+  }
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef oci_hpp
+#define oci_hpp
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <filesystem>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/parallel.hpp"
+#include "../interfaces/json.hpp"
+#include "inventory.hpp"
+#include "manifest.hpp"
+#include "data.hpp"
+
+// Ingests local OCI image layouts (https://github.com/opencontainers/image-spec/blob/main/image-layout.md)
+// without a container engine. Layers are extracted in parallel into separate directories, then merged in
+// order with renames, applying whiteouts on the way. As every layer is extracted on its own, a hardlink to a file
+// of a lower layer cannot be created and fails the build.
+namespace oci
+{
+  const std::string WHITEOUT_PREFIX = ".wh.";
+  const std::string OPAQUE_WHITEOUT = ".wh..wh..opq";
+
+  struct layer_t
+  {
+    std::string media_type;
+    std::filesystem::path blob;
+  };
+
+  std::filesystem::path blob_path(const std::filesystem::path &layout, const std::string &digest)
+  {
+    auto colon = digest.find(':');
+    if (colon == std::string::npos || digest.find('/') != std::string::npos)
+      throw std::runtime_error("Invalid digest " + digest);
+    return layout / "blobs" / digest.substr(0, colon) / digest.substr(colon + 1);
+  }
+
+  std::string host_architecture()
+  {
+    struct utsname name;
+    uname(&name);
+    std::string machine = name.machine;
+    if (machine == "x86_64")
+      return "amd64";
+    if (machine == "aarch64")
+      return "arm64";
+    if (machine.rfind("arm", 0) == 0)
+      return "arm";
+    if (machine == "i686" || machine == "i386")
+      return "386";
+    return machine;
+  }
+
+  bool is_index(const json::value_t &descriptor)
+  {
+    std::string type = descriptor.get("mediaType");
+    return type == "application/vnd.oci.image.index.v1+json" || type == "application/vnd.docker.distribution.manifest.list.v2+json";
+  }
+
+  // Picks the manifest for the host architecture from an index, descending into nested indexes.
+  json::value_t find_manifest(const std::filesystem::path &layout, const json::value_t &index)
+  {
+    const json::value_t *chosen = nullptr;
+    for (auto &descriptor : index.at("manifests").array)
+    {
+      if (descriptor.has("platform") && descriptor.at("platform").get("architecture") != host_architecture())
+        continue;
+      chosen = &descriptor;
+      break;
+    }
+    if (!chosen)
+      throw std::runtime_error("OCI layout has no manifest for " + host_architecture());
+
+    json::value_t blob = json::load(blob_path(layout, chosen->get("digest")));
+    if (is_index(*chosen) || blob.has("manifests"))
+      return find_manifest(layout, blob);
+    return blob;
+  }
+
+  std::vector<layer_t> list_layers(const std::filesystem::path &layout)
+  {
+    if (!std::filesystem::exists(layout / "oci-layout") || !std::filesystem::exists(layout / "index.json"))
+      throw std::runtime_error(layout.string() + " is not an OCI image layout");
+
+    json::value_t manifest = find_manifest(layout, json::load(layout / "index.json"));
+    std::vector<layer_t> layers;
+    for (auto &descriptor : manifest.at("layers").array)
+      layers.push_back({.media_type = descriptor.get("mediaType"), .blob = blob_path(layout, descriptor.get("digest"))});
+    return layers;
+  }
+
+  std::vector<std::string> decompressor(const layer_t &layer)
+  {
+    const std::string &type = layer.media_type;
+    auto ends_with = [&type](const std::string &suffix)
+    { return type.size() >= suffix.size() && type.compare(type.size() - suffix.size(), suffix.size(), suffix) == 0; };
+
+    if (ends_with("+zstd"))
+      return {"zstd", "-d", "-q", "-c", layer.blob.string()};
+    if (ends_with("+gzip") || ends_with(".gzip"))
+      return {sys::binary_exists("pigz") ? "pigz" : "gzip", "-d", "-c", layer.blob.string()};
+    if (ends_with(".tar") || ends_with("tar.v1.tar") || type == "application/vnd.oci.image.layer.v1.tar")
+      return {};
+    throw std::runtime_error("Unsupported layer media type " + type);
+  }
+
+  void extract_layer(const layer_t &layer, const std::filesystem::path &dest)
+  {
+    std::filesystem::create_directories(dest);
+    std::vector<std::string> tar = {"tar", "--xattrs", "--xattrs-include=*", "--numeric-owner", "--same-owner", "-C", dest.string(), "-xf"};
+    auto decompress = decompressor(layer);
+    int result;
+    if (decompress.empty())
+    {
+      tar.push_back(layer.blob.string());
+      result = sys::execute_pipeline({tar});
+    }
+    else
+    {
+      tar.push_back("-");
+      result = sys::execute_pipeline({decompress, tar});
+    }
+    if (result != 0)
+      throw std::runtime_error("Cannot extract layer " + layer.blob.filename().string());
+  }
+
+  void copy_metadata(const std::filesystem::path &from, const std::filesystem::path &to)
+  {
+    struct stat st;
+    if (lstat(from.c_str(), &st) != 0)
+      throw sys::system_error("Cannot stat " + from.string() + ". Error code: " + std::string(std::strerror(errno)));
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (lchown(to.c_str(), st.st_uid, st.st_gid) != 0 || chmod(to.c_str(), st.st_mode & 07777) != 0 ||
+        utimensat(AT_FDCWD, to.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+      throw sys::system_error("Cannot update " + to.string() + ". Error code: " + std::string(std::strerror(errno)));
+  }
+
+  // Whiteouts in a directory that did not exist in the lower layers hide nothing, they only have to go.
+  void strip_whiteouts(const std::filesystem::path &dir)
+  {
+    std::vector<std::filesystem::path> whiteouts;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir); it != std::filesystem::recursive_directory_iterator(); it++)
+      if (it->path().filename().string().rfind(WHITEOUT_PREFIX, 0) == 0)
+        whiteouts.push_back(it->path());
+    for (auto &whiteout : whiteouts)
+      std::filesystem::remove(whiteout);
+  }
+
+  // Moves the content of an extracted layer over the root filesystem built from the layers below it.
+  void merge(const std::filesystem::path &layer, const std::filesystem::path &root)
+  {
+    if (std::filesystem::exists(std::filesystem::symlink_status(layer / OPAQUE_WHITEOUT)))
+    {
+      for (auto &entry : std::filesystem::directory_iterator(root))
+        std::filesystem::remove_all(entry.path());
+      std::filesystem::remove(layer / OPAQUE_WHITEOUT);
+    }
+
+    // entries are moved out of the layer, so the listing is taken before touching anything
+    std::vector<std::filesystem::directory_entry> entries(std::filesystem::directory_iterator(layer), {}), kept;
+    // all whiteouts first, a file may be deleted and recreated by the same layer in either listing order
+    for (auto &entry : entries)
+    {
+      std::string name = entry.path().filename().string();
+      if (name.rfind(WHITEOUT_PREFIX, 0) != 0)
+      {
+        kept.push_back(entry);
+        continue;
+      }
+      std::string hidden = name.substr(WHITEOUT_PREFIX.size());
+      if (hidden.empty() || hidden == "." || hidden == "..")
+        throw std::runtime_error("Invalid whiteout " + entry.path().string());
+      std::filesystem::remove_all(root / hidden);
+    }
+
+    for (auto &entry : kept)
+    {
+      std::filesystem::path target = root / entry.path().filename();
+      auto target_status = std::filesystem::symlink_status(target);
+      if (entry.is_directory() && !entry.is_symlink() && std::filesystem::is_directory(target_status))
+      {
+        merge(entry.path(), target);
+        copy_metadata(entry.path(), target);
+        continue;
+      }
+
+      if (std::filesystem::exists(target_status))
+        std::filesystem::remove_all(target);
+      std::filesystem::rename(entry.path(), target);
+      if (entry.is_directory() && !entry.is_symlink())
+        strip_whiteouts(target);
+    }
+  }
+
+  // Builds the version entity from the OCI image layout, all in a staging directory that is renamed into the
+  // inventory at the end, along with its manifest.
+  void build(entity_t entity, const std::filesystem::path &layout, const inventory::before_publish_t &before_publish = nullptr)
+  {
+    auto layers = list_layers(layout);
+    std::cout << "Extracting " << layers.size() << " layers from " << layout.string() << std::endl;
+
+    std::filesystem::path staging = inventory::stage("oci");
+    std::filesystem::path root = staging / "root";
+    try
+    {
+      parallel::for_each(layers.size(), [&](size_t i)
+                         { extract_layer(layers[i], staging / "layers" / std::to_string(i)); });
+
+      inventory::create(root);
+      for (size_t i = 0; i < layers.size(); i++)
+        merge(staging / "layers" / std::to_string(i), root);
+
+      std::optional<std::vector<manifest::entry_t>> entries;
+      if (before_publish)
+        entries = before_publish(root);
+      inventory::publish(root, entity, entries.has_value() ? entries : manifest::generate(root));
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(root))
+        inventory::destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+  }
+}
+
+#endif
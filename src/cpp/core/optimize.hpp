@@ -0,0 +1,325 @@
+#ifndef optimize_hpp
+#define optimize_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <tuple>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/parallel.hpp"
+#include "inventory.hpp"
+#include "manifest.hpp"
+#include "lazy.hpp"
+#include "tier.hpp"
+#include "data.hpp"
+
+// Post-build optimization of a tree, in three steps:
+//   prune    removes the paths matching the prune_paths globs of the config, e.g. /usr/share/doc/*
+//   rewrite  copies the small files anew, those the image opened at its earlier boots first and the rest by
+//            directory, so that the filesystem allocates the files read together next to each other
+//   link     replaces identical regular files by hardlinks to a single copy
+// Files carrying xattrs, e.g. file capabilities, are neither rewritten nor linked, as neither keeps them.
+namespace optimize
+{
+  const uint64_t SMALL_FILE_SIZE = 256 << 10;
+  const std::string TMP_SUFFIX = ".succ-optimize";
+
+  struct options_t
+  {
+    std::vector<std::string> prune_paths;
+    // paths in the order they were read at boot
+    std::optional<std::filesystem::path> hot_list;
+  };
+
+  struct report_t
+  {
+    uint64_t pruned = 0;
+    uint64_t rewritten = 0;
+    uint64_t linked = 0;
+    uint64_t bytes_before = 0;
+    uint64_t bytes_after = 0;
+  };
+
+  // `*` matches across slashes, so that /usr/share/locale/* removes everything below the directory
+  bool matches(const std::vector<std::string> &globs, const std::string &path)
+  {
+    std::string absolute = "/" + path;
+    for (auto &glob : globs)
+      if (fnmatch(glob.c_str(), absolute.c_str(), 0) == 0)
+        return true;
+    return false;
+  }
+
+  bool has_xattrs(const std::filesystem::path &path)
+  {
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    return size > 0 || (size < 0 && errno != ENOTSUP);
+  }
+
+  // Bytes allocated to the regular files of the tree, counting every inode once.
+  uint64_t disk_usage(const std::filesystem::path &root, const std::vector<manifest::entry_t> &entries)
+  {
+    std::set<std::pair<dev_t, ino_t>> seen;
+    uint64_t total = 0;
+    for (auto &entry : entries)
+    {
+      struct stat st;
+      if (entry.type != 'f' || lstat((root / entry.path).c_str(), &st) != 0)
+        continue;
+      if (seen.insert({st.st_dev, st.st_ino}).second)
+        total += st.st_blocks * 512;
+    }
+    return total;
+  }
+
+  std::vector<manifest::entry_t> prune(const std::filesystem::path &root, const std::vector<manifest::entry_t> &entries,
+                                       const std::vector<std::string> &globs, report_t &report)
+  {
+    std::vector<manifest::entry_t> kept;
+    std::set<std::string> pruned_dirs;
+    for (auto &entry : entries)
+    {
+      bool below_pruned = false;
+      for (size_t slash = entry.path.find('/'); slash != std::string::npos && !below_pruned; slash = entry.path.find('/', slash + 1))
+        below_pruned = pruned_dirs.count(entry.path.substr(0, slash)) > 0;
+      if (below_pruned)
+        continue;
+      if (!matches(globs, entry.path))
+      {
+        kept.push_back(entry);
+        continue;
+      }
+      std::filesystem::remove_all(root / entry.path);
+      report.pruned++;
+      if (entry.type == 'd')
+        pruned_dirs.insert(entry.path);
+    }
+    return kept;
+  }
+
+  // Replaces the file by a fresh copy with the same owner, mode and times.
+  void rewrite(const std::filesystem::path &path)
+  {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+      throw sys::system_error("Cannot stat " + path.string() + ". Error code: " + std::string(std::strerror(errno)));
+    std::filesystem::path tmp = path.string() + TMP_SUFFIX;
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+      throw sys::system_error("Cannot open " + path.string() + ". Error code: " + std::string(std::strerror(errno)));
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out == -1)
+    {
+      close(in);
+      throw sys::system_error("Cannot create " + tmp.string() + ". Error code: " + std::string(std::strerror(errno)));
+    }
+    // read and write rather than copy_file_range, which may share the extents instead of allocating new ones
+    std::vector<char> buffer(SMALL_FILE_SIZE);
+    ssize_t n;
+    bool ok = true;
+    while ((n = read(in, buffer.data(), buffer.size())) > 0)
+      if (write(out, buffer.data(), n) != n)
+      {
+        ok = false;
+        break;
+      }
+    ok = ok && n == 0;
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    // the owner first, as chown clears the setuid and setgid bits
+    ok = ok && fchown(out, st.st_uid, st.st_gid) == 0 && fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0;
+    int error = errno;
+    close(in);
+    ok = close(out) == 0 && ok;
+    if (!ok)
+    {
+      std::filesystem::remove(tmp);
+      throw sys::system_error("Cannot rewrite " + path.string() + ". Error code: " + std::string(std::strerror(error)));
+    }
+    std::filesystem::rename(tmp, path);
+  }
+
+  // Small files in the order they are read at boot, as far as the hot list knows it, then by path.
+  std::vector<size_t> boot_order(const std::vector<manifest::entry_t> &entries, const std::optional<std::filesystem::path> &hot_list)
+  {
+    std::map<std::string, size_t> by_path;
+    for (size_t i = 0; i < entries.size(); i++)
+      if (entries[i].type == 'f' && entries[i].size > 0 && entries[i].size <= SMALL_FILE_SIZE)
+        by_path[entries[i].path] = i;
+
+    std::vector<size_t> order;
+    if (hot_list.has_value())
+    {
+      std::ifstream is(hot_list.value());
+      std::string line;
+      while (std::getline(is, line))
+      {
+        auto it = by_path.find(manifest::unescape(line));
+        if (it == by_path.end())
+          continue;
+        order.push_back(it->second);
+        by_path.erase(it);
+      }
+    }
+    std::vector<size_t> rest;
+    for (auto &[path, i] : by_path)
+      rest.push_back(i);
+    std::sort(rest.begin(), rest.end());
+    order.insert(order.end(), rest.begin(), rest.end());
+    return order;
+  }
+
+  bool same_bytes(const std::filesystem::path &a, const std::filesystem::path &b)
+  {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    std::vector<char> ba(1 << 16), bb(1 << 16);
+    while (fa && fb)
+    {
+      fa.read(ba.data(), ba.size());
+      fb.read(bb.data(), bb.size());
+      if (fa.gcount() != fb.gcount() || std::memcmp(ba.data(), bb.data(), fa.gcount()) != 0)
+        return false;
+    }
+    return fa.eof() && fb.eof();
+  }
+
+  // Links every file to the first identical one in `rank` order. Identical means the same content, owner and
+  // mode, as they end up sharing an inode; the contents are compared in full before linking.
+  void link_duplicates(const std::filesystem::path &root, std::vector<manifest::entry_t> &entries,
+                       const std::vector<size_t> &rank, std::set<size_t> &skipped, report_t &report)
+  {
+    std::map<std::tuple<std::string, uint64_t, mode_t, uid_t, gid_t>, std::vector<size_t>> groups;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+      auto &entry = entries[i];
+      if (entry.type == 'f' && entry.size > 0 && entry.hash != "-" && skipped.count(i) == 0)
+        groups[{entry.hash, entry.size, entry.mode, entry.uid, entry.gid}].push_back(i);
+    }
+    std::vector<std::vector<size_t>> duplicates;
+    for (auto &[key, members] : groups)
+      if (members.size() > 1)
+      {
+        std::sort(members.begin(), members.end(), [&](size_t a, size_t b)
+                  { return rank[a] < rank[b]; });
+        duplicates.push_back(members);
+      }
+
+    std::atomic<uint64_t> linked(0);
+    parallel::for_each(duplicates.size(), [&](size_t g)
+                       {
+                         auto &members = duplicates[g];
+                         std::filesystem::path first = root / entries[members[0]].path;
+                         struct stat first_st;
+                         if (lstat(first.c_str(), &first_st) != 0)
+                           return;
+                         for (size_t j = 1; j < members.size(); j++)
+                         {
+                           auto &entry = entries[members[j]];
+                           std::filesystem::path path = root / entry.path;
+                           struct stat st;
+                           if (lstat(path.c_str(), &st) != 0 || (st.st_dev == first_st.st_dev && st.st_ino == first_st.st_ino))
+                             continue;
+                           if (!same_bytes(first, path))
+                             continue;
+                           std::filesystem::path tmp = path.string() + TMP_SUFFIX;
+                           // EMLINK once the first copy has as many links as the filesystem allows
+                           if (link(first.c_str(), tmp.c_str()) != 0)
+                             continue;
+                           std::filesystem::rename(tmp, path);
+                           entry.mtime = entries[members[0]].mtime;
+                           linked++;
+                         } });
+    report.linked += linked;
+  }
+
+  // Optimizes the tree in place and returns its manifest.
+  std::vector<manifest::entry_t> run(const std::filesystem::path &root, const options_t &options, report_t &report)
+  {
+    auto entries = manifest::generate(root);
+    report.bytes_before = disk_usage(root, entries);
+    if (!options.prune_paths.empty())
+      entries = prune(root, entries, options.prune_paths, report);
+
+    std::vector<size_t> order = boot_order(entries, options.hot_list);
+    std::vector<size_t> rank(entries.size(), entries.size());
+    for (size_t i = 0; i < order.size(); i++)
+      rank[order[i]] = i;
+    // files outside the boot order keep their path order behind it
+    for (size_t i = 0; i < entries.size(); i++)
+      if (rank[i] == entries.size())
+        rank[i] = order.size() + i;
+
+    std::vector<char> xattrs(entries.size(), 0);
+    parallel::for_each(entries.size(), [&](size_t i)
+                       { xattrs[i] = entries[i].type == 'f' && has_xattrs(root / entries[i].path); });
+    std::set<size_t> skipped;
+    for (size_t i = 0; i < entries.size(); i++)
+      if (xattrs[i])
+        skipped.insert(i);
+    for (auto i : order)
+    {
+      if (skipped.count(i))
+        continue;
+      rewrite(root / entries[i].path);
+      report.rewritten++;
+    }
+    link_duplicates(root, entries, rank, skipped, report);
+    report.bytes_after = disk_usage(root, entries);
+    return entries;
+  }
+
+  void print(const report_t &report)
+  {
+    int64_t saved = (int64_t)report.bytes_before - (int64_t)report.bytes_after;
+    std::cout << report.pruned << " paths pruned, " << report.rewritten << " small files rewritten, " << report.linked
+              << " duplicates linked, " << saved / 1048576.0 << " MiB saved (" << report.bytes_before / 1048576.0
+              << " -> " << report.bytes_after / 1048576.0 << " MiB)" << std::endl;
+  }
+
+  // Optimizes a copy of the version, which may be running or the base of a delta, into the next version.
+  entity_t version(entity_t base, const options_t &options)
+  {
+    if (!std::filesystem::exists(inventory::path(base)))
+      throw std::runtime_error("Image " + base.name + ":" + std::to_string(base.version) + " does not exist");
+    if (lazy::is_lazy(base))
+      throw std::runtime_error("Image " + base.name + ":" + std::to_string(base.version) + " is lazy, its files are in its blob store");
+    tier::rehydrate(base);
+
+    std::filesystem::path staging = inventory::stage("optimize");
+    std::filesystem::path root = staging / "root";
+    entity_t entity;
+    try
+    {
+      std::cout << "Cloning image " << base.name << ":" << base.version << std::endl;
+      inventory::clone(base, root);
+      report_t report;
+      auto entries = run(root, options, report);
+      print(report);
+      entity = inventory::publish(root, base.name, entries);
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(root))
+        inventory::destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    std::filesystem::remove_all(staging);
+    return entity;
+  }
+}
+
+#endif
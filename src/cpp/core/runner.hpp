@@ -7,15 +7,23 @@
 #include <stdexcept>
 #include <filesystem>
 #include <functional>
+#include <chrono>
 
 #include "../interfaces/system.hpp"
 #include "../interfaces/config.hpp"
 #include "../interfaces/log.hpp"
+#include "inventory.hpp"
+#include "lazy.hpp"
 
 namespace runner
 {
 
   const std::filesystem::path DEFAULT_ROOTBACK = "/succ/rootback";
+  // runner owned mounts, e.g. the tmpfs of ephemeral runs, live below it and are never migrated
+  const std::filesystem::path SCRATCH_PATH = "/succ/scratch";
+  const std::string DEFAULT_EPHEMERAL_SIZE = "50%";
+  const int DEFAULT_TO_RAM_PERCENT = 50;
+  const std::string DEFAULT_VOLATILE_SIZE = "25%";
 
   enum run_mode_t
   {
@@ -23,12 +31,44 @@ namespace runner
     RUN_MODE_TEMPORARY,
   };
 
+  struct run_options_t
+  {
+    // if set, the sysroot becomes the read-only lower layer of an overlay whose upper layer lives on a tmpfs of
+    // this size (anything tmpfs accepts, e.g. 2G or 50%) that is thrown away on rollback
+    std::optional<std::string> ephemeral_size;
+    // if set, the sysroot is copied to a tmpfs and run from memory, provided that it takes at most this percentage
+    // of the available memory; otherwise it runs from the disk as usual. The tmpfs is capped at that size as well.
+    std::optional<int> to_ram_percent;
+    // tmpfs mounts of the given sizes over these directories of the sysroot, so that what is written there never
+    // reaches the disk. Host mounts at or below them are left behind rather than stacked on top.
+    std::vector<std::pair<std::filesystem::path, std::string>> volatile_directories;
+    // if set and the rootback already holds a root, e.g. the host root of an earlier permanent run, the root
+    // being left is detached instead of stacked on top of it. That step cannot be rolled back, so it comes last.
+    bool drop_previous_root = false;
+    // if set, the sysroot is an empty lazy version, which is mounted from its blob store as an overlay whose upper
+    // layer keeps what the image writes
+    std::optional<lazy::source_t> lazy;
+    // called once the root is switched, right before the executable is started, with the time spent switching so
+    // far, in total and by phase
+    std::function<void(int64_t switch_us, const std::vector<std::pair<std::string, int64_t>> &phases)> on_switched;
+  };
+
   void run(logging::logger_t &logger, run_mode_t run_mode,
            std::filesystem::path sysroot,
            std::filesystem::path rootback,
            const std::vector<std::filesystem::path> &persistent_directories,
-           std::optional<std::filesystem::path> executable)
+           std::optional<std::filesystem::path> executable,
+           const run_options_t &options = {})
   {
+    auto start = std::chrono::steady_clock::now();
+    auto phase_start = start;
+    std::vector<std::pair<std::string, int64_t>> phases;
+    auto end_phase = [&phases, &phase_start](const std::string &name)
+    {
+      auto now = std::chrono::steady_clock::now();
+      phases.push_back({name, std::chrono::duration_cast<std::chrono::microseconds>(now - phase_start).count()});
+      phase_start = now;
+    };
     std::vector<std::function<void()>> rollback_stack;
     auto roll_one_back = [&rollback_stack]()
     {
@@ -57,19 +97,11 @@ namespace runner
       {
         throw std::runtime_error("sysroot does not exist.");
       }
-
-      std::filesystem::path tmprootback = "/tmprootback";
-      if (std::filesystem::exists(sysroot / tmprootback.relative_path()))
-      {
-        throw std::runtime_error("Temporary rootback directory already exists. Please remove it.");
-      }
-      if (!std::filesystem::create_directories(sysroot / tmprootback.relative_path()))
-      {
-        throw std::runtime_error("Cannot create temporary rootback directory.");
-      }
-      rollback_stack.push_back([&sysroot, tmprootback]()
-                               { if (std::filesystem::exists(sysroot / tmprootback.relative_path()))
-                                  std::filesystem::remove_all(sysroot / tmprootback.relative_path()); });
+      // until the rollback, or the exec of a permanent run, whose root is the current one from then on
+      int in_use = inventory::lock_in_use(sysroot);
+      rollback_stack.push_back([in_use]()
+                               { close(in_use); });
+      end_phase("namespace");
 
       logger.info() << "Preparing persistent directories..." << std::endl;
       for (const auto &p : persistent_directories)
@@ -83,22 +115,94 @@ namespace runner
         rollback_stack.push_back([p]()
                                  { sys::mnt::detach(p); });
       }
+      end_phase("persistent");
+
+      if (options.lazy.has_value())
+      {
+        const lazy::source_t &source = options.lazy.value();
+        logger.info() << "Mounting lazy image from " << source.store.string() << "..." << std::endl;
+        pid_t server = lazy::start(source);
+        rollback_stack.push_back([server, source]()
+                                 { lazy::stop(server, source.lower); });
+        std::filesystem::create_directories(source.upper);
+        std::filesystem::create_directories(source.work);
+        sys::mnt::overlay(source.lower, source.upper, source.work, sysroot);
+        rollback_stack.push_back([sysroot]()
+                                 { sys::mnt::detach(sysroot); });
+      }
+
+      if (options.ephemeral_size.has_value())
+      {
+        // after the persistent directories, so that binding /succ onto itself does not hide the scratch mount
+        logger.info() << "Mounting ephemeral overlay..." << std::endl;
+        std::filesystem::create_directories(SCRATCH_PATH);
+        sys::mnt::tmpfs(SCRATCH_PATH, options.ephemeral_size.value());
+        rollback_stack.push_back([]()
+                                 { sys::mnt::detach(SCRATCH_PATH); });
+        for (auto dir : {"upper", "work", "root"})
+          std::filesystem::create_directory(SCRATCH_PATH / dir);
+        sys::mnt::overlay(sysroot, SCRATCH_PATH / "upper", SCRATCH_PATH / "work", SCRATCH_PATH / "root");
+        rollback_stack.push_back([]()
+                                 { sys::mnt::detach(SCRATCH_PATH / "root"); });
+        sysroot = SCRATCH_PATH / "root";
+      }
+
+      if (options.to_ram_percent.has_value())
+      {
+        uint64_t needed = sys::fs::tree_size(sysroot);
+        uint64_t allowed = sys::memory_available() / 100 * options.to_ram_percent.value();
+        if (needed > allowed)
+          logger.warn() << "Warning: the image needs " << (needed >> 20) << " MiB of memory but only " << (allowed >> 20)
+                        << " MiB may be used. Running from the disk instead..." << std::endl;
+        else
+        {
+          logger.info() << "Copying " << (needed >> 20) << " MiB of the image to memory..." << std::endl;
+          std::filesystem::create_directories(SCRATCH_PATH);
+          sys::mnt::tmpfs(SCRATCH_PATH, std::to_string(allowed));
+          rollback_stack.push_back([]()
+                                   { sys::mnt::detach(SCRATCH_PATH); });
+          std::filesystem::create_directory(SCRATCH_PATH / "root");
+          sys::fs::copy_tree(sysroot, SCRATCH_PATH / "root");
+          sysroot = SCRATCH_PATH / "root";
+        }
+      }
+
+      end_phase("sysroot");
+
+      std::filesystem::path tmprootback = "/tmprootback";
+      if (std::filesystem::exists(sysroot / tmprootback.relative_path()))
+      {
+        throw std::runtime_error("Temporary rootback directory already exists. Please remove it.");
+      }
+      if (!std::filesystem::create_directories(sysroot / tmprootback.relative_path()))
+      {
+        throw std::runtime_error("Cannot create temporary rootback directory.");
+      }
+      rollback_stack.push_back([&sysroot, tmprootback]()
+                               { if (std::filesystem::exists(sysroot / tmprootback.relative_path()))
+                                  std::filesystem::remove_all(sysroot / tmprootback.relative_path()); });
 
       std::vector<std::string> migrating_mounts;
       logger.info() << "Registering mountpoints to move..." << std::endl;
+      auto is_below = [](const std::string &path, const std::string &parent)
+      { return path == parent || path.rfind(parent + "/", 0) == 0; };
       for (const auto &mountpoint : sys::mnt::list())
       {
         if (mountpoint.target == "/")
           continue;
-        if (find_if(migrating_mounts.begin(), migrating_mounts.end(), [&mountpoint](std::string &other)
-                    { return mountpoint.target.rfind(other) == 0; }) != migrating_mounts.end())
+        if (is_below(mountpoint.target, SCRATCH_PATH.string()))
           continue;
-        else
-        {
-          migrating_mounts.push_back(mountpoint.target);
-          std::remove_if(migrating_mounts.begin(), migrating_mounts.end(), [&mountpoint](std::string &other)
-                         { return other.rfind(mountpoint.target) == 0; });
-        }
+        if (find_if(options.volatile_directories.begin(), options.volatile_directories.end(), [&](auto &directory)
+                    { return is_below(mountpoint.target, directory.first.string()); }) != options.volatile_directories.end())
+          continue;
+        // moving a mountpoint moves the ones below it as well
+        if (find_if(migrating_mounts.begin(), migrating_mounts.end(), [&](std::string &other)
+                    { return is_below(mountpoint.target, other); }) != migrating_mounts.end())
+          continue;
+        migrating_mounts.erase(std::remove_if(migrating_mounts.begin(), migrating_mounts.end(), [&](std::string &other)
+                                              { return is_below(other, mountpoint.target); }),
+                               migrating_mounts.end());
+        migrating_mounts.push_back(mountpoint.target);
       }
 
       for (const auto &m : migrating_mounts)
@@ -111,11 +215,34 @@ namespace runner
           }
         }
 
+      end_phase("register");
+
       logger.info() << "Binding sysroot to itself..." << std::endl;
       sys::mnt::bind(sysroot, sysroot);
       rollback_stack.push_back([&sysroot]()
                                { sys::mnt::detach(sysroot); });
 
+      // on top of the bind, as a non-recursive bind would not carry them
+      for (const auto &[directory, size] : options.volatile_directories)
+      {
+        if (!directory.is_absolute())
+          throw std::runtime_error("Volatile directory " + directory.string() + " is not absolute.");
+        logger.info() << "Mounting volatile directory " << directory.string() << "..." << std::endl;
+        std::filesystem::path target = sysroot / directory.relative_path();
+        std::filesystem::create_directories(target);
+        // a symlink in the image must not lead the mount out of it
+        if (!is_below(std::filesystem::canonical(target).string(), std::filesystem::canonical(sysroot).string()))
+          throw std::runtime_error("Volatile directory " + directory.string() + " leads out of the image.");
+        struct stat st;
+        if (stat(target.c_str(), &st) != 0)
+          throw sys::system_error("Cannot stat " + target.string() + ". Error code: " + std::string(std::strerror(errno)));
+        char mode[8];
+        snprintf(mode, sizeof(mode), "%o", st.st_mode & 07777);
+        sys::mnt::mount_fs("tmpfs", target, "size=" + size + ",mode=" + mode, "tmpfs");
+        rollback_stack.push_back([target]()
+                                 { sys::mnt::detach(target); });
+      }
+
       logger.info() << "Setting root..." << std::endl;
       sys::pivot_root(sysroot, sysroot / tmprootback.relative_path());
       rollback_stack.push_back([tmprootback, &sysroot, &logger]()
@@ -128,6 +255,8 @@ namespace runner
       rollback_stack.push_back([previous_cwd]()
                                { std::filesystem::current_path(previous_cwd); });
 
+      end_phase("pivot");
+
       for (const std::string &mountpoint : migrating_mounts)
       {
         logger.info() << "Moving mountpoint " << mountpoint << "..." << std::endl;
@@ -153,21 +282,37 @@ namespace runner
         }
       }
 
-      logger.info() << "Moving tmprootback..." << std::endl;
+      end_phase("mounts");
+
       if (!std::filesystem::exists(rootback))
         throw std::runtime_error("Rootback directory " + rootback.string() + " does not exist.");
-      sys::mnt::move(tmprootback, rootback);
-      std::filesystem::remove(tmprootback);
-      rollback_stack.push_back([&rootback, tmprootback]()
-                               {
-        std::filesystem::create_directory(tmprootback);
-        sys::mnt::move(rootback, tmprootback); });
+      if (options.drop_previous_root && sys::mnt::is_mountpoint(rootback))
+      {
+        logger.info() << "Detaching previous root..." << std::endl;
+        sys::mnt::detach_lazily(tmprootback);
+        std::filesystem::remove(tmprootback);
+        rollback_stack.clear();
+      }
+      else
+      {
+        logger.info() << "Moving tmprootback..." << std::endl;
+        sys::mnt::move(tmprootback, rootback);
+        std::filesystem::remove(tmprootback);
+        rollback_stack.push_back([&rootback, tmprootback]()
+                                 {
+          std::filesystem::create_directory(tmprootback);
+          sys::mnt::move(rootback, tmprootback); });
+      }
+      end_phase("rootback");
+
+      if (options.on_switched)
+        options.on_switched(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), phases);
 
       if (executable)
       {
         logger.info() << "Executing " << executable.value() << "..." << std::endl;
         bool replace = run_mode == run_mode_t::RUN_MODE_PERMANENT;
-        int result = sys::execute(executable.value(), {}, false);
+        int result = sys::execute(executable.value(), {}, replace);
         // it will be unreachable for replace == true
         if (result != 0)
           logger.warn() << "Warning: executable exited with code " << result << std::endl;
@@ -179,7 +324,7 @@ namespace runner
       logger.info() << "Rolling back..." << std::endl;
       roll_all_back();
       logger.info() << "Rollback complete." << std::endl;
-      throw e;
+      throw;
     }
 
     logger.info() << "Rolling back..." << std::endl;
@@ -0,0 +1,298 @@
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <regex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/config.hpp"
+#include "inventory.hpp"
+#include "data.hpp"
+
+// Builds the images of a build manifest with a bounded pool of `successor build` processes. A manifest maps
+// image names to their build:
+//
+//   base:
+//     source: base/Containerfile
+//   web:
+//     source: web/Containerfile
+//     context: web
+//     after: base
+//   tools:
+//     oci: layouts/tools
+//
+// source is the Containerfile and context the build context, the directory of the manifest by default. oci
+// ingests an OCI image layout instead, `stream: true` streams the builder output and `optimize: true` optimizes the
+// result like --optimize. after lists, comma separated, the images that must be built first; images whose
+// Containerfile is FROM another image of the manifest depend on it as well. Relative paths are relative to the
+// manifest.
+namespace scheduler
+{
+  const int DEFAULT_JOBS = 2;
+
+  struct job_t
+  {
+    std::string name;
+    std::filesystem::path source;
+    std::filesystem::path context;
+    std::optional<std::filesystem::path> oci_layout;
+    bool stream = false;
+    bool optimize = false;
+    std::set<std::string> after;
+  };
+
+  enum status_t
+  {
+    STATUS_PENDING,
+    STATUS_RUNNING,
+    STATUS_SUCCEEDED,
+    STATUS_FAILED,
+    STATUS_SKIPPED, // a dependency failed
+  };
+
+  struct result_t
+  {
+    std::string name;
+    status_t status = STATUS_PENDING;
+    int version = 0;
+    int64_t duration_ms = 0;
+    uint64_t size = 0;
+    std::filesystem::path log;
+  };
+
+  // The images named by the FROM lines of a Containerfile, without registry, tag or digest.
+  std::set<std::string> base_images(const std::filesystem::path &containerfile)
+  {
+    std::set<std::string> images;
+    std::ifstream file(containerfile);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream is(line);
+      std::string word, image;
+      is >> word;
+      std::transform(word.begin(), word.end(), word.begin(), ::toupper);
+      if (word != "FROM")
+        continue;
+      while (is >> image && image.rfind("--", 0) == 0)
+        ;
+      image = image.substr(image.find_last_of('/') + 1);
+      images.insert(image.substr(0, image.find_first_of(":@")));
+    }
+    return images;
+  }
+
+  std::vector<job_t> load(const std::filesystem::path &manifest)
+  {
+    std::ifstream file(manifest);
+    if (!file.is_open())
+      throw std::runtime_error("Cannot open build manifest " + manifest.string());
+    std::filesystem::path base = std::filesystem::absolute(manifest).parent_path();
+
+    std::vector<job_t> jobs;
+    std::string line;
+    while (std::getline(file, line))
+    {
+      if (line.find('#') != std::string::npos)
+        line = line.substr(0, line.find('#'));
+      if (trim(line).empty())
+        continue;
+
+      if (line[0] != ' ' && line[0] != '\t')
+      {
+        std::string name = trim(line.substr(0, line.find(':')));
+        if (!std::regex_match(name, image_name_regex()))
+          throw std::runtime_error("Invalid image name " + name + " in build manifest");
+        for (auto &job : jobs)
+          if (job.name == name)
+            throw std::runtime_error("Image " + name + " appears twice in build manifest");
+        jobs.push_back({.name = name, .context = base});
+        continue;
+      }
+
+      if (jobs.empty() || line.find(':') == std::string::npos)
+        throw std::runtime_error("Invalid build manifest line: " + trim(line));
+      job_t &job = jobs.back();
+      std::string key = trim(line.substr(0, line.find(':')));
+      std::string value = trim(line.substr(line.find(':') + 1));
+      if (key == "source")
+        job.source = base / value;
+      else if (key == "context")
+        job.context = base / value;
+      else if (key == "oci")
+        job.oci_layout = base / value;
+      else if (key == "stream")
+        job.stream = value == "true" || value == "yes";
+      else if (key == "optimize")
+        job.optimize = value == "true" || value == "yes";
+      else if (key == "after")
+      {
+        std::istringstream is(value);
+        std::string dependency;
+        while (std::getline(is, dependency, ','))
+          if (!trim(dependency).empty())
+            job.after.insert(trim(dependency));
+      }
+      else
+        throw std::runtime_error("Unknown key " + key + " of image " + job.name + " in build manifest");
+    }
+
+    std::set<std::string> names;
+    for (auto &job : jobs)
+      names.insert(job.name);
+    for (auto &job : jobs)
+    {
+      if (job.source.empty() == !job.oci_layout.has_value())
+        throw std::runtime_error("Image " + job.name + " needs exactly one of source and oci in build manifest");
+      for (auto &dependency : job.after)
+        if (!names.count(dependency))
+          throw std::runtime_error("Image " + job.name + " depends on " + dependency + ", which is not in the build manifest");
+      if (!job.source.empty())
+        for (auto &image : base_images(job.source))
+          if (names.count(image) && image != job.name)
+            job.after.insert(image);
+    }
+    return jobs;
+  }
+
+  // Throws if the dependencies form a cycle, which would leave some images waiting forever.
+  void check_cycles(const std::vector<job_t> &jobs)
+  {
+    std::map<std::string, const job_t *> by_name;
+    for (auto &job : jobs)
+      by_name[job.name] = &job;
+    std::map<std::string, int> state; // 1 while visiting, 2 once done
+    std::function<void(const job_t &)> visit = [&](const job_t &job)
+    {
+      if (state[job.name] == 2)
+        return;
+      if (state[job.name] == 1)
+        throw std::runtime_error("Build manifest has a dependency cycle through " + job.name);
+      state[job.name] = 1;
+      for (auto &dependency : job.after)
+        visit(*by_name[dependency]);
+      state[job.name] = 2;
+    };
+    for (auto &job : jobs)
+      visit(job);
+  }
+
+  std::vector<std::string> command(const job_t &job)
+  {
+    std::vector<std::string> command = {"/proc/self/exe", "build", "--name", job.name};
+    if (job.optimize)
+      command.push_back("--optimize");
+    if (job.oci_layout.has_value())
+    {
+      command.push_back("--from-oci");
+      command.push_back(job.oci_layout->string());
+      return command;
+    }
+    if (job.stream)
+      command.push_back("--stream");
+    command.push_back(job.source.string());
+    return command;
+  }
+
+  // Runs up to workers builds at a time, each as soon as its dependencies are built. The builds share the
+  // layer cache of the container builder, as they all run it as the same user. The output of every build goes
+  // to its own log, which ends up next to the version it built.
+  std::vector<result_t> run(const std::vector<job_t> &jobs, size_t workers)
+  {
+    check_cycles(jobs);
+    std::vector<result_t> results(jobs.size());
+    std::map<pid_t, size_t> running;
+    std::map<size_t, std::chrono::steady_clock::time_point> started;
+    auto status_of = [&](const std::string &name)
+    {
+      for (size_t i = 0; i < jobs.size(); i++)
+        if (jobs[i].name == name)
+          return results[i].status;
+      return STATUS_SKIPPED;
+    };
+
+    for (size_t i = 0; i < jobs.size(); i++)
+      results[i].name = jobs[i].name;
+
+    while (true)
+    {
+      bool progress = true;
+      while (progress)
+      {
+        progress = false;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+          if (results[i].status != STATUS_PENDING)
+            continue;
+          bool ready = true, blocked = false;
+          for (auto &dependency : jobs[i].after)
+          {
+            status_t status = status_of(dependency);
+            ready = ready && status == STATUS_SUCCEEDED;
+            blocked = blocked || status == STATUS_FAILED || status == STATUS_SKIPPED;
+          }
+          if (blocked)
+          {
+            results[i].status = STATUS_SKIPPED;
+            std::cout << "[" << jobs[i].name << "] skipped, a dependency failed" << std::endl;
+            progress = true;
+            continue;
+          }
+          if (!ready || running.size() >= workers)
+            continue;
+
+          results[i].log = inventory::METADATA_PATH / jobs[i].name / "last_build.log";
+          std::filesystem::create_directories(results[i].log.parent_path());
+          int log = open(results[i].log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+          if (log == -1)
+            throw sys::system_error("Cannot open " + results[i].log.string() + ". Error code: " + std::string(std::strerror(errno)));
+          pid_t pid = sys::spawn(command(jobs[i]), -1, log, jobs[i].context.string());
+          close(log);
+          running[pid] = i;
+          started[i] = std::chrono::steady_clock::now();
+          results[i].status = STATUS_RUNNING;
+          std::cout << "[" << jobs[i].name << "] started, logging to " << results[i].log.string() << std::endl;
+          progress = true;
+        }
+      }
+
+      if (running.empty())
+        break;
+
+      auto [pid, code] = sys::wait_any();
+      if (!running.count(pid))
+        continue;
+      size_t i = running[pid];
+      running.erase(pid);
+      result_t &result = results[i];
+      result.duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started[i]).count();
+      result.status = code == 0 ? STATUS_SUCCEEDED : STATUS_FAILED;
+      if (result.status == STATUS_SUCCEEDED)
+      {
+        entity_t entity = inventory::resolve(jobs[i].name, version_latest);
+        result.version = entity.version;
+        result.size = inventory::size(entity);
+        std::filesystem::create_directories(inventory::metadata_path(entity));
+        std::filesystem::rename(result.log, inventory::metadata_path(entity) / "build.log");
+        result.log = inventory::metadata_path(entity) / "build.log";
+      }
+      std::cout << "[" << jobs[i].name << "] " << (result.status == STATUS_SUCCEEDED ? "built" : "failed") << " in "
+                << result.duration_ms / 1000.0 << " s" << std::endl;
+    }
+    return results;
+  }
+}
+
+#endif
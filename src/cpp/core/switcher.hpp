@@ -0,0 +1,92 @@
+#ifndef switcher_hpp
+#define switcher_hpp
+
+#include <string>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+
+#include "../interfaces/config.hpp"
+#include "inventory.hpp"
+#include "lazy.hpp"
+#include "data.hpp"
+
+// Soft switches: moving a running system into another image without going through the firmware. Only PID 1 can
+// exec the init of the new image, so a switch asked for anywhere else is written down as a request and handed to
+// the running init through the switch_command of the config, which is expected to stop the services and exec
+// `successor switch` as PID 1. That one picks the request up and does the switch itself.
+namespace switcher
+{
+  const std::filesystem::path REQUEST_PATH = inventory::METADATA_PATH / "switch";
+  const std::filesystem::path DEFAULT_INIT = "/sbin/init";
+  const int DEFAULT_STOP_TIMEOUT = 10;
+
+  struct request_t
+  {
+    entity_t entity;
+    std::filesystem::path executable;
+  };
+
+  void write_request(const request_t &request)
+  {
+    std::filesystem::create_directories(REQUEST_PATH.parent_path());
+    std::filesystem::path tmp = REQUEST_PATH.string() + ".tmp";
+    {
+      std::ofstream file(tmp);
+      file << "image: " << request.entity.name << "\n"
+           << "version: " << request.entity.version << "\n"
+           << "executable: " << request.executable.string() << "\n";
+      if (!file)
+        throw std::runtime_error("Cannot write switch request " + tmp.string());
+    }
+    std::filesystem::rename(tmp, REQUEST_PATH);
+  }
+
+  // Reads and removes the pending request, so that a failed switch is not retried on the next one.
+  std::optional<request_t> take_request()
+  {
+    std::ifstream file(REQUEST_PATH);
+    if (!file.is_open())
+      return std::nullopt;
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line))
+      lines.push_back(line);
+    file.close();
+    std::filesystem::remove(REQUEST_PATH);
+
+    request_t request;
+    std::string version;
+    for (auto &line : lines)
+    {
+      if (line.find(':') == std::string::npos)
+        continue;
+      std::string key = trim(line.substr(0, line.find(':')));
+      std::string value = trim(line.substr(line.find(':') + 1));
+      if (key == "image")
+        request.entity.name = value;
+      else if (key == "version")
+        version = value;
+      else if (key == "executable")
+        request.executable = value;
+    }
+    // written by write_request, but PID 1 trusts nothing it is about to switch into
+    if (!std::regex_match(request.entity.name, image_name_regex()) || version.empty() || version.size() > 9 ||
+        !std::all_of(version.begin(), version.end(), ::isdigit) || !request.executable.is_absolute())
+      throw std::runtime_error("Invalid switch request " + REQUEST_PATH.string());
+    request.entity.version = std::stoi(version);
+    return request;
+  }
+
+  // A lazy root is served by a FUSE server, which stopping every process before the switch would kill from under
+  // the running system and the fallback init.
+  void check_current_root()
+  {
+    auto current = inventory::current();
+    if (current.has_value() && lazy::is_lazy(current.value()))
+      throw std::runtime_error("Cannot switch out of the lazy version " + current->name + ":" + std::to_string(current->version) + ", reboot into the next version instead");
+  }
+}
+
+#endif
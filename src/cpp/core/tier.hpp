@@ -0,0 +1,342 @@
+#ifndef tier_hpp
+#define tier_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "../interfaces/system.hpp"
+#include "../interfaces/config.hpp"
+#include "../interfaces/parallel.hpp"
+#include "inventory.hpp"
+#include "lazy.hpp"
+#include "data.hpp"
+
+// Tiered storage. Versions that are neither current, next nor the latest of their image are archived to the
+// archive_path of the config, typically on a larger and slower volume, and their directory in the inventory is
+// left empty. An archived version is a directory of tar archives, zstd compressed unless archive_compression is
+// none: one holding the directories, restored last so that their times survive, and shards holding the rest,
+// split by size and keeping hardlinked files together, so that they are written and read back in parallel.
+// Commands that need the files of a version rehydrate it first; the archive is kept, so that archiving it again
+// only drops the hot copy.
+namespace tier
+{
+  const std::filesystem::path LOCK_PATH = inventory::METADATA_PATH / "archive.lock";
+  const std::filesystem::path LOG_PATH = inventory::METADATA_PATH / "archive.log";
+  const size_t MAX_SHARDS = 16;
+
+  std::filesystem::path marker_path(entity_t entity)
+  {
+    return inventory::metadata_path(entity) / "archived";
+  }
+
+  bool is_archived(entity_t entity)
+  {
+    return std::filesystem::exists(marker_path(entity));
+  }
+
+  std::filesystem::path archive_of(entity_t entity)
+  {
+    std::ifstream marker(marker_path(entity));
+    std::string archive;
+    if (!std::getline(marker, archive) || archive.empty())
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " has no archive");
+    return archive;
+  }
+
+  bool compressed(const config_t &config)
+  {
+    return config.archive_compression.value_or("zstd") != "none";
+  }
+
+  std::vector<std::string> tar_command(const std::filesystem::path &archive)
+  {
+    std::vector<std::string> command = {"tar", "--xattrs", "--xattrs-include=*", "--acls", "--numeric-owner"};
+    if (archive.extension() == ".zst")
+      command.push_back("--use-compress-program=zstd -q");
+    return command;
+  }
+
+  // Writes the tree to the archive directory, which must not exist yet.
+  void write_archive(const std::filesystem::path &root, const std::filesystem::path &archive, bool compress)
+  {
+    std::vector<std::string> directories;
+    // groups of paths sharing an inode, with their size
+    std::map<std::pair<dev_t, ino_t>, std::pair<std::vector<std::string>, uint64_t>> groups;
+    for (auto it = std::filesystem::recursive_directory_iterator(root); it != std::filesystem::recursive_directory_iterator(); it++)
+    {
+      std::string relative = it->path().lexically_relative(root).string();
+      struct stat st;
+      if (lstat(it->path().c_str(), &st) != 0)
+        throw sys::system_error("Cannot stat " + it->path().string() + ". Error code: " + std::string(std::strerror(errno)));
+      if (S_ISDIR(st.st_mode))
+        directories.push_back(relative);
+      else
+      {
+        auto &group = groups[{st.st_dev, st.st_ino}];
+        group.first.push_back(relative);
+        group.second = st.st_size;
+      }
+    }
+    directories.insert(directories.begin(), ".");
+
+    std::vector<std::pair<std::vector<std::string>, uint64_t>> sorted;
+    for (auto &[inode, group] : groups)
+      sorted.push_back(group);
+    std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b)
+              { return a.second > b.second; });
+    size_t count = std::max<size_t>(1, std::min({MAX_SHARDS, parallel::default_threads(), sorted.size()}));
+    std::vector<std::pair<std::vector<std::string>, uint64_t>> shards(count);
+    // the largest groups first, each to the lightest shard
+    for (auto &group : sorted)
+    {
+      auto &shard = *std::min_element(shards.begin(), shards.end(), [](auto &a, auto &b)
+                                      { return a.second < b.second; });
+      shard.first.insert(shard.first.end(), group.first.begin(), group.first.end());
+      shard.second += group.second;
+    }
+
+    std::filesystem::path partial = archive.string() + ".partial";
+    std::filesystem::remove_all(partial);
+    std::filesystem::create_directories(partial);
+    std::string suffix = compress ? ".tar.zst" : ".tar";
+    std::vector<std::pair<std::string, std::vector<std::string>>> parts = {{"directories" + suffix, directories}};
+    for (size_t i = 0; i < shards.size(); i++)
+      parts.push_back({"shard-" + std::to_string(i) + suffix, shards[i].first});
+
+    try
+    {
+      parallel::for_each(parts.size(), [&](size_t i)
+                         {
+                           auto &[name, paths] = parts[i];
+                           std::filesystem::path list = partial / (name + ".list");
+                           {
+                             std::ofstream os(list, std::ios::binary);
+                             for (auto &p : paths)
+                               os << p << '\0';
+                           }
+                           auto command = tar_command(partial / name);
+                           command.insert(command.end(), {"--no-recursion", "-C", root.string(), "--null", "-T", list.string(), "-cf", (partial / name).string()});
+                           if (sys::execute(command[0], std::vector<std::string>(command.begin() + 1, command.end())) != 0)
+                             throw std::runtime_error("Cannot write " + (partial / name).string());
+                           std::filesystem::remove(list); },
+                         parts.size());
+    }
+    catch (const std::exception &e)
+    {
+      std::filesystem::remove_all(partial);
+      throw;
+    }
+    std::filesystem::rename(partial, archive);
+  }
+
+  // Extracts the shards in parallel, then the directories, reporting the progress on the standard error.
+  void read_archive(const std::filesystem::path &archive, const std::filesystem::path &root, const std::string &label)
+  {
+    std::vector<std::filesystem::path> shards;
+    std::optional<std::filesystem::path> directories;
+    uint64_t total = 0;
+    for (auto &entry : std::filesystem::directory_iterator(archive))
+    {
+      if (entry.path().filename().string().rfind("directories", 0) == 0)
+        directories = entry.path();
+      else
+        shards.push_back(entry.path());
+      total += entry.file_size();
+    }
+    if (!directories.has_value())
+      throw std::runtime_error("Archive " + archive.string() + " is incomplete");
+
+    std::mutex mutex;
+    size_t done = 0;
+    uint64_t read = 0;
+    auto extract = [&](const std::filesystem::path &part)
+    {
+      auto command = tar_command(part);
+      command.insert(command.end(), {"--same-owner", "-C", root.string(), "-xf", part.string()});
+      if (sys::execute(command[0], std::vector<std::string>(command.begin() + 1, command.end())) != 0)
+        throw std::runtime_error("Cannot extract " + part.string());
+      std::lock_guard<std::mutex> lock(mutex);
+      done++;
+      read += std::filesystem::file_size(part);
+      std::cerr << "\rRehydrating " << label << ": " << done << "/" << shards.size() + 1 << " parts, "
+                << (read >> 20) << "/" << (total >> 20) << " MiB" << std::flush;
+    };
+    parallel::for_each(shards.size(), [&](size_t i)
+                       { extract(shards[i]); },
+                       shards.size());
+    extract(directories.value());
+    std::cerr << std::endl;
+  }
+
+  // Makes the files of the version available again, if it is archived.
+  void rehydrate(entity_t entity)
+  {
+    if (!is_archived(entity))
+      return;
+    std::filesystem::path archive = archive_of(entity);
+    std::filesystem::path staging = inventory::stage("rehydrate");
+    std::filesystem::path root = staging / "root";
+    try
+    {
+      inventory::create(root);
+      read_archive(archive, root, entity.name + ":" + std::to_string(entity.version));
+      inventory::lock_t lock(inventory::LOCK_MODE_EXCLUSIVE);
+      // unless someone else was faster
+      if (is_archived(entity))
+      {
+        std::filesystem::remove(inventory::path(entity));
+        std::filesystem::rename(root, inventory::path(entity));
+        std::filesystem::remove(marker_path(entity));
+      }
+    }
+    catch (const std::exception &e)
+    {
+      if (std::filesystem::exists(root))
+        inventory::destroy(root);
+      std::filesystem::remove_all(staging);
+      throw;
+    }
+    if (std::filesystem::exists(root))
+      inventory::destroy(root);
+    std::filesystem::remove_all(staging);
+  }
+
+  // Removes the versions like inventory::remove, and their archives along with them.
+  void remove(const std::vector<entity_t> &entities)
+  {
+    std::vector<std::filesystem::path> archives;
+    for (auto &entity : entities)
+      if (is_archived(entity))
+        archives.push_back(archive_of(entity));
+    inventory::remove(entities);
+    for (auto &archive : archives)
+      std::filesystem::remove_all(archive);
+  }
+
+  // The versions that stay hot: the current one, the next one and the latest of every image.
+  std::set<entity_t> hot_versions(const config_t &config)
+  {
+    std::set<entity_t> hot;
+    if (auto current = inventory::current())
+      hot.insert(current.value());
+    if (config.default_image_name.has_value())
+      hot.insert(inventory::resolve(config.default_image_name.value(), config.default_image_version.value_or(version_latest)));
+    for (auto &image : inventory::list_images())
+      if (!inventory::list_versions(image).empty())
+        hot.insert(inventory::resolve(image, version_latest));
+    return hot;
+  }
+
+  // Archives every version that does not need to stay hot, returning how many. Only one pass runs at a time,
+  // others return right away.
+  int archive(const config_t &config)
+  {
+    if (!config.archive_path.has_value())
+      throw std::runtime_error("No archive_path is configured");
+    int fd = open(LOCK_PATH.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+      throw sys::system_error("Cannot open " + LOCK_PATH.string() + ". Error code: " + std::string(std::strerror(errno)));
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      close(fd);
+      std::cout << "Another archive pass is running" << std::endl;
+      return 0;
+    }
+
+    std::vector<entity_t> candidates;
+    {
+      inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+      auto hot = hot_versions(config);
+      for (auto &image : inventory::list_images())
+        for (auto version : inventory::list_versions(image))
+        {
+          entity_t entity = {.name = image, .version = version};
+          if (hot.count(entity) == 0 && !is_archived(entity) && !lazy::is_lazy(entity))
+            candidates.push_back(entity);
+        }
+    }
+
+    int archived = 0;
+    try
+    {
+      for (auto &entity : candidates)
+      {
+        std::filesystem::path archive = std::filesystem::absolute(config.archive_path.value()) / entity.name / std::to_string(entity.version);
+        if (!std::filesystem::exists(archive))
+        {
+          std::cout << "Archiving image " << entity.name << ":" << entity.version << " to " << archive.string() << std::endl;
+          // versions never change, and a removal meanwhile only fails the pass
+          write_archive(inventory::path(entity), archive, compressed(config));
+        }
+
+        std::filesystem::path trash = inventory::stage("archive");
+        {
+          inventory::lock_t lock(inventory::LOCK_MODE_EXCLUSIVE);
+          // it may have become current, been removed or started running, e.g. temporarily in another mount
+          // namespace, meanwhile
+          auto hot = hot_versions(config);
+          bool eligible = hot.count(entity) == 0 && std::filesystem::exists(inventory::path(entity)) && !is_archived(entity);
+          int unused = eligible ? inventory::lock_unused(inventory::path(entity)) : -1;
+          if (eligible && unused == -1)
+            std::cout << "Keeping image " << entity.name << ":" << entity.version << ", it is running" << std::endl;
+          if (unused != -1)
+          {
+            try
+            {
+              std::filesystem::rename(inventory::path(entity), trash / "root");
+              std::filesystem::create_directory(inventory::path(entity));
+              std::filesystem::create_directories(inventory::metadata_path(entity));
+              std::ofstream marker(marker_path(entity));
+              marker << archive.string() << "\n";
+              if (!marker)
+                throw std::runtime_error("Cannot write " + marker_path(entity).string());
+            }
+            catch (const std::exception &e)
+            {
+              close(unused);
+              throw;
+            }
+            close(unused);
+            archived++;
+          }
+        }
+        if (std::filesystem::exists(trash / "root"))
+          inventory::destroy(trash / "root");
+        std::filesystem::remove_all(trash);
+      }
+    }
+    catch (const std::exception &e)
+    {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    return archived;
+  }
+
+  // Starts an archive pass in the background at idle priority, logging to LOG_PATH.
+  void archive_in_background()
+  {
+    int log = open(LOG_PATH.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log == -1)
+      throw sys::system_error("Cannot open " + LOG_PATH.string() + ". Error code: " + std::string(std::strerror(errno)));
+    sys::spawn({"/proc/self/exe", "archive", "--background"}, -1, log);
+    close(log);
+  }
+}
+
+#endif
@@ -0,0 +1,80 @@
+// successor-init, the PID 1 entry point installed as /sbin/init. It boots the configured image like
+// `successor run --dp --replace` would, with nothing in between: no shell, no command line and no more than the
+// config, the inventory, the runner and the metrics of the switch. If anything goes wrong before the image's init
+// runs, the original init, moved to /sbin/init2, takes over.
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <filesystem>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+
+#include "interfaces/config.hpp"
+#include "interfaces/log.hpp"
+#include "core/inventory.hpp"
+#include "core/metrics.hpp"
+#include "core/runner.hpp"
+
+const char *FALLBACK_INIT = "/sbin/init2";
+const char *DEFAULT_INIT = "/sbin/init";
+
+int main(int argc, char **argv)
+{
+  logging::tty_logger logger;
+  config_t config;
+  // set once the runner takes over, from then on a failure counts as a failed switch
+  std::optional<entity_t> switching;
+  try
+  {
+    // the kernel mounts / with the rootflags of the command line, only ro goes
+    struct statvfs root;
+    if (statvfs("/", &root) != 0)
+      throw sys::system_error("Cannot stat /. Error code: " + std::string(std::strerror(errno)));
+    unsigned long flags = root.f_flag & (ST_NOSUID | ST_NODEV | ST_NOEXEC | ST_SYNCHRONOUS | ST_MANDLOCK | ST_NOATIME | ST_NODIRATIME | ST_RELATIME);
+    if (mount(nullptr, "/", nullptr, MS_REMOUNT | flags, nullptr) != 0)
+      throw sys::system_error("Cannot remount / read-write. Error code: " + std::string(std::strerror(errno)));
+    // the runner reads the mount table, which is only there if an initramfs left /proc behind
+    if (!std::filesystem::exists("/proc/self"))
+      sys::mnt::mount_fs("proc", "/proc", "", "proc");
+
+    config = load_config();
+    if (!config.default_image_name.has_value())
+      throw std::runtime_error("No image configured");
+    entity_t entity = inventory::resolve(config.default_image_name.value(), config.default_image_version.value_or(version_latest));
+    // the next version is never archived, unless the config changed since the last archive pass. Restoring it is
+    // left to the original init, so that PID 1 does not spend minutes untarring before anything is up.
+    if (!std::filesystem::exists(inventory::path(entity)))
+      throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " does not exist");
+    std::string executable = config.default_executable.value_or(DEFAULT_INIT);
+
+    std::vector<std::filesystem::path> persistent_directories = {"/succ"};
+    persistent_directories.insert(persistent_directories.end(), config.persistent_directories.begin(), config.persistent_directories.end());
+    runner::run_options_t options;
+    if (lazy::is_lazy(entity))
+      options.lazy = lazy::source_of(entity);
+    for (auto &directory : config.volatile_directories)
+      options.volatile_directories.push_back({directory.path, directory.size.value_or(runner::DEFAULT_VOLATILE_SIZE)});
+    options.on_switched = [&](int64_t switch_us, const std::vector<std::pair<std::string, int64_t>> &phases)
+    {
+      auto record = metrics::record_switch(config, entity, switch_us, phases, logger);
+      logger.info() << "successor-init: starting " << executable << " " << record.exec_us << " us after start" << std::endl;
+    };
+
+    switching = entity;
+    runner::run(logger, runner::RUN_MODE_PERMANENT, inventory::path(entity), runner::DEFAULT_ROOTBACK, persistent_directories, executable, options);
+    logger.error() << "successor-init: " << executable << " returned" << std::endl;
+  }
+  catch (const std::exception &e)
+  {
+    logger.error() << "successor-init failed because of " << e.what() << std::endl;
+  }
+  if (switching.has_value())
+    metrics::record_failure(config, switching.value(), logger);
+
+  logger.error() << "successor-init: starting " << FALLBACK_INIT << " instead..." << std::endl;
+  execv(FALLBACK_INIT, argv);
+  logger.error() << "successor-init: cannot start " << FALLBACK_INIT << ". Error code: " << std::strerror(errno) << std::endl;
+  return 1;
+}
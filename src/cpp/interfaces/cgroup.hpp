@@ -0,0 +1,182 @@
+#ifndef cgroup_hpp
+#define cgroup_hpp
+
+#include <string>
+#include <optional>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/magic.h>
+#include <linux/ioprio.h>
+
+#include "system.hpp"
+
+// Transient cgroup v2 groups, used to keep builds from starving the services running on the host.
+namespace cgroup
+{
+  const std::filesystem::path CGROUP_ROOT = "/sys/fs/cgroup";
+
+  struct limits_t
+  {
+    std::optional<int> cpu_weight;         // 1 - 10000, 100 is the default of every cgroup
+    std::optional<std::string> memory_max; // bytes, with an optional K, M or G suffix
+    std::optional<int> io_weight;          // 1 - 10000
+    std::optional<std::string> io_max;     // e.g. "8:0 wbps=10485760"
+    std::optional<int> nice;
+    std::optional<std::string> ionice;     // idle, best-effort[:LEVEL] or realtime[:LEVEL]
+  };
+
+  struct usage_t
+  {
+    uint64_t cpu_usec = 0;
+    uint64_t memory_peak = 0;
+    uint64_t bytes_written = 0;
+  };
+
+  bool available()
+  {
+    try
+    {
+      return sys::fs::type(CGROUP_ROOT) == CGROUP2_SUPER_MAGIC;
+    }
+    catch (const sys::system_error &e)
+    {
+      return false;
+    }
+  }
+
+  void write_file(const std::filesystem::path &file, const std::string &value)
+  {
+    std::ofstream os(file);
+    os << value;
+    os.flush();
+    if (!os)
+      throw sys::system_error("Cannot write " + value + " to " + file.string());
+  }
+
+  // the cgroup v2 path of the calling process, from the "0::/path" line of /proc/self/cgroup
+  std::filesystem::path current()
+  {
+    std::ifstream is("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(is, line))
+      if (line.rfind("0::", 0) == 0)
+        return CGROUP_ROOT / line.substr(3).substr(1);
+    throw sys::system_error("Cannot find the cgroup v2 of the process");
+  }
+
+  void set_ionice(const std::string &ionice)
+  {
+    std::string name = ionice.substr(0, ionice.find(':'));
+    int level = ionice.find(':') == std::string::npos ? 4 : std::stoi(ionice.substr(ionice.find(':') + 1));
+    int io_class;
+    if (name == "idle")
+      io_class = IOPRIO_CLASS_IDLE, level = 0;
+    else if (name == "best-effort")
+      io_class = IOPRIO_CLASS_BE;
+    else if (name == "realtime")
+      io_class = IOPRIO_CLASS_RT;
+    else
+      throw std::runtime_error("Invalid ionice class " + name);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(io_class, level)) != 0)
+      throw sys::system_error("Cannot set ionice. Error code: " + std::string(std::strerror(errno)));
+  }
+
+  // Applies the nice and ionice limits to the calling process and, by inheritance, to its future children.
+  void set_priority(const limits_t &limits)
+  {
+    if (limits.nice && setpriority(PRIO_PROCESS, 0, limits.nice.value()) != 0)
+      throw sys::system_error("Cannot set nice. Error code: " + std::string(std::strerror(errno)));
+    if (limits.ionice)
+      set_ionice(limits.ionice.value());
+  }
+
+  // Creates a cgroup below the root, applies the limits and moves the calling process into it, so that every
+  // process forked afterwards is accounted there as well. The process moves back on destruction.
+  class scope_t
+  {
+    std::filesystem::path path;
+    std::filesystem::path previous;
+
+  public:
+    scope_t(const std::string &name, const limits_t &limits)
+    {
+      previous = current();
+      path = CGROUP_ROOT / (name + "-" + std::to_string(getpid()));
+
+      // best effort, the controllers are usually enabled already by the init system
+      try
+      {
+        write_file(CGROUP_ROOT / "cgroup.subtree_control", "+cpu +memory +io");
+      }
+      catch (const sys::system_error &e)
+      {
+      }
+
+      std::filesystem::create_directory(path);
+      try
+      {
+        if (limits.cpu_weight)
+          write_file(path / "cpu.weight", std::to_string(limits.cpu_weight.value()));
+        if (limits.memory_max)
+          write_file(path / "memory.max", limits.memory_max.value());
+        if (limits.io_weight)
+          write_file(path / "io.weight", "default " + std::to_string(limits.io_weight.value()));
+        if (limits.io_max)
+          write_file(path / "io.max", limits.io_max.value());
+        write_file(path / "cgroup.procs", std::to_string(getpid()));
+      }
+      catch (const std::exception &e)
+      {
+        std::filesystem::remove(path);
+        throw;
+      }
+    }
+
+    usage_t usage()
+    {
+      usage_t usage;
+      std::string key, line;
+      uint64_t value;
+
+      std::ifstream cpu(path / "cpu.stat");
+      while (cpu >> key >> value)
+        if (key == "usage_usec")
+          usage.cpu_usec = value;
+
+      // memory.peak needs linux 5.19
+      std::ifstream(path / "memory.peak") >> usage.memory_peak;
+
+      std::ifstream io(path / "io.stat");
+      while (std::getline(io, line))
+      {
+        std::istringstream ls(line);
+        std::string field;
+        ls >> field; // device
+        while (ls >> field)
+          if (field.rfind("wbytes=", 0) == 0)
+            usage.bytes_written += std::stoull(field.substr(7));
+      }
+      return usage;
+    }
+
+    ~scope_t()
+    {
+      try
+      {
+        write_file(previous / "cgroup.procs", std::to_string(getpid()));
+        std::filesystem::remove(path);
+      }
+      catch (const std::exception &e)
+      {
+        // a leftover empty cgroup is harmless
+      }
+    }
+  };
+}
+
+#endif
@@ -8,21 +8,57 @@
 #include "../core/data.hpp"
 
 const std::map<std::string, std::string> HELP_TEXTS{
-    {"build", R"(successor build [--name | -n NAME] [--version | -v VERSION] SOURCE
+    {"build", R"(successor build [--name | -n NAME] [--version | -v VERSION] [--stream] [--optimize] SOURCE
+successor build [--name | -n NAME] [--version | -v VERSION] [--optimize] --from-oci DIRECTORY
+successor build --manifest FILE [--jobs | -j JOBS]
 
 Description:
 Builds a new image from the specified source directory. It uses buildah, docker or podman to build the image.
+With --from-oci, the image is extracted from a local OCI image layout instead, without any container engine.
+With --manifest, every image of a build manifest is built, in parallel where their dependencies allow it.
 
 Options:
     --name | -n NAME            The name of the image to build. If not specified, the default image from the config file is used.
     --version | -v VERSION      The version of the image to build. If not specified, the latest version is used.
+    --from-oci DIRECTORY        An OCI image layout directory to ingest instead of building SOURCE.
+    --stream                    If specified, the builder output is streamed as a tar archive and written, hashed and
+                                deduplicated in a single pass instead of being exported as a directory first.
+    --optimize                  If specified, the new version is optimized like `successor optimize` does before its
+                                manifest is written.
+    --manifest FILE             A build manifest listing the images to build, see below.
+    --jobs | -j JOBS            The number of builds to run at the same time. Defaults to 2.
 
 Arguments:
-    SOURCE    The source directory to build the image from.)"},
-    {"list", R"(successor list
+    SOURCE    The source directory to build the image from.
+
+Build manifest:
+    Every image starts with an unindented NAME: line, followed by indented keys:
+        source: FILE        The Containerfile to build.
+        context: DIRECTORY  The build context. Defaults to the directory of the manifest.
+        oci: DIRECTORY      An OCI image layout to ingest instead of building a Containerfile.
+        stream: true        Streams the builder output, like --stream.
+        optimize: true      Optimizes the new version, like --optimize.
+        after: NAME, ...    Images to build first. Images the Containerfile is FROM are added automatically.
+    The output of each build goes to /succ/meta/NAME/VERSION/build.log.)"},
+    {"list", R"(successor list [--timings]
+
+Description:
+Lists all images and their versions, as well as the current and the next image.
+
+Options:
+    --timings    If specified, the median boot timings of each version are shown, and versions that boot slower than
+                 the previous one by more than regression_threshold percent (20 by default) are flagged.)"},
+    {"optimize", R"(successor optimize [--name | -n NAME] [--version | -v VERSION]
 
 Description:
-Lists all images and their versions, as well as the current and the next image.)"},
+Creates the next version of the image from an optimized copy of the specified version: the paths matching the
+prune_paths globs of the config are removed, small files are rewritten in the order the image reads them at boot
+so that they are stored close together, and identical files are hardlinked. Files with xattrs are left alone.
+The saved space is reported.
+
+Options:
+    --name | -n NAME            The name of the image to optimize. If not specified, the default image from the config file is used.
+    --version | -v VERSION      The version of the image to optimize. If not specified, the latest version is used.)"},
     {"remove", R"(First Form:
 successor remove [--name | -n NAME] --version | -v VERSION
 
@@ -41,7 +77,7 @@ Removes all of the version, excluding the latest and running one (if any), of th
 
 Options:
     --name | -n NAME          The name of the image to remove. If not specified, the default image from the config file is used.)"},
-    {"run", R"(successor run [--name | -n NAME] [--version | -v VERSION] [--persistent-directory | -p DIRECTORY]... [--exec | -e EXECUTABLE] [--replace] [--enable-logging]
+    {"run", R"(successor run [--name | -n NAME] [--version | -v VERSION] [--persistent-directory | -p DIRECTORY]... [--exec | -e EXECUTABLE] [--replace] [--enable-logging] [--ephemeral [--ephemeral-size SIZE] | --to-ram]
 
 Description:
 Runs the specified image.
@@ -53,7 +89,11 @@ Options:
     --persistent-directory | -p DIRECTORY A directory that is shared between the root filesystem and the successor OS.
     --exec | -e EXECUTABLE                The executable to run. If not specified, the default executable from the config file is used.
     --replace                             If specified, the running successor OS will replace the current OS. (use with caution)
-    --enable-logging                      If specified, the successor OS will collect logs.)"},
+    --enable-logging                      If specified, the successor OS will collect logs.
+    --ephemeral                           If specified, the image is mounted read-only under an overlay whose writes go to a tmpfs and are discarded on exit.
+    --ephemeral-size SIZE                 The size cap of the ephemeral tmpfs, e.g. 2G or 50% of the memory. Defaults to 50%.
+    --to-ram                              If specified, the image is copied to a tmpfs and runs from memory, unless it takes more than
+                                          to_ram_max_percent (50 by default) percent of the available memory.)"},
     {"logs", R"(successor logs [--index | -i INDEX]
 
 Description:
@@ -61,16 +101,123 @@ Prints the logs of the specified boot.
 
 Options:
     --index | -i INDEX The index of the boot to print the logs of. 1 indicates the current boot, 2 the previous one, and so on. If not specified, the current boot is used.)"},
+    {"delta", R"(successor delta [--name | -n NAME] --from VERSION --to VERSION > FILE
+
+Description:
+Writes a delta pack to the standard output, holding only the files that were added, removed or changed between two versions of an image.
+
+Options:
+    --name | -n NAME            The name of the image. If not specified, the default image from the config file is used.
+    --from VERSION              The version the pack will be applied to.
+    --to VERSION                The version the pack reconstructs.)"},
+    {"diff", R"(successor diff [--name | -n NAME] --from VERSION --to VERSION
+
+Description:
+Lists the files that were added, removed or modified between two versions of an image, followed by a summary.
+The manifests stored at build time are compared when both versions have one, otherwise the versions are scanned.
+
+Options:
+    --name | -n NAME            The name of the image. If not specified, the default image from the config file is used.
+    --from VERSION              The older version.
+    --to VERSION                The newer version.)"},
+    {"apply", R"(successor apply [--name | -n NAME] < FILE
+
+Description:
+Reads a delta pack created by `successor delta` from the standard input and reconstructs its target version on top of the base version.
+The result is verified against the target manifest and added as the next version of the image.
+
+Options:
+    --name | -n NAME            The name of the image holding the base version. If not specified, the name stored in the pack is used.)"},
+    {"agent", R"(successor agent
+successor agent --jobs
+successor agent --follow | -f JOB
+
+Description:
+Runs the agent, which keeps a model of the inventory in memory, updated as it changes, and serves it on the Unix
+socket /succ/agent.sock. While it runs, list and logs are answered by it, and build and remove are queued and run
+by it one at a time, their output streamed back. Without an agent, every command does its work by itself.
+With --jobs, prints the jobs of the running agent. With --follow, prints the output of one of them.
+
+Options:
+    --jobs                      Prints the queued, running and finished jobs of the agent.
+    --follow | -f JOB           Prints the output of the job until it finishes.)"},
+    {"archive", R"(successor archive [--background]
+successor archive --restore [--name | -n NAME] [--version | -v VERSION]
+
+Description:
+Moves the versions that are neither current, next nor the latest of their image to the archive_path of the config,
+zstd compressed unless archive_compression is none, leaving them listed as archived. Commands that need the files of
+an archived version rehydrate it in parallel first. After every build, an archive pass runs in the background if
+archive_path is configured.
+With --restore, rehydrates the specified version right away.
+
+Options:
+    --background                Runs at idle CPU and I/O priority.
+    --restore                   Rehydrates a version instead of archiving.
+    --name | -n NAME            The name of the image to rehydrate. If not specified, the default image from the config file is used.
+    --version | -v VERSION      The version of the image to rehydrate. If not specified, the latest version is used.)"},
+    {"export", R"(successor export [--name | -n NAME] [--version | -v VERSION] [--store | -s DIR] > FILE
+
+Description:
+Writes the specified build to the standard output as a zstd compressed tar archive, preserving hardlinks, xattrs and ACLs.
+With --store, adds it to a blob store instead, from which `successor import --store` creates lazy versions.
+
+Options:
+    --name | -n NAME            The name of the image to export. If not specified, the default image from the config file is used.
+    --version | -v VERSION      The version of the image to export. If not specified, the latest version is used.
+    --store | -s DIR            The blob store to add the contents and the manifest of the version to.)"},
+    {"import", R"(successor import [--name | -n NAME] [--store | -s DIR [--version | -v VERSION]] < FILE
+
+Description:
+Reads an archive created by `successor export` from the standard input and adds it as the next version of the image.
+With --store, adds the version of the blob store as the next, lazy, version instead. Nothing but its manifest is
+copied: its files are fetched into /succ/cache when first opened, and the ones opened before are fetched as soon as it runs.
+
+Options:
+    --name | -n NAME            The name of the image to import into. If not specified, the default image from the config file is used.
+    --store | -s DIR            The blob store to import a lazy version from.
+    --version | -v VERSION      The version in the blob store to import. If not specified, the latest version is used.)"},
+    {"switch", R"(successor switch [--name | -n NAME] [--version | -v VERSION] [--exec | -e EXECUTABLE] [--timeout | -t SECONDS]
+
+Description:
+Switches the running system into the specified image without rebooting the firmware or the kernel. The services
+are stopped, the image becomes the root as with `run --replace`, and its init takes over as PID 1. The host root
+stays at /succ/rootback. Unless successor runs as PID 1, the switch is requested from the running init through
+the switch_command of the config file, which has to stop the services and make the init exec `successor switch`.
+
+Options:
+    --name | -n NAME              The name of the image to switch to. If not specified, the default image from the config file is used.
+    --version | -v VERSION        The version of the image to switch to. If not specified, the default version from the config file is used.
+    --exec | -e EXECUTABLE        The init of the image. If not specified, the default executable from the config file or /sbin/init is used.
+    --timeout | -t SECONDS        How long the remaining processes get to exit after SIGTERM before they are killed. Defaults to 10.)"},
+    {"stats", R"(successor stats [--session | -s SESSION]
+
+Description:
+Prints per-operation syscall counts and latencies recorded during the last switch, build or remove.
+Statistics are only recorded if successor was compiled with SUCCESSOR_STATS.
+
+Options:
+    --session | -s SESSION The session to print, one of switch, build or remove. If not specified, all of them are printed.)"},
     {"", R"(successor v0.2.0
 successor -h | --help
 successor COMMAND [OPTIONS]
 
 Commands:
+    agent
+    apply
+    archive
     build
+    delta
+    diff
+    export
+    import
     list
     logs
+    optimize
     remove
     run
+    stats
+    switch
 
 You can use `successor COMMAND --help` to get more information about a specific command.)"}};
 
@@ -84,6 +231,11 @@ struct build_cmd_t
   std::optional<std::string> image;
   std::optional<version_t> version;
   std::filesystem::path source;
+  std::optional<std::filesystem::path> oci_layout;
+  bool stream = false;
+  bool optimize = false;
+  std::optional<std::filesystem::path> manifest;
+  std::optional<int> jobs;
 };
 
 std::variant<build_cmd_t, help_cmd_t> parse_build_cmd(int argc, char **argv)
@@ -98,7 +250,7 @@ std::variant<build_cmd_t, help_cmd_t> parse_build_cmd(int argc, char **argv)
     {
       if (i + 1 >= argc)
         throw std::runtime_error("No image name specified.");
-      if (!std::regex_match(argv[i + 1], IMAGE_NAME_REGEX))
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
         throw std::runtime_error("Invalid image name.");
       if (cmd.image.has_value())
         throw std::runtime_error("Image name already specified.");
@@ -117,6 +269,43 @@ std::variant<build_cmd_t, help_cmd_t> parse_build_cmd(int argc, char **argv)
         cmd.version = std::stoi(argv[i + 1]);
       i++;
     }
+    else if (arg == "--stream")
+    {
+      cmd.stream = true;
+    }
+    else if (arg == "--optimize")
+    {
+      cmd.optimize = true;
+    }
+    else if (arg == "--manifest")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No build manifest specified.");
+      if (cmd.manifest.has_value())
+        throw std::runtime_error("Build manifest already specified.");
+      cmd.manifest = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--jobs" || arg == "-j")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No number of jobs specified.");
+      if (cmd.jobs.has_value())
+        throw std::runtime_error("Number of jobs already specified.");
+      cmd.jobs = std::stoi(argv[i + 1]);
+      if (cmd.jobs.value() < 1)
+        throw std::runtime_error("Invalid number of jobs.");
+      i++;
+    }
+    else if (arg == "--from-oci")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No OCI image layout specified.");
+      if (cmd.oci_layout.has_value())
+        throw std::runtime_error("OCI image layout already specified.");
+      cmd.oci_layout = argv[i + 1];
+      i++;
+    }
     else if (arg == "--help" || arg == "-h")
     {
       return help_cmd_t{.command = "build"};
@@ -130,24 +319,410 @@ std::variant<build_cmd_t, help_cmd_t> parse_build_cmd(int argc, char **argv)
     }
   }
 
-  if (!source_specified)
+  if (cmd.manifest.has_value())
+  {
+    if (source_specified || cmd.oci_layout.has_value() || cmd.image.has_value() || cmd.version.has_value() || cmd.stream)
+      throw std::runtime_error("A build manifest cannot be combined with other build options.");
+    return cmd;
+  }
+  if (cmd.jobs.has_value())
+    throw std::runtime_error("--jobs requires --manifest.");
+  if (source_specified && cmd.oci_layout.has_value())
+    throw std::runtime_error("Source directory and OCI image layout cannot be specified together.");
+  if (cmd.stream && cmd.oci_layout.has_value())
+    throw std::runtime_error("--stream only applies to container builds.");
+  if (!source_specified && !cmd.oci_layout.has_value())
     throw std::runtime_error("No source directory specified.");
   return cmd;
 }
 
+struct delta_cmd_t
+{
+  std::optional<std::string> image;
+  version_t from;
+  version_t to;
+};
+
+std::variant<delta_cmd_t, help_cmd_t> parse_delta_cmd(int argc, char **argv)
+{
+  std::optional<std::string> image;
+  std::optional<version_t> from, to;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--from" || arg == "--to")
+    {
+      std::optional<version_t> &version = arg == "--from" ? from : to;
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        version = version_latest;
+      else
+        version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "delta"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  if (!from.has_value() || !to.has_value())
+    throw std::runtime_error("Both --from and --to must be specified.");
+  return delta_cmd_t{.image = image, .from = from.value(), .to = to.value()};
+}
+
+struct diff_cmd_t
+{
+  std::optional<std::string> image;
+  version_t from;
+  version_t to;
+};
+
+std::variant<diff_cmd_t, help_cmd_t> parse_diff_cmd(int argc, char **argv)
+{
+  std::optional<std::string> image;
+  std::optional<version_t> from, to;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--from" || arg == "--to")
+    {
+      std::optional<version_t> &version = arg == "--from" ? from : to;
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        version = version_latest;
+      else
+        version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "diff"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  if (!from.has_value() || !to.has_value())
+    throw std::runtime_error("Both --from and --to must be specified.");
+  return diff_cmd_t{.image = image, .from = from.value(), .to = to.value()};
+}
+
+struct apply_cmd_t
+{
+  std::optional<std::string> image;
+};
+
+std::variant<apply_cmd_t, help_cmd_t> parse_apply_cmd(int argc, char **argv)
+{
+  apply_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "apply"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  return cmd;
+}
+
+struct agent_cmd_t
+{
+  bool jobs = false;
+  std::optional<int> follow;
+};
+
+std::variant<agent_cmd_t, help_cmd_t> parse_agent_cmd(int argc, char **argv)
+{
+  agent_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--jobs")
+    {
+      cmd.jobs = true;
+    }
+    else if (arg == "--follow" || arg == "-f")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No job specified.");
+      if (cmd.follow.has_value())
+        throw std::runtime_error("Job already specified.");
+      cmd.follow = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "agent"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  if (cmd.jobs && cmd.follow.has_value())
+    throw std::runtime_error("Only one of --jobs and --follow can be given.");
+  return cmd;
+}
+
+struct archive_cmd_t
+{
+  bool background = false;
+  bool restore = false;
+  std::optional<std::string> image;
+  std::optional<version_t> version;
+};
+
+std::variant<archive_cmd_t, help_cmd_t> parse_archive_cmd(int argc, char **argv)
+{
+  archive_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--background")
+    {
+      cmd.background = true;
+    }
+    else if (arg == "--restore")
+    {
+      cmd.restore = true;
+    }
+    else if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--version" || arg == "-v")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (cmd.version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        cmd.version = version_latest;
+      else
+        cmd.version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "archive"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  if (!cmd.restore && (cmd.image.has_value() || cmd.version.has_value()))
+    throw std::runtime_error("A name or a version can only be given with --restore.");
+  return cmd;
+}
+
+struct export_cmd_t
+{
+  std::optional<std::string> image;
+  std::optional<version_t> version;
+  std::optional<std::filesystem::path> store;
+};
+
+std::variant<export_cmd_t, help_cmd_t> parse_export_cmd(int argc, char **argv)
+{
+  export_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--version" || arg == "-v")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (cmd.version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        cmd.version = version_latest;
+      else
+        cmd.version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--store" || arg == "-s")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No blob store specified.");
+      if (cmd.store.has_value())
+        throw std::runtime_error("Blob store already specified.");
+      cmd.store = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "export"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  return cmd;
+}
+
+struct import_cmd_t
+{
+  std::optional<std::string> image;
+  std::optional<version_t> version;
+  std::optional<std::filesystem::path> store;
+};
+
+std::variant<import_cmd_t, help_cmd_t> parse_import_cmd(int argc, char **argv)
+{
+  import_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--version" || arg == "-v")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (cmd.version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        cmd.version = version_latest;
+      else
+        cmd.version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--store" || arg == "-s")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No blob store specified.");
+      if (cmd.store.has_value())
+        throw std::runtime_error("Blob store already specified.");
+      cmd.store = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "import"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  if (cmd.version.has_value() && !cmd.store.has_value())
+    throw std::runtime_error("A version can only be imported from a blob store.");
+  return cmd;
+}
+
 struct list_cmd_t
 {
+  bool timings;
 };
 
 std::variant<list_cmd_t, help_cmd_t> parse_list_cmd(int argc, char **argv)
 {
+  list_cmd_t cmd = {.timings = false};
   for (int i = 1; i < argc; i++)
     if (std::string(argv[i]) == "--help" || std::string(argv[i]) == "-h")
       return help_cmd_t{.command = "list"};
+    else if (std::string(argv[i]) == "--timings")
+    {
+      if (cmd.timings)
+        throw std::runtime_error("Timings already specified.");
+      cmd.timings = true;
+    }
     else
       throw std::runtime_error("Invalid argument.");
 
-  return list_cmd_t();
+  return cmd;
 }
 
 struct logs_cmd_t
@@ -184,6 +759,55 @@ std::variant<logs_cmd_t, help_cmd_t> parse_logs_cmd(int argc, char **argv)
   return cmd;
 }
 
+struct optimize_cmd_t
+{
+  std::optional<std::string> image;
+  std::optional<version_t> version;
+};
+
+std::variant<optimize_cmd_t, help_cmd_t> parse_optimize_cmd(int argc, char **argv)
+{
+  optimize_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--version" || arg == "-v")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (cmd.version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        cmd.version = version_latest;
+      else
+        cmd.version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "optimize"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  return cmd;
+}
+
 struct remove_specific_cmd_t
 {
   std::string image;
@@ -208,7 +832,7 @@ std::variant<remove_specific_cmd_t, remove_unused_cmd_t, help_cmd_t> parse_remov
     {
       if (i + 1 >= argc)
         throw std::runtime_error("No image name specified.");
-      if (!std::regex_match(argv[i + 1], IMAGE_NAME_REGEX))
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
         throw std::runtime_error("Invalid image name.");
       if (image.has_value())
         throw std::runtime_error("Image name already specified.");
@@ -270,11 +894,14 @@ struct run_cmd_t
   bool add_default_persistent_directories;
   std::vector<std::filesystem::path> persistent_directories;
   std::optional<std::filesystem::path> executable;
+  bool ephemeral;
+  std::optional<std::string> ephemeral_size;
+  bool to_ram;
 };
 
 std::variant<run_cmd_t, help_cmd_t> parse_run_cmd(int argc, char **argv)
 {
-  run_cmd_t cmd = {.replace = false, .enable_logging = false, .add_default_persistent_directories = false};
+  run_cmd_t cmd = {.replace = false, .enable_logging = false, .add_default_persistent_directories = false, .ephemeral = false, .to_ram = false};
 
   for (int i = 1; i < argc; i++)
   {
@@ -283,7 +910,7 @@ std::variant<run_cmd_t, help_cmd_t> parse_run_cmd(int argc, char **argv)
     {
       if (i + 1 >= argc)
         throw std::runtime_error("No image name specified.");
-      if (!std::regex_match(argv[i + 1], IMAGE_NAME_REGEX))
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
         throw std::runtime_error("Invalid image name.");
       if (cmd.image.has_value())
         throw std::runtime_error("Image name already specified.");
@@ -336,6 +963,27 @@ std::variant<run_cmd_t, help_cmd_t> parse_run_cmd(int argc, char **argv)
         throw std::runtime_error("Enable logging already specified.");
       cmd.enable_logging = true;
     }
+    else if (arg == "--ephemeral")
+    {
+      if (cmd.ephemeral)
+        throw std::runtime_error("Ephemeral already specified.");
+      cmd.ephemeral = true;
+    }
+    else if (arg == "--ephemeral-size")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No ephemeral size specified.");
+      if (cmd.ephemeral_size.has_value())
+        throw std::runtime_error("Ephemeral size already specified.");
+      cmd.ephemeral_size = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--to-ram")
+    {
+      if (cmd.to_ram)
+        throw std::runtime_error("To RAM already specified.");
+      cmd.to_ram = true;
+    }
     else if (arg == "--help" || arg == "-h")
     {
       return help_cmd_t{.command = "run"};
@@ -346,10 +994,124 @@ std::variant<run_cmd_t, help_cmd_t> parse_run_cmd(int argc, char **argv)
     }
   }
 
+  if (cmd.ephemeral_size.has_value() && !cmd.ephemeral)
+    throw std::runtime_error("Ephemeral size requires --ephemeral.");
+  if (cmd.ephemeral && cmd.replace)
+    throw std::runtime_error("Ephemeral cannot be used with replace.");
+  if (cmd.ephemeral && cmd.to_ram)
+    throw std::runtime_error("Ephemeral cannot be used with to RAM.");
   return cmd;
 }
 
-typedef std::variant<build_cmd_t, list_cmd_t, logs_cmd_t, remove_specific_cmd_t, remove_unused_cmd_t, run_cmd_t, help_cmd_t> cmd_t;
+struct switch_cmd_t
+{
+  std::optional<std::string> image;
+  std::optional<version_t> version;
+  std::optional<std::filesystem::path> executable;
+  std::optional<int> timeout;
+};
+
+std::variant<switch_cmd_t, help_cmd_t> parse_switch_cmd(int argc, char **argv)
+{
+  switch_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--name" || arg == "-n")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image name specified.");
+      if (!std::regex_match(argv[i + 1], image_name_regex()))
+        throw std::runtime_error("Invalid image name.");
+      if (cmd.image.has_value())
+        throw std::runtime_error("Image name already specified.");
+      cmd.image = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--version" || arg == "-v")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No image version specified.");
+      if (cmd.version.has_value())
+        throw std::runtime_error("Image version already specified.");
+      if (std::string(argv[i + 1]) == "latest")
+        cmd.version = version_latest;
+      else
+        cmd.version = std::stoi(argv[i + 1]);
+      i++;
+    }
+    else if (arg == "--exec" || arg == "-e")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No executable specified.");
+      if (cmd.executable.has_value())
+        throw std::runtime_error("Executable already specified.");
+      cmd.executable = argv[i + 1];
+      i++;
+    }
+    else if (arg == "--timeout" || arg == "-t")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No timeout specified.");
+      if (cmd.timeout.has_value())
+        throw std::runtime_error("Timeout already specified.");
+      cmd.timeout = std::stoi(argv[i + 1]);
+      if (cmd.timeout.value() < 0)
+        throw std::runtime_error("Timeout cannot be negative.");
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "switch"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  return cmd;
+}
+
+struct stats_cmd_t
+{
+  std::optional<std::string> session;
+};
+
+std::variant<stats_cmd_t, help_cmd_t> parse_stats_cmd(int argc, char **argv)
+{
+  stats_cmd_t cmd;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--session" || arg == "-s")
+    {
+      if (i + 1 >= argc)
+        throw std::runtime_error("No session specified.");
+      if (cmd.session.has_value())
+        throw std::runtime_error("Session already specified.");
+      std::string session = argv[i + 1];
+      if (session != "switch" && session != "build" && session != "remove")
+        throw std::runtime_error("Invalid session.");
+      cmd.session = session;
+      i++;
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      return help_cmd_t{.command = "stats"};
+    }
+    else
+    {
+      throw std::runtime_error("Invalid argument.");
+    }
+  }
+
+  return cmd;
+}
+
+typedef std::variant<build_cmd_t, delta_cmd_t, diff_cmd_t, apply_cmd_t, agent_cmd_t, archive_cmd_t, export_cmd_t, import_cmd_t, list_cmd_t, logs_cmd_t, optimize_cmd_t, remove_specific_cmd_t, remove_unused_cmd_t, run_cmd_t, stats_cmd_t, switch_cmd_t, help_cmd_t> cmd_t;
 
 
 template <class... Fs>
@@ -376,6 +1138,34 @@ cmd_t parse_cmd(int argc, char **argv)
     return std::visit([](auto &&arg) -> cmd_t
                       { return arg; },
                       parse_build_cmd(argc - 1, &argv[1]));
+  else if (command == "delta")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_delta_cmd(argc - 1, &argv[1]));
+  else if (command == "diff")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_diff_cmd(argc - 1, &argv[1]));
+  else if (command == "apply")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_apply_cmd(argc - 1, &argv[1]));
+  else if (command == "agent")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_agent_cmd(argc - 1, &argv[1]));
+  else if (command == "archive")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_archive_cmd(argc - 1, &argv[1]));
+  else if (command == "export")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_export_cmd(argc - 1, &argv[1]));
+  else if (command == "import")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_import_cmd(argc - 1, &argv[1]));
   else if (command == "list")
   {
     return std::visit([](auto &&arg) -> cmd_t
@@ -386,6 +1176,10 @@ cmd_t parse_cmd(int argc, char **argv)
     return std::visit([](auto &&arg) -> cmd_t
                       { return arg; },
                       parse_logs_cmd(argc - 1, &argv[1]));
+  else if (command == "optimize")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_optimize_cmd(argc - 1, &argv[1]));
   else if (command == "remove")
     return std::visit([](auto &&arg) -> cmd_t
                       { return arg; },
@@ -394,6 +1188,14 @@ cmd_t parse_cmd(int argc, char **argv)
     return std::visit([](auto &&arg) -> cmd_t
                       { return arg; },
                       parse_run_cmd(argc - 1, &argv[1]));
+  else if (command == "stats")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_stats_cmd(argc - 1, &argv[1]));
+  else if (command == "switch")
+    return std::visit([](auto &&arg) -> cmd_t
+                      { return arg; },
+                      parse_switch_cmd(argc - 1, &argv[1]));
   else
     throw std::runtime_error("Invalid command.");
 }
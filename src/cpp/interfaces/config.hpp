@@ -9,14 +9,34 @@
 #include <variant>
 #include <map>
 
+#include "cgroup.hpp"
+#include "../core/data.hpp"
+
 const std::filesystem::path CONFIG_PATH = "/succ/defaults.yml";
 
+struct volatile_directory_t
+{
+  std::filesystem::path path;
+  std::optional<std::string> size;
+};
+
 struct config_t
 {
   std::optional<std::string> default_image_name;
   std::optional<version_t> default_image_version;
   std::vector<std::string> persistent_directories;
+  std::vector<volatile_directory_t> volatile_directories;
+  std::vector<std::string> prune_paths;
   std::optional<std::string> default_executable;
+  std::optional<std::filesystem::path> ready_marker;
+  std::optional<int> ready_timeout;
+  std::optional<int> regression_threshold;
+  std::optional<int> to_ram_max_percent;
+  std::optional<std::filesystem::path> metrics_file;
+  std::optional<std::string> switch_command;
+  std::optional<std::filesystem::path> archive_path;
+  std::optional<std::string> archive_compression;
+  cgroup::limits_t build_limits;
 };
 
 struct yml_map_t;
@@ -42,6 +62,13 @@ config_t load_config(std::filesystem::path path = CONFIG_PATH)
 
   std::ifstream file(path);
   std::string line;
+  // list items belong to persistent_dirs unless they follow volatile_dirs or prune_paths
+  enum
+  {
+    LIST_PERSISTENT_DIRS,
+    LIST_VOLATILE_DIRS,
+    LIST_PRUNE_PATHS,
+  } list = LIST_PERSISTENT_DIRS;
   while (std::getline(file, line))
   {
 
@@ -63,11 +90,80 @@ config_t load_config(std::filesystem::path path = CONFIG_PATH)
     if (line.find("executable") == 0)
       config.default_executable = trim(line.substr(line.find(':') + 1));
 
+    if (line.find("ready_marker") == 0)
+      config.ready_marker = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("ready_timeout") == 0)
+      config.ready_timeout = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("regression_threshold") == 0)
+      config.regression_threshold = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("to_ram_max_percent") == 0)
+      config.to_ram_max_percent = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("metrics_file") == 0)
+      config.metrics_file = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("switch_command") == 0)
+      config.switch_command = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("archive_path") == 0)
+      config.archive_path = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("archive_compression") == 0)
+      config.archive_compression = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("build_cpu_weight") == 0)
+      config.build_limits.cpu_weight = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("build_memory_max") == 0)
+      config.build_limits.memory_max = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("build_io_weight") == 0)
+      config.build_limits.io_weight = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("build_io_max") == 0)
+      config.build_limits.io_max = trim(line.substr(line.find(':') + 1));
+
+    if (line.find("build_nice") == 0)
+      config.build_limits.nice = std::stoi(trim(line.substr(line.find(':') + 1)));
+
+    if (line.find("build_ionice") == 0)
+      config.build_limits.ionice = trim(line.substr(line.find(':') + 1));
+
     if (line.find("persistent_dirs") == 0)
+    {
+      list = LIST_PERSISTENT_DIRS;
+      continue;
+    }
+
+    if (line.find("volatile_dirs") == 0)
+    {
+      list = LIST_VOLATILE_DIRS;
       continue;
+    }
+
+    if (line.find("prune_paths") == 0)
+    {
+      list = LIST_PRUNE_PATHS;
+      continue;
+    }
 
     if (trim(line).find('-') == 0)
-      config.persistent_directories.push_back(trim(trim(line).substr(1)));
+    {
+      std::string item = trim(trim(line).substr(1));
+      if (list == LIST_PERSISTENT_DIRS)
+        config.persistent_directories.push_back(item);
+      else if (list == LIST_PRUNE_PATHS)
+        config.prune_paths.push_back(item);
+      else if (item.find(':') == std::string::npos)
+        config.volatile_directories.push_back({.path = item});
+      else
+        config.volatile_directories.push_back({.path = trim(item.substr(0, item.find(':'))), .size = trim(item.substr(item.find(':') + 1))});
+    }
+    else if (!trim(line).empty())
+      list = LIST_PERSISTENT_DIRS;
   }
 
   return config;
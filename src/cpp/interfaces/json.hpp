@@ -0,0 +1,237 @@
+#ifndef json_hpp
+#define json_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+
+// Minimal JSON reader, enough for OCI image layouts. Numbers are kept as doubles and \u escapes outside of
+// the ASCII range are encoded as UTF-8.
+namespace json
+{
+  struct value_t
+  {
+    enum type_t
+    {
+      JSON_NULL,
+      JSON_BOOL,
+      JSON_NUMBER,
+      JSON_STRING,
+      JSON_ARRAY,
+      JSON_OBJECT,
+    } type = JSON_NULL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<value_t> array;
+    std::map<std::string, value_t> object;
+
+    bool has(const std::string &key) const
+    {
+      return type == JSON_OBJECT && object.count(key) > 0;
+    }
+
+    const value_t &at(const std::string &key) const
+    {
+      if (!has(key))
+        throw std::runtime_error("Missing JSON key " + key);
+      return object.at(key);
+    }
+
+    // returns the string value of key, or fallback if it is missing or not a string
+    std::string get(const std::string &key, const std::string &fallback = "") const
+    {
+      return has(key) && object.at(key).type == JSON_STRING ? object.at(key).string : fallback;
+    }
+  };
+
+  class parser_t
+  {
+    const std::string &text;
+    size_t pos = 0;
+
+    void skip()
+    {
+      while (pos < text.size() && isspace((unsigned char)text[pos]))
+        pos++;
+    }
+
+    char peek()
+    {
+      skip();
+      if (pos >= text.size())
+        throw std::runtime_error("Unexpected end of JSON");
+      return text[pos];
+    }
+
+    void expect(char c)
+    {
+      if (peek() != c)
+        throw std::runtime_error(std::string("Expected '") + c + "' in JSON at offset " + std::to_string(pos));
+      pos++;
+    }
+
+    void literal(const std::string &word)
+    {
+      if (text.compare(pos, word.size(), word) != 0)
+        throw std::runtime_error("Invalid JSON literal at offset " + std::to_string(pos));
+      pos += word.size();
+    }
+
+    std::string parse_string()
+    {
+      expect('"');
+      std::string result;
+      while (pos < text.size() && text[pos] != '"')
+      {
+        char c = text[pos++];
+        if (c != '\\')
+        {
+          result += c;
+          continue;
+        }
+        if (pos >= text.size())
+          break;
+        c = text[pos++];
+        switch (c)
+        {
+        case 'b':
+          result += '\b';
+          break;
+        case 'f':
+          result += '\f';
+          break;
+        case 'n':
+          result += '\n';
+          break;
+        case 'r':
+          result += '\r';
+          break;
+        case 't':
+          result += '\t';
+          break;
+        case 'u':
+        {
+          unsigned code = std::stoul(text.substr(pos, 4), nullptr, 16);
+          pos += 4;
+          if (code < 0x80)
+            result += (char)code;
+          else if (code < 0x800)
+          {
+            result += (char)(0xc0 | (code >> 6));
+            result += (char)(0x80 | (code & 0x3f));
+          }
+          else
+          {
+            result += (char)(0xe0 | (code >> 12));
+            result += (char)(0x80 | ((code >> 6) & 0x3f));
+            result += (char)(0x80 | (code & 0x3f));
+          }
+          break;
+        }
+        default:
+          result += c;
+        }
+      }
+      expect('"');
+      return result;
+    }
+
+  public:
+    parser_t(const std::string &text) : text(text) {}
+
+    value_t parse()
+    {
+      value_t value;
+      char c = peek();
+      if (c == '{')
+      {
+        value.type = value_t::JSON_OBJECT;
+        pos++;
+        if (peek() == '}')
+        {
+          pos++;
+          return value;
+        }
+        while (true)
+        {
+          std::string key = parse_string();
+          expect(':');
+          value.object[key] = parse();
+          if (peek() == ',')
+            pos++;
+          else
+          {
+            expect('}');
+            return value;
+          }
+        }
+      }
+      if (c == '[')
+      {
+        value.type = value_t::JSON_ARRAY;
+        pos++;
+        if (peek() == ']')
+        {
+          pos++;
+          return value;
+        }
+        while (true)
+        {
+          value.array.push_back(parse());
+          if (peek() == ',')
+            pos++;
+          else
+          {
+            expect(']');
+            return value;
+          }
+        }
+      }
+      if (c == '"')
+      {
+        value.type = value_t::JSON_STRING;
+        value.string = parse_string();
+        return value;
+      }
+      if (c == 't' || c == 'f')
+      {
+        value.type = value_t::JSON_BOOL;
+        value.boolean = c == 't';
+        literal(c == 't' ? "true" : "false");
+        return value;
+      }
+      if (c == 'n')
+      {
+        literal("null");
+        return value;
+      }
+      size_t used = 0;
+      value.type = value_t::JSON_NUMBER;
+      value.number = std::stod(text.substr(pos, 32), &used);
+      pos += used;
+      return value;
+    }
+  };
+
+  value_t parse(const std::string &text)
+  {
+    return parser_t(text).parse();
+  }
+
+  value_t load(const std::filesystem::path &path)
+  {
+    std::ifstream file(path);
+    if (!file.is_open())
+      throw std::runtime_error("Cannot open " + path.string());
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return parse(ss.str());
+  }
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef log_hpp
 #define log_hpp
 
+#include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <vector>
@@ -80,6 +81,26 @@ namespace logging
       return std::cout;
     }
   };
+
+  // drops everything but errors, for callers that measure rather than watch
+  class quiet_logger : public logger_t
+  {
+    std::ostream discard{nullptr};
+
+  public:
+    std::ostream &info() override
+    {
+      return discard;
+    }
+    std::ostream &warn() override
+    {
+      return discard;
+    }
+    std::ostream &error() override
+    {
+      return std::cerr;
+    }
+  };
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <exception>
+#include <functional>
+#include <algorithm>
+
+namespace parallel
+{
+  size_t default_threads()
+  {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Calls fn(i) for every i in [0, count) on a pool of threads. The first exception thrown by any call is
+  // rethrown once all threads are done; the remaining indices are skipped.
+  void for_each(size_t count, const std::function<void(size_t)> &fn, size_t threads = default_threads())
+  {
+    threads = std::max<size_t>(1, std::min(threads, count));
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error = nullptr;
+    std::mutex error_mutex;
+
+    auto worker = [&]()
+    {
+      for (size_t i = next++; i < count && !failed; i = next++)
+        try
+        {
+          fn(i);
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = std::current_exception();
+          failed = true;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++)
+      pool.emplace_back(worker);
+    worker();
+    for (auto &thread : pool)
+      thread.join();
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // Bounded queue connecting the stages of a pipeline running on separate threads. Producers block while it is
+  // full, so a slow stage throttles the ones before it instead of letting memory grow.
+  template <typename T>
+  class queue_t
+  {
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+  public:
+    queue_t(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    // returns false if the queue was closed, in which case the item is dropped
+    bool push(T item)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [this]
+                    { return closed || items.size() < capacity; });
+      if (closed)
+        return false;
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+      return true;
+    }
+
+    // returns nullopt once the queue is closed and drained
+    std::optional<T> pop()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [this]
+                     { return closed || !items.empty(); });
+      if (items.empty())
+        return std::nullopt;
+      T item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return item;
+    }
+
+    // called by the producer when it is done, or by the consumer to make the producer give up
+    void close()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      not_empty.notify_all();
+      not_full.notify_all();
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef stats_hpp
+#define stats_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+
+// Syscall instrumentation. Probes are compiled in only if SUCCESSOR_STATS is defined,
+// otherwise SUCC_PROBE expands to nothing and costs nothing.
+#ifdef SUCCESSOR_STATS
+#define SUCC_PROBE(op) stats::probe_t succ_probe_(op)
+#else
+#define SUCC_PROBE(op)
+#endif
+
+namespace stats
+{
+  const std::filesystem::path STATS_PATH = "/succ/stats";
+
+#ifdef SUCCESSOR_STATS
+  const bool enabled = true;
+#else
+  const bool enabled = false;
+#endif
+
+  struct op_stats_t
+  {
+    std::string op;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+  };
+
+  std::mutex &samples_mutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  std::map<std::string, std::vector<uint64_t>> &samples()
+  {
+    static std::map<std::string, std::vector<uint64_t>> samples;
+    return samples;
+  }
+
+  void record(const std::string &op, uint64_t ns)
+  {
+    std::lock_guard<std::mutex> lock(samples_mutex());
+    samples()[op].push_back(ns);
+  }
+
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock(samples_mutex());
+    samples().clear();
+  }
+
+  class probe_t
+  {
+    std::string op;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    probe_t(std::string op) : op(std::move(op)), start(std::chrono::steady_clock::now()) {}
+
+    ~probe_t()
+    {
+      record(op, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+  };
+
+  // nearest-rank percentile of a sorted sample vector
+  uint64_t percentile(const std::vector<uint64_t> &sorted, int p)
+  {
+    if (sorted.empty())
+      return 0;
+    size_t rank = (sorted.size() * p + 99) / 100;
+    return sorted[rank == 0 ? 0 : rank - 1];
+  }
+
+  std::vector<op_stats_t> summarize()
+  {
+    std::lock_guard<std::mutex> lock(samples_mutex());
+    std::vector<op_stats_t> result;
+    for (auto &[op, values] : samples())
+    {
+      std::vector<uint64_t> sorted = values;
+      std::sort(sorted.begin(), sorted.end());
+      uint64_t total = 0;
+      for (auto v : sorted)
+        total += v;
+      result.push_back({.op = op, .count = sorted.size(), .total_ns = total, .p50_ns = percentile(sorted, 50), .p99_ns = percentile(sorted, 99)});
+    }
+    return result;
+  }
+
+  // Stores the summary of the current process under the given session name (switch, build, remove).
+  void save(const std::string &session, std::filesystem::path dir = STATS_PATH)
+  {
+    if (!enabled)
+      return;
+
+    std::filesystem::create_directories(dir);
+    std::filesystem::path tmp = dir / ("." + session + ".tmp");
+    {
+      std::ofstream file(tmp);
+      if (!file.is_open())
+        throw std::runtime_error("Cannot open stats file");
+      for (auto &s : summarize())
+        file << s.op << " " << s.count << " " << s.total_ns << " " << s.p50_ns << " " << s.p99_ns << std::endl;
+    }
+    std::filesystem::rename(tmp, dir / session);
+  }
+
+  std::vector<op_stats_t> load(const std::string &session, std::filesystem::path dir = STATS_PATH)
+  {
+    std::vector<op_stats_t> result;
+    std::ifstream file(dir / session);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream is(line);
+      op_stats_t s;
+      if (is >> s.op >> s.count >> s.total_ns >> s.p50_ns >> s.p99_ns)
+        result.push_back(s);
+    }
+    return result;
+  }
+}
+
+#endif
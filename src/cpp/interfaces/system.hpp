@@ -10,7 +10,23 @@
 #include <sys/mount.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+
+#include "stats.hpp"
+#include "parallel.hpp"
 
 namespace sys
 {
@@ -22,6 +38,7 @@ namespace sys
 
   void pivot_root(std::string new_root, std::string put_old)
   {
+    SUCC_PROBE("pivot_root");
     if (syscall(SYS_pivot_root, new_root.c_str(), put_old.c_str()) != 0)
       throw system_error("Cannot pivot root. Error code: " + std::string(std::strerror(errno)));
   }
@@ -37,6 +54,7 @@ namespace sys
     pid_t pid = 0;
     if (!replace)
     {
+      SUCC_PROBE("fork");
       pid = fork();
       if (pid == -1)
         throw system_error("Cannot fork process. Error code: " + std::string(std::strerror(errno)));
@@ -57,6 +75,7 @@ namespace sys
     }
     else
     {
+      SUCC_PROBE("waitpid");
       int status;
       if (waitpid(pid, &status, 0) == -1)
         throw system_error("Cannot wait for forked process. Error code: " + std::string(std::strerror(errno)));
@@ -64,6 +83,149 @@ namespace sys
     }
   }
 
+  // Starts the command without waiting for it. If output is given, the child gets it as file descriptor 3, so
+  // that it can be passed to tools that only accept a path, as /dev/fd/3. If log is given, it becomes the
+  // standard output and error of the child. If directory is given, the child runs there.
+  pid_t spawn(const std::vector<std::string> &command, int output = -1, int log = -1, const std::string &directory = "")
+  {
+    char *arglist[command.size() + 1];
+    for (size_t i = 0; i < command.size(); i++)
+      arglist[i] = (char *)(command[i].c_str());
+    arglist[command.size()] = NULL;
+
+    pid_t pid;
+    {
+      SUCC_PROBE("fork");
+      pid = fork();
+    }
+    if (pid == -1)
+      throw system_error("Cannot fork process. Error code: " + std::string(std::strerror(errno)));
+    if (pid == 0)
+    {
+      if (log != -1)
+      {
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+      }
+      if (!directory.empty() && chdir(directory.c_str()) != 0)
+        _exit(127);
+      if (output != -1)
+      {
+        if (output == 3)
+          fcntl(output, F_SETFD, 0);
+        else
+          dup2(output, 3);
+      }
+      execvp(arglist[0], arglist);
+      _exit(127);
+    }
+    return pid;
+  }
+
+  int wait(pid_t pid)
+  {
+    SUCC_PROBE("waitpid");
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+      throw system_error("Cannot wait for forked process. Error code: " + std::string(std::strerror(errno)));
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+
+  // Waits for any child to exit, returns its pid and exit code.
+  std::pair<pid_t, int> wait_any()
+  {
+    SUCC_PROBE("waitpid");
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid == -1)
+      throw system_error("Cannot wait for forked process. Error code: " + std::string(std::strerror(errno)));
+    return {pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)};
+  }
+
+  // Sends SIGTERM to every process it may signal but itself and SIGKILL to whatever is left after the timeout,
+  // reaping its children meanwhile. Meant for PID 1, which every orphan is reparented to, so that having no
+  // children left means that the system is empty.
+  void terminate_all(int timeout_seconds)
+  {
+    if (kill(-1, SIGTERM) != 0 && errno != ESRCH)
+      throw system_error("Cannot signal processes. Error code: " + std::string(std::strerror(errno)));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+      pid_t pid = waitpid(-1, nullptr, WNOHANG);
+      if (pid == -1 && errno == ECHILD)
+        return;
+      if (pid <= 0)
+        usleep(10000);
+    }
+    kill(-1, SIGKILL);
+    while (waitpid(-1, nullptr, 0) > 0)
+      ;
+  }
+
+  // Runs the commands connected by pipes, like `a | b | c` in a shell, with the standard input of the first and
+  // the standard output of the last command inherited. Returns the first non-zero exit code, if any.
+  int execute_pipeline(const std::vector<std::vector<std::string>> &commands)
+  {
+    std::vector<pid_t> pids;
+    int input = STDIN_FILENO;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+      int fds[2] = {-1, -1};
+      if (i + 1 < commands.size() && pipe(fds) != 0)
+        throw system_error("Cannot create pipe. Error code: " + std::string(std::strerror(errno)));
+
+      char *arglist[commands[i].size() + 1];
+      for (size_t j = 0; j < commands[i].size(); j++)
+        arglist[j] = (char *)(commands[i][j].c_str());
+      arglist[commands[i].size()] = NULL;
+
+      pid_t pid;
+      {
+        SUCC_PROBE("fork");
+        pid = fork();
+      }
+      if (pid == -1)
+        throw system_error("Cannot fork process. Error code: " + std::string(std::strerror(errno)));
+      if (pid == 0)
+      {
+        if (input != STDIN_FILENO)
+        {
+          dup2(input, STDIN_FILENO);
+          close(input);
+        }
+        if (fds[1] != -1)
+        {
+          dup2(fds[1], STDOUT_FILENO);
+          close(fds[0]);
+          close(fds[1]);
+        }
+        execvp(arglist[0], arglist);
+        _exit(127);
+      }
+
+      pids.push_back(pid);
+      if (input != STDIN_FILENO)
+        close(input);
+      if (fds[1] != -1)
+        close(fds[1]);
+      input = fds[0];
+    }
+
+    SUCC_PROBE("waitpid");
+    int result = 0;
+    for (pid_t pid : pids)
+    {
+      int status;
+      if (waitpid(pid, &status, 0) == -1)
+        throw system_error("Cannot wait for forked process. Error code: " + std::string(std::strerror(errno)));
+      int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      if (result == 0)
+        result = code;
+    }
+    return result;
+  }
+
   bool binary_exists(std::string name)
   {
     return execute("sh", {"-c", "which " + name}, false, true) == 0;
@@ -82,6 +244,7 @@ namespace sys
 
     std::vector<mount_t> list(std::string path = "/proc/mounts")
     {
+      SUCC_PROBE("mount.list");
       std::vector<mount_t> mounts;
       FILE *fd = setmntent(path.c_str(), "r");
       struct mntent *ent;
@@ -94,35 +257,321 @@ namespace sys
       return mounts;
     }
 
+    bool is_mountpoint(const std::string &path)
+    {
+      std::string target = std::filesystem::weakly_canonical(path).string();
+      for (auto &mount : list())
+        if (mount.target == target)
+          return true;
+      return false;
+    }
+
     void new_namespace()
     {
+      SUCC_PROBE("unshare");
       if (unshare(CLONE_NEWNS) != 0)
         throw system_error("Cannot create new mount namespace. Error code: " + std::string(std::strerror(errno)));
     }
 
     void make_private(const std::string &target)
     {
+      SUCC_PROBE("mount.private");
       if (mount(NULL, target.c_str(), NULL, MS_PRIVATE, NULL) != 0)
         throw system_error("Cannot make mountpoint private. Error code: " + std::string(std::strerror(errno)));
     }
 
     void bind(const std::string &source, const std::string &target)
     {
+      SUCC_PROBE("mount.bind");
       if (mount(source.c_str(), target.c_str(), NULL, MS_BIND, NULL) != 0)
         throw system_error("Cannot bind mountpoint. Error code: " + std::string(std::strerror(errno)));
     }
 
     void move(const std::string &from, const std::string &to)
     {
+      SUCC_PROBE("mount.move");
       if (mount(from.c_str(), to.c_str(), NULL, MS_MOVE, NULL) != 0)
         throw system_error("Cannot move mountpoint. Error code: " + std::string(std::strerror(errno)));
     }
 
     void detach(const std::string &target)
     {
+      SUCC_PROBE("umount");
       if (umount(target.c_str()) != 0)
         throw system_error("Cannot detach mountpoint. Error code: " + std::string(std::strerror(errno)));
     }
+
+    // detaches the mount and everything below it, once they are no longer busy
+    void detach_lazily(const std::string &target)
+    {
+      SUCC_PROBE("umount");
+      if (umount2(target.c_str(), MNT_DETACH) != 0)
+        throw system_error("Cannot detach mountpoint. Error code: " + std::string(std::strerror(errno)));
+    }
+
+    void mount_fs(const std::string &type, const std::string &target, const std::string &options, const std::string &source = "none", unsigned long flags = 0)
+    {
+      SUCC_PROBE("mount." + type);
+      if (mount(source.c_str(), target.c_str(), type.c_str(), flags, options.c_str()) != 0)
+        throw system_error("Cannot mount " + type + " on " + target + ". Error code: " + std::string(std::strerror(errno)));
+    }
+
+    void tmpfs(const std::string &target, const std::string &size)
+    {
+      mount_fs("tmpfs", target, "size=" + size + ",mode=0755", "tmpfs");
+    }
+
+    void overlay(const std::string &lower, const std::string &upper, const std::string &work, const std::string &target)
+    {
+      mount_fs("overlay", target, "lowerdir=" + lower + ",upperdir=" + upper + ",workdir=" + work, "overlay");
+    }
+  }
+
+
+  namespace fs
+  {
+    unsigned long type(const std::string &path)
+    {
+      struct statfs st;
+      if (statfs(path.c_str(), &st) != 0)
+        throw system_error("Cannot stat filesystem of " + path + ". Error code: " + std::string(std::strerror(errno)));
+      return st.f_type;
+    }
+
+    // subvolume roots always have the first free object id as their inode number
+    bool is_btrfs_subvolume(const std::string &path)
+    {
+      struct stat st;
+      return lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_ino == BTRFS_FIRST_FREE_OBJECTID &&
+             type(path) == BTRFS_SUPER_MAGIC;
+    }
+
+    // opens the parent directory of path and fills name with the last component of path
+    int open_parent(const std::string &path, char *name, size_t size)
+    {
+      std::string parent = path.substr(0, path.find_last_of('/'));
+      std::string base = path.substr(path.find_last_of('/') + 1);
+      if (base.empty() || base.size() >= size)
+        throw system_error("Invalid subvolume path " + path);
+      std::strncpy(name, base.c_str(), size - 1);
+      int fd = open(parent.empty() ? "/" : parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd == -1)
+        throw system_error("Cannot open " + parent + ". Error code: " + std::string(std::strerror(errno)));
+      return fd;
+    }
+
+    void btrfs_subvolume_create(const std::string &path)
+    {
+      SUCC_PROBE("btrfs.create");
+      struct btrfs_ioctl_vol_args args = {};
+      int fd = open_parent(path, args.name, sizeof(args.name));
+      int result = ioctl(fd, BTRFS_IOC_SUBVOL_CREATE, &args);
+      int error = errno;
+      close(fd);
+      if (result != 0)
+        throw system_error("Cannot create subvolume " + path + ". Error code: " + std::string(std::strerror(error)));
+    }
+
+    void btrfs_snapshot(const std::string &source, const std::string &dest)
+    {
+      SUCC_PROBE("btrfs.snapshot");
+      struct btrfs_ioctl_vol_args_v2 args = {};
+      int source_fd = open(source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (source_fd == -1)
+        throw system_error("Cannot open " + source + ". Error code: " + std::string(std::strerror(errno)));
+      args.fd = source_fd;
+      int fd;
+      try
+      {
+        fd = open_parent(dest, args.name, sizeof(args.name));
+      }
+      catch (const system_error &e)
+      {
+        close(source_fd);
+        throw;
+      }
+      int result = ioctl(fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+      int error = errno;
+      close(fd);
+      close(source_fd);
+      if (result != 0)
+        throw system_error("Cannot snapshot " + source + ". Error code: " + std::string(std::strerror(error)));
+    }
+
+    void btrfs_subvolume_delete(const std::string &path)
+    {
+      SUCC_PROBE("btrfs.delete");
+      struct btrfs_ioctl_vol_args args = {};
+      int fd = open_parent(path, args.name, sizeof(args.name));
+      int result = ioctl(fd, BTRFS_IOC_SNAP_DESTROY, &args);
+      int error = errno;
+      close(fd);
+      if (result != 0)
+        throw system_error("Cannot delete subvolume " + path + ". Error code: " + std::string(std::strerror(error)));
+    }
+
+    // Bytes needed to hold the regular files of the tree on a filesystem with 4 KiB pages, like tmpfs.
+    uint64_t tree_size(const std::string &root)
+    {
+      uint64_t size = 0;
+      for (auto it = std::filesystem::recursive_directory_iterator(root); it != std::filesystem::recursive_directory_iterator(); it++)
+        if (it->is_regular_file() && !it->is_symlink())
+          size += (it->file_size() + 4095) / 4096 * 4096;
+      return size;
+    }
+
+    void copy_metadata(const std::string &from, const std::string &to, const struct stat &st)
+    {
+      struct timespec times[2] = {st.st_atim, st.st_mtim};
+      if (lchown(to.c_str(), st.st_uid, st.st_gid) != 0 || (!S_ISLNK(st.st_mode) && chmod(to.c_str(), st.st_mode & 07777) != 0))
+        throw system_error("Cannot change the owner and mode of " + to + ". Error code: " + std::string(std::strerror(errno)));
+
+      ssize_t size = llistxattr(from.c_str(), NULL, 0);
+      if (size > 0)
+      {
+        std::vector<char> names(size);
+        size = llistxattr(from.c_str(), names.data(), names.size());
+        for (ssize_t i = 0; i < size; i += strlen(&names[i]) + 1)
+        {
+          const char *name = &names[i];
+          ssize_t length = lgetxattr(from.c_str(), name, NULL, 0);
+          if (length < 0)
+            continue;
+          std::vector<char> value(length);
+          length = lgetxattr(from.c_str(), name, value.data(), value.size());
+          if (length >= 0 && lsetxattr(to.c_str(), name, value.data(), length, 0) != 0 && errno != ENOTSUP)
+            throw system_error("Cannot copy extended attribute " + std::string(name) + " of " + from + ". Error code: " + std::string(std::strerror(errno)));
+        }
+      }
+
+      if (utimensat(AT_FDCWD, to.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+        throw system_error("Cannot change the timestamps of " + to + ". Error code: " + std::string(std::strerror(errno)));
+    }
+
+    void copy_data(const std::string &from, const std::string &to, uint64_t size)
+    {
+      int in = open(from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (in == -1)
+        throw system_error("Cannot open " + from + ". Error code: " + std::string(std::strerror(errno)));
+      int out = open(to.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (out == -1)
+      {
+        close(in);
+        throw system_error("Cannot open " + to + ". Error code: " + std::string(std::strerror(errno)));
+      }
+
+      bool fallback = false;
+      while (size > 0 && !fallback)
+      {
+        ssize_t count = copy_file_range(in, NULL, out, NULL, size, 0);
+        if (count == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+          fallback = true;
+        else if (count == -1 && errno != EINTR)
+          break;
+        else if (count == 0)
+          size = 0;
+        else if (count > 0)
+          size -= count;
+      }
+      // both offsets moved along, so the plain copy continues where copy_file_range stopped
+      char buffer[1 << 16];
+      ssize_t count = 0;
+      while (fallback && (count = read(in, buffer, sizeof(buffer))) > 0)
+        if (write(out, buffer, count) != count)
+        {
+          count = -1;
+          break;
+        }
+      int error = errno;
+      bool failed = (size > 0 && !fallback) || count < 0;
+      close(in);
+      if (close(out) != 0 || failed)
+        throw system_error("Cannot copy " + from + ". Error code: " + std::string(std::strerror(failed ? error : errno)));
+    }
+
+    // Copies the content of from into the existing directory to, keeping owners, modes, timestamps, extended
+    // attributes and hardlinks. The structure is created in one pass, then the regular files are filled in
+    // parallel with copy_file_range, so that the data does not bounce through user space.
+    void copy_tree(const std::string &from, const std::string &to, size_t threads = parallel::default_threads())
+    {
+      std::vector<std::pair<std::string, struct stat>> files, directories;
+      std::map<std::pair<dev_t, ino_t>, std::string> links;
+
+      struct stat st;
+      if (lstat(from.c_str(), &st) != 0)
+        throw system_error("Cannot stat " + from + ". Error code: " + std::string(std::strerror(errno)));
+      directories.push_back({"", st});
+
+      for (auto it = std::filesystem::recursive_directory_iterator(from); it != std::filesystem::recursive_directory_iterator(); it++)
+      {
+        std::string relative = it->path().lexically_relative(from).string();
+        std::string source = from + "/" + relative, dest = to + "/" + relative;
+        if (lstat(source.c_str(), &st) != 0)
+          throw system_error("Cannot stat " + source + ". Error code: " + std::string(std::strerror(errno)));
+
+        if (S_ISDIR(st.st_mode))
+        {
+          if (mkdir(dest.c_str(), 0700) != 0)
+            throw system_error("Cannot create " + dest + ". Error code: " + std::string(std::strerror(errno)));
+          directories.push_back({relative, st});
+          continue;
+        }
+
+        if (st.st_nlink > 1)
+        {
+          auto [link, inserted] = links.emplace(std::make_pair(st.st_dev, st.st_ino), relative);
+          if (!inserted)
+          {
+            if (::link((to + "/" + link->second).c_str(), dest.c_str()) != 0)
+              throw system_error("Cannot link " + dest + ". Error code: " + std::string(std::strerror(errno)));
+            continue;
+          }
+        }
+
+        int result;
+        if (S_ISREG(st.st_mode))
+        {
+          result = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+          if (result != -1)
+            result = close(result);
+          files.push_back({relative, st});
+        }
+        else if (S_ISLNK(st.st_mode))
+          result = symlink(std::filesystem::read_symlink(source).c_str(), dest.c_str());
+        else
+          result = mknod(dest.c_str(), st.st_mode, st.st_rdev);
+        if (result != 0)
+          throw system_error("Cannot create " + dest + ". Error code: " + std::string(std::strerror(errno)));
+        if (!S_ISREG(st.st_mode))
+          copy_metadata(source, dest, st);
+      }
+
+      parallel::for_each(files.size(), [&](size_t i)
+                         {
+                           auto &[relative, st] = files[i];
+                           copy_data(from + "/" + relative, to + "/" + relative, st.st_size);
+                           copy_metadata(from + "/" + relative, to + "/" + relative, st); }, threads);
+
+      // last, creating the content changes the modification time of directories
+      for (auto it = directories.rbegin(); it != directories.rend(); it++)
+        copy_metadata(from + "/" + it->first, to + "/" + it->first, it->second);
+    }
+  }
+
+  // MemAvailable of /proc/meminfo, in bytes
+  uint64_t memory_available()
+  {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    uint64_t value;
+    std::string unit;
+    while (meminfo >> key >> value)
+    {
+      std::getline(meminfo, unit);
+      if (key == "MemAvailable:")
+        return value * 1024;
+    }
+    throw system_error("Cannot read the available memory");
   }
 
 }
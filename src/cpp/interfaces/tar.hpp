@@ -0,0 +1,265 @@
+#ifndef tar_hpp
+#define tar_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <unistd.h>
+
+// Streaming reader for ustar archives with the GNU long name and pax extensions, as written by container
+// builders. Entries are read strictly in order from a file descriptor, so the archive can come from a pipe.
+namespace tar
+{
+  const size_t HEADER_SIZE = 512;
+
+  enum type_t : char
+  {
+    TYPE_FILE = '0',
+    TYPE_HARDLINK = '1',
+    TYPE_SYMLINK = '2',
+    TYPE_CHAR = '3',
+    TYPE_BLOCK = '4',
+    TYPE_DIRECTORY = '5',
+    TYPE_FIFO = '6',
+  };
+
+  struct header_t
+  {
+    std::string path;
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    int64_t mtime;
+    std::string link;
+    unsigned devmajor;
+    unsigned devminor;
+    std::map<std::string, std::string> xattrs;
+  };
+
+  // octal, or base-256 if the high bit of the first byte is set
+  uint64_t parse_number(const char *field, size_t length)
+  {
+    uint64_t value = 0;
+    if ((unsigned char)field[0] & 0x80)
+    {
+      value = (unsigned char)field[0] & 0x3f;
+      for (size_t i = 1; i < length; i++)
+        value = (value << 8) | (unsigned char)field[i];
+      return value;
+    }
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+      i++;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+      value = value * 8 + (field[i] - '0');
+    return value;
+  }
+
+  std::string parse_string(const char *field, size_t length)
+  {
+    return std::string(field, strnlen(field, length));
+  }
+
+  class reader_t
+  {
+    int fd;
+    char buffer[1 << 16];
+    size_t position = 0, available = 0;
+    uint64_t remaining = 0; // content bytes of the current entry not read yet
+    uint64_t padding = 0;
+
+    size_t read_some(char *out, size_t size)
+    {
+      if (available == position)
+      {
+        // large reads bypass the buffer
+        if (size >= sizeof(buffer))
+        {
+          ssize_t count;
+          while ((count = ::read(fd, out, size)) == -1 && errno == EINTR)
+            ;
+          if (count == -1)
+            throw std::runtime_error("Cannot read archive. Error code: " + std::string(std::strerror(errno)));
+          return count;
+        }
+        ssize_t count;
+        while ((count = ::read(fd, buffer, sizeof(buffer))) == -1 && errno == EINTR)
+          ;
+        if (count == -1)
+          throw std::runtime_error("Cannot read archive. Error code: " + std::string(std::strerror(errno)));
+        position = 0;
+        available = count;
+        if (count == 0)
+          return 0;
+      }
+      size_t count = std::min(size, available - position);
+      memcpy(out, buffer + position, count);
+      position += count;
+      return count;
+    }
+
+    // returns false on a clean end of file before the first byte
+    bool read_exact(char *out, size_t size)
+    {
+      size_t done = 0;
+      while (done < size)
+      {
+        size_t count = read_some(out + done, size - done);
+        if (count == 0)
+        {
+          if (done == 0)
+            return false;
+          throw std::runtime_error("Truncated archive");
+        }
+        done += count;
+      }
+      return true;
+    }
+
+    void skip(uint64_t size)
+    {
+      char scratch[HEADER_SIZE * 8];
+      while (size > 0)
+      {
+        size_t count = std::min<uint64_t>(size, sizeof(scratch));
+        if (!read_exact(scratch, count))
+          throw std::runtime_error("Truncated archive");
+        size -= count;
+      }
+    }
+
+    std::string read_content(uint64_t size)
+    {
+      std::string content(size, '\0');
+      if (size > 0 && !read_exact(content.data(), size))
+        throw std::runtime_error("Truncated archive");
+      skip((HEADER_SIZE - size % HEADER_SIZE) % HEADER_SIZE);
+      return content;
+    }
+
+    // pax records look like "LENGTH KEY=VALUE\n", where LENGTH covers the whole record
+    static void parse_pax(const std::string &content, std::map<std::string, std::string> &records)
+    {
+      size_t offset = 0;
+      while (offset < content.size())
+      {
+        size_t space = content.find(' ', offset);
+        if (space == std::string::npos)
+          break;
+        size_t length = std::stoul(content.substr(offset, space - offset));
+        if (length == 0 || offset + length > content.size())
+          throw std::runtime_error("Malformed pax header");
+        std::string record = content.substr(space + 1, offset + length - space - 2);
+        size_t equals = record.find('=');
+        if (equals != std::string::npos)
+          records[record.substr(0, equals)] = record.substr(equals + 1);
+        offset += length;
+      }
+    }
+
+  public:
+    reader_t(int fd) : fd(fd) {}
+
+    // Reads the header of the next entry, skipping whatever is left of the current one. Returns false at the end
+    // of the archive.
+    bool next(header_t &header)
+    {
+      skip(remaining + padding);
+      remaining = padding = 0;
+
+      std::string long_path, long_link;
+      std::map<std::string, std::string> pax;
+      char block[HEADER_SIZE];
+      while (true)
+      {
+        if (!read_exact(block, HEADER_SIZE))
+          return false;
+        if (std::all_of(block, block + HEADER_SIZE, [](char c)
+                        { return c == 0; }))
+          return false;
+
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < HEADER_SIZE; i++)
+          checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block[i];
+        if (checksum != parse_number(block + 148, 8))
+          throw std::runtime_error("Invalid archive header checksum");
+
+        char type = block[156];
+        uint64_t size = parse_number(block + 124, 12);
+        if (type == 'L')
+          long_path = read_content(size).c_str();
+        else if (type == 'K')
+          long_link = read_content(size).c_str();
+        else if (type == 'x')
+          parse_pax(read_content(size), pax);
+        else if (type == 'g')
+          read_content(size);
+        else
+        {
+          header.type = type == '\0' || type == '7' ? TYPE_FILE : type;
+          header.mode = parse_number(block + 100, 8) & 07777;
+          header.uid = parse_number(block + 108, 8);
+          header.gid = parse_number(block + 116, 8);
+          header.size = size;
+          header.mtime = parse_number(block + 136, 12);
+          header.link = parse_string(block + 157, 100);
+          header.devmajor = parse_number(block + 329, 8);
+          header.devminor = parse_number(block + 337, 8);
+          header.path = parse_string(block, 100);
+          // POSIX ustar only, GNU archives keep other data there
+          if (memcmp(block + 257, "ustar\0", 6) == 0 && block[345] != '\0')
+            header.path = parse_string(block + 345, 155) + "/" + header.path;
+          header.xattrs.clear();
+          break;
+        }
+      }
+
+      if (!long_path.empty())
+        header.path = long_path;
+      if (!long_link.empty())
+        header.link = long_link;
+      for (auto &[key, value] : pax)
+        if (key == "path")
+          header.path = value;
+        else if (key == "linkpath")
+          header.link = value;
+        else if (key == "size")
+          header.size = std::stoull(value);
+        else if (key == "uid")
+          header.uid = std::stoul(value);
+        else if (key == "gid")
+          header.gid = std::stoul(value);
+        else if (key == "mtime")
+          header.mtime = std::stoll(value);
+        else if (key.rfind("SCHILY.xattr.", 0) == 0)
+          header.xattrs[key.substr(13)] = value;
+
+      remaining = header.size;
+      padding = (HEADER_SIZE - header.size % HEADER_SIZE) % HEADER_SIZE;
+      // only the content of regular files is meaningful, anything else is skipped by the next call
+      if (header.type != TYPE_FILE)
+        header.size = 0;
+      return true;
+    }
+
+    // Reads up to size bytes of the content of the current entry, returns 0 once all of it was read.
+    size_t read(char *out, size_t size)
+    {
+      size = std::min<uint64_t>(size, remaining);
+      if (size == 0)
+        return 0;
+      if (!read_exact(out, size))
+        throw std::runtime_error("Truncated archive");
+      remaining -= size;
+      return size;
+    }
+  };
+}
+
+#endif
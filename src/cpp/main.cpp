@@ -1,10 +1,23 @@
 #include <iostream>
+#include <iomanip>
 
 #include "interfaces/cli.hpp"
 #include "interfaces/config.hpp"
+#include "interfaces/stats.hpp"
 
 #include "core/inventory.hpp"
+#include "core/delta.hpp"
+#include "core/ingest.hpp"
+#include "core/oci.hpp"
+#include "core/history.hpp"
 #include "core/runner.hpp"
+#include "core/scheduler.hpp"
+#include "core/metrics.hpp"
+#include "core/switcher.hpp"
+#include "core/lazy.hpp"
+#include "core/optimize.hpp"
+#include "core/tier.hpp"
+#include "core/agent.hpp"
 
 int main(int argc, char **argv)
 {
@@ -27,16 +40,71 @@ int main(int argc, char **argv)
   }
   catch (const std::exception &e)
   {
-    std::cout << e.what() << std::endl;
-    std::cout << "Unable to load config file." << std::endl;
+    std::cerr << e.what() << std::endl;
+    std::cerr << "Unable to load config file." << std::endl;
     return 1;
   }
 
+  // name of the stats session to store once the command is done, if any
+  std::string stats_session;
+  // whether the command changed anything the metrics file reports
+  bool update_metrics = false;
+  // records a permanent switch for `list --timings` and the metrics, called once the root is switched
+  auto record_switch = [&config](const entity_t &entity, logging::logger_t &logger)
+  {
+    return [entity, &config, &logger](int64_t switch_us, const std::vector<std::pair<std::string, int64_t>> &phases)
+    {
+      metrics::record_switch(config, entity, switch_us, phases, logger);
+    };
+  };
+  // with an agent running, builds and removes run as its jobs, one at a time, and their output is streamed back;
+  // returns false without one
+  auto queue_job = [argc, argv]()
+  {
+    auto client = agent::connect();
+    if (!client)
+      return false;
+    std::vector<std::string> request = {"job", std::filesystem::current_path().string()};
+    request.insert(request.end(), argv + 1, argv + argc);
+    client->request(request, [](const std::vector<std::string> &fields)
+                    {
+                      if (fields.size() == 2 && fields[0] == "queued")
+                        std::cout << "Queued as job " << fields[1] << " of the agent" << std::endl;
+                      else
+                        std::cout << (fields.empty() ? "" : fields[0]) << std::endl; });
+    return true;
+  };
+  int exit_code = 0;
   try
   {
     std::visit(
-        overloaded{[&config](build_cmd_t &cmd)
+        overloaded{[&config, &stats_session, &exit_code, &update_metrics, &queue_job](build_cmd_t &cmd)
                    {
+                     if (queue_job())
+                       return;
+                     update_metrics = true;
+                     if (cmd.manifest.has_value())
+                     {
+                       auto results = scheduler::run(scheduler::load(cmd.manifest.value()), cmd.jobs.value_or(scheduler::DEFAULT_JOBS));
+                       std::cout << std::endl
+                                 << std::left << std::setw(24) << "image" << std::setw(10) << "result" << std::right
+                                 << std::setw(9) << "version" << std::setw(14) << "duration (s)" << std::setw(12) << "size (MiB)"
+                                 << "  log" << std::endl;
+                       for (auto &result : results)
+                       {
+                         const char *status = result.status == scheduler::STATUS_SUCCEEDED ? "ok" : result.status == scheduler::STATUS_FAILED ? "failed"
+                                                                                                                                               : "skipped";
+                         std::cout << std::left << std::setw(24) << result.name << std::setw(10) << status << std::right << std::fixed << std::setprecision(1);
+                         if (result.status == scheduler::STATUS_SKIPPED)
+                           std::cout << std::endl;
+                         else
+                           std::cout << std::setw(9) << (result.version ? std::to_string(result.version) : "-") << std::setw(14) << result.duration_ms / 1e3
+                                     << std::setw(12) << result.size / 1048576.0 << "  " << result.log.string() << std::endl;
+                         if (result.status != scheduler::STATUS_SUCCEEDED)
+                           exit_code = 1;
+                       }
+                       return;
+                     }
                      if (!cmd.image.has_value() && !config.default_image_name.has_value())
                        throw std::runtime_error("No image name provided");
                      entity_t entity = inventory::resolve(
@@ -44,37 +112,230 @@ int main(int argc, char **argv)
                          cmd.version.value_or(version_latest));
                      entity.version++;
                      std::cout << "Building image " << entity.name << ":" << entity.version << std::endl;
-                     inventory::build(entity, cmd.source);
+                     stats_session = "build";
+                     inventory::before_publish_t before_publish = nullptr;
+                     if (cmd.optimize)
+                       before_publish = [&entity, &config](const std::filesystem::path &root) -> std::optional<std::vector<manifest::entry_t>>
+                       {
+                         std::cout << "Optimizing image " << entity.name << ":" << entity.version << std::endl;
+                         optimize::report_t report;
+                         auto entries = optimize::run(root, {.prune_paths = config.prune_paths, .hot_list = lazy::hot_list_path(entity.name)}, report);
+                         optimize::print(report);
+                         return entries;
+                       };
+                     inventory::isolate_build(entity, config.build_limits, [&cmd, &entity, &before_publish]()
+                                              {
+                                                if (cmd.stream)
+                                                  ingest::build(entity, cmd.source, before_publish);
+                                                else if (cmd.oci_layout.has_value())
+                                                  oci::build(entity, cmd.oci_layout.value(), before_publish);
+                                                else
+                                                  inventory::build(entity, cmd.source, before_publish); });
+                     if (config.archive_path.has_value())
+                       tier::archive_in_background();
                    },
-                   [&config](list_cmd_t &cmd)
+                   [&config](delta_cmd_t &cmd)
+                   {
+                     if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                       throw std::runtime_error("No image name provided");
+                     if (isatty(STDOUT_FILENO))
+                       throw std::runtime_error("Refusing to write the delta pack to a terminal, redirect the output to a file");
+                     std::string image = cmd.image.value_or(config.default_image_name.value_or(""));
+                     entity_t from = inventory::resolve(image, cmd.from);
+                     entity_t to = inventory::resolve(image, cmd.to);
+                     // before locking, as rehydrating takes the lock itself
+                     tier::rehydrate(from);
+                     tier::rehydrate(to);
+                     inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                     std::cerr << "Creating delta pack " << image << ":" << from.version << " -> " << to.version << std::endl;
+                     delta::create(from, to);
+                   },
+                   [&config](diff_cmd_t &cmd)
                    {
-                     auto current = inventory::current();
-                     for (auto &image : inventory::list_images())
+                     if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                       throw std::runtime_error("No image name provided");
+                     std::string image = cmd.image.value_or(config.default_image_name.value_or(""));
+                     inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                     entity_t from = inventory::resolve(image, cmd.from), to = inventory::resolve(image, cmd.to);
+
+                     // stored manifests are streamed, versions built before manifests existed are scanned instead
+                     std::ifstream files[2];
+                     std::vector<manifest::entry_t> scanned[2];
+                     manifest::source_t sources[2];
+                     for (int i = 0; i < 2; i++)
                      {
-                       std::cout << "Image Name: " << image << std::endl;
-                       for (auto &version : inventory::list_versions(image))
+                       entity_t entity = i == 0 ? from : to;
+                       if (!std::filesystem::exists(inventory::path(entity)))
+                         throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " does not exist");
+                       files[i].open(inventory::manifest_path(entity));
+                       if (files[i].is_open())
+                         sources[i] = manifest::from_stream(files[i]);
+                       else
                        {
-                         std::cout << "  Version: " << version;
-                         if (entity_t{image, version} == inventory::current())
-                           std::cout << " (current)";
-                         if (config.default_image_name)
-                           if (entity_t{image, version} == inventory::resolve(config.default_image_name.value(), config.default_image_version.value_or(version_latest)))
-                             std::cout << " (next)";
-                          std::cout << std::endl;
+                         scanned[i] = manifest::generate(inventory::path(entity));
+                         sources[i] = manifest::from_vector(scanned[i]);
                        }
                      }
+
+                     size_t added = 0, removed = 0, modified = 0;
+                     int64_t size_delta = 0;
+                     manifest::diff(
+                         sources[0], sources[1],
+                         [&](const manifest::entry_t &e)
+                         {
+                           std::cout << "+ " << e.path << " (" << e.size << " bytes)" << std::endl;
+                           added++, size_delta += e.size;
+                         },
+                         [&](const manifest::entry_t &e)
+                         {
+                           std::cout << "- " << e.path << std::endl;
+                           removed++, size_delta -= e.size;
+                         },
+                         [&](const manifest::entry_t &a, const manifest::entry_t &b)
+                         {
+                           std::cout << "M " << b.path << " (" << a.size << " -> " << b.size << " bytes)" << std::endl;
+                           modified++, size_delta += (int64_t)b.size - (int64_t)a.size;
+                         });
+                     std::cout << added << " added, " << removed << " removed, " << modified << " modified, "
+                               << (size_delta >= 0 ? "+" : "") << size_delta << " bytes" << std::endl;
+                   },
+                   [](apply_cmd_t &cmd)
+                   {
+                     entity_t entity = delta::apply(cmd.image);
+                     std::cout << "Applied delta pack as image " << entity.name << ":" << entity.version << std::endl;
+                   },
+                   [&config](archive_cmd_t &cmd)
+                   {
+                     if (cmd.restore)
+                     {
+                       if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                         throw std::runtime_error("No image name provided");
+                       entity_t entity = inventory::resolve(
+                           cmd.image.value_or(config.default_image_name.value_or("")),
+                           cmd.version.value_or(version_latest));
+                       if (!tier::is_archived(entity))
+                         throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " is not archived");
+                       tier::rehydrate(entity);
+                       std::cout << "Rehydrated image " << entity.name << ":" << entity.version << std::endl;
+                       return;
+                     }
+                     if (cmd.background)
+                       cgroup::set_priority({.nice = 19, .ionice = "idle"});
+                     int archived = tier::archive(config);
+                     std::cout << "Archived " << archived << " versions" << std::endl;
+                   },
+                   [&config](export_cmd_t &cmd)
+                   {
+                     if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                       throw std::runtime_error("No image name provided");
+                     if (!cmd.store.has_value() && isatty(STDOUT_FILENO))
+                       throw std::runtime_error("Refusing to write the archive to a terminal, redirect the output to a file");
+                     entity_t entity = inventory::resolve(
+                         cmd.image.value_or(config.default_image_name.value_or("")),
+                         cmd.version.value_or(version_latest));
+                     tier::rehydrate(entity);
+                     inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                     if (lazy::is_lazy(entity))
+                       throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " is lazy, its files are in its blob store");
+                     if (cmd.store.has_value())
+                     {
+                       lazy::push(entity, cmd.store.value());
+                       return;
+                     }
+                     // the standard output carries the archive, so progress goes to the standard error
+                     std::cerr << "Exporting image " << entity.name << ":" << entity.version << std::endl;
+                     inventory::export_version(entity);
+                   },
+                   [&config](import_cmd_t &cmd)
+                   {
+                     if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                       throw std::runtime_error("No image name provided");
+                     std::string image = cmd.image.value_or(config.default_image_name.value_or(""));
+                     entity_t entity = cmd.store.has_value() ? lazy::import(image, cmd.version.value_or(version_latest), cmd.store.value())
+                                                             : inventory::import_version(image);
+                     std::cout << "Imported image " << entity.name << ":" << entity.version << std::endl;
+                   },
+                   [&config](list_cmd_t &cmd)
+                   {
+                     std::vector<agent::image_info_t> images;
+                     // the timings are not part of the model of the agent
+                     auto client = cmd.timings ? nullptr : agent::connect();
+                     if (client)
+                       client->request({"list"}, [&images](const std::vector<std::string> &fields)
+                                       { agent::decode_list(fields, images); });
+                     else
+                     {
+                       inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                       images = agent::describe(config);
+                     }
+
+                     auto records = cmd.timings ? history::load() : std::vector<history::record_t>{};
+                     std::string image;
+                     std::map<int, history::summary_t> timings;
+                     std::optional<history::summary_t> previous;
+                     agent::print_list(images, [&](const agent::version_info_t &v)
+                                       {
+                                         if (!cmd.timings)
+                                           return;
+                                         if (v.entity.name != image)
+                                         {
+                                           image = v.entity.name;
+                                           timings = history::summarize(records, image);
+                                           previous.reset();
+                                         }
+                                         if (!timings.count(v.entity.version))
+                                           return;
+                                         auto &summary = timings[v.entity.version];
+                                         std::cout << std::fixed << std::setprecision(1) << "  boots: " << summary.boots
+                                                   << "  switch: " << summary.switch_us / 1e3 << " ms"
+                                                   << "  init: " << summary.exec_us / 1e3 << " ms";
+                                         if (summary.ready_us.has_value())
+                                           std::cout << "  ready: " << summary.ready_us.value() / 1e3 << " ms";
+                                         if (previous.has_value())
+                                         {
+                                           auto [before, now] = history::boot_times(previous.value(), summary);
+                                           int threshold = config.regression_threshold.value_or(history::DEFAULT_REGRESSION_THRESHOLD);
+                                           if (before > 0 && now * 100 > before * (100 + threshold))
+                                             std::cout << "  REGRESSION +" << (now - before) * 100 / before << "%";
+                                         }
+                                         previous = summary; });
                    },
                    [](logs_cmd_t &cmd)
                    {
+                     if (auto client = agent::connect())
+                     {
+                       client->request({"logs", std::to_string(cmd.index.value_or(1))}, [](const std::vector<std::string> &fields)
+                                       { std::cout << (fields.empty() ? "" : fields[0]) << std::endl; });
+                       return;
+                     }
                      std::ifstream is = logging::read_log(cmd.index.value_or(1) - 1);
                      std::cout << is.rdbuf() << std::endl;
                    },
-                   [](remove_specific_cmd_t &cmd)
+                   [&config, &update_metrics](optimize_cmd_t &cmd)
+                   {
+                     if (!cmd.image.has_value() && !config.default_image_name.has_value())
+                       throw std::runtime_error("No image name provided");
+                     update_metrics = true;
+                     entity_t base = inventory::resolve(
+                         cmd.image.value_or(config.default_image_name.value_or("")),
+                         cmd.version.value_or(version_latest));
+                     entity_t entity = optimize::version(base, {.prune_paths = config.prune_paths, .hot_list = lazy::hot_list_path(base.name)});
+                     std::cout << "Optimized image " << base.name << ":" << base.version << " into version " << entity.version << std::endl;
+                   },
+                   [&stats_session, &update_metrics, &queue_job](remove_specific_cmd_t &cmd)
                    {
-                     inventory::remove(std::vector{inventory::resolve(cmd.image, cmd.version)});
+                     if (queue_job())
+                       return;
+                     update_metrics = true;
+                     stats_session = "remove";
+                     tier::remove(std::vector{inventory::resolve(cmd.image, cmd.version)});
                    },
-                   [](remove_unused_cmd_t &cmd)
+                   [&stats_session, &update_metrics, &queue_job](remove_unused_cmd_t &cmd)
                    {
+                     if (queue_job())
+                       return;
+                     update_metrics = true;
+                     stats_session = "remove";
                      auto versions = inventory::list_versions(cmd.image);
                      for (auto &version : versions)
                      {
@@ -88,14 +349,20 @@ int main(int argc, char **argv)
                          std::cout << "Ignoring latest version" << std::endl;
                          break;
                        }
-                       inventory::remove(std::vector{inventory::resolve(cmd.image, version)});
+                       tier::remove(std::vector{inventory::resolve(cmd.image, version)});
                      }
                    },
-                   [&config](run_cmd_t &cmd)
+                   [&config, &stats_session, &record_switch](run_cmd_t &cmd)
                    {
-                     auto entity = inventory::resolve(cmd.image.value_or(config.default_image_name.value_or("")), cmd.version.value_or(config.default_image_version.value_or(version_latest)));
+                     entity_t entity;
+                     {
+                       // not held while running, so that removing other versions does not wait for it
+                       inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                       entity = inventory::resolve(cmd.image.value_or(config.default_image_name.value_or("")), cmd.version.value_or(config.default_image_version.value_or(version_latest)));
+                     }
                      if (entity.name == "")
                        throw std::runtime_error("No image name provided");
+                     tier::rehydrate(entity);
 
                      std::unique_ptr<logging::logger_t> logger = nullptr;
                      if (cmd.enable_logging)
@@ -116,7 +383,153 @@ int main(int argc, char **argv)
                      if (cmd.add_default_persistent_directories)
                        persistent_directories.insert(persistent_directories.end(), config.persistent_directories.begin(), config.persistent_directories.end());
 
-                     runner::run(*logger, mode, inventory::path(entity), runner::DEFAULT_ROOTBACK, persistent_directories, executable);
+                     stats_session = "switch";
+                     runner::run_options_t options;
+                     if (cmd.ephemeral)
+                       options.ephemeral_size = cmd.ephemeral_size.value_or(runner::DEFAULT_EPHEMERAL_SIZE);
+                     if (cmd.to_ram)
+                       options.to_ram_percent = config.to_ram_max_percent.value_or(runner::DEFAULT_TO_RAM_PERCENT);
+                     for (auto &directory : config.volatile_directories)
+                       options.volatile_directories.push_back({directory.path, directory.size.value_or(runner::DEFAULT_VOLATILE_SIZE)});
+                     if (lazy::is_lazy(entity))
+                       options.lazy = lazy::source_of(entity);
+                     if (mode == runner::RUN_MODE_PERMANENT)
+                       options.on_switched = record_switch(entity, *logger);
+
+                     try
+                     {
+                       runner::run(*logger, mode, inventory::path(entity), runner::DEFAULT_ROOTBACK, persistent_directories, executable, options);
+                     }
+                     catch (const std::exception &e)
+                     {
+                       metrics::record_failure(config, entity, *logger);
+                       throw;
+                     }
+                   },
+                   [&config, &record_switch](switch_cmd_t &cmd)
+                   {
+                     logging::tty_logger logger;
+                     auto resolve = [&cmd, &config]()
+                     {
+                       inventory::lock_t lock(inventory::LOCK_MODE_SHARED);
+                       auto entity = inventory::resolve(cmd.image.value_or(config.default_image_name.value_or("")), cmd.version.value_or(config.default_image_version.value_or(version_latest)));
+                       if (entity.name == "")
+                         throw std::runtime_error("No image name provided");
+                       return switcher::request_t{.entity = entity, .executable = cmd.executable.value_or(config.default_executable.value_or(switcher::DEFAULT_INIT))};
+                     };
+                     auto prepare = [](const entity_t &entity)
+                     {
+                       switcher::check_current_root();
+                       tier::rehydrate(entity);
+                       if (!std::filesystem::exists(inventory::path(entity)))
+                         throw std::runtime_error("Image " + entity.name + ":" + std::to_string(entity.version) + " does not exist");
+                     };
+
+                     if (getpid() != 1)
+                     {
+                       auto request = resolve();
+                       prepare(request.entity);
+                       if (!config.switch_command.has_value())
+                         throw std::runtime_error("Not running as PID 1 and no switch_command is configured");
+                       switcher::write_request(request);
+                       std::cout << "Requesting a switch to " << request.entity.name << ":" << request.entity.version << " from the running init..." << std::endl;
+                       if (sys::execute("sh", {"-c", config.switch_command.value()}) != 0)
+                       {
+                         std::filesystem::remove(switcher::REQUEST_PATH);
+                         throw std::runtime_error("switch_command failed");
+                       }
+                       return;
+                     }
+
+                     // PID 1 must not exit, so from here on whatever goes wrong ends in the init of the root we are in
+                     std::optional<entity_t> entity;
+                     try
+                     {
+                       std::optional<switcher::request_t> request = switcher::take_request();
+                       if (!request.has_value() || cmd.image.has_value() || cmd.version.has_value() || cmd.executable.has_value())
+                         request = resolve();
+                       entity = request->entity;
+                       prepare(entity.value());
+
+                       logger.info() << "Stopping all processes..." << std::endl;
+                       sys::terminate_all(cmd.timeout.value_or(switcher::DEFAULT_STOP_TIMEOUT));
+                       sync();
+
+                       std::vector<std::filesystem::path> persistent_directories = {"/succ"};
+                       persistent_directories.insert(persistent_directories.end(), config.persistent_directories.begin(), config.persistent_directories.end());
+                       runner::run_options_t options;
+                       options.drop_previous_root = true;
+                       for (auto &directory : config.volatile_directories)
+                         options.volatile_directories.push_back({directory.path, directory.size.value_or(runner::DEFAULT_VOLATILE_SIZE)});
+                       if (lazy::is_lazy(entity.value()))
+                         options.lazy = lazy::source_of(entity.value());
+                       options.on_switched = record_switch(entity.value(), logger);
+                       runner::run(logger, runner::RUN_MODE_PERMANENT, inventory::path(entity.value()), runner::DEFAULT_ROOTBACK, persistent_directories, request->executable, options);
+                       throw std::runtime_error(request->executable.string() + " returned");
+                     }
+                     catch (const std::exception &e)
+                     {
+                       logger.error() << "Switch failed because of " << e.what() << std::endl;
+                       if (entity.has_value())
+                         metrics::record_failure(config, entity.value(), logger);
+                     }
+                     logger.error() << "Starting " << switcher::DEFAULT_INIT.string() << " instead..." << std::endl;
+                     try
+                     {
+                       sys::execute(switcher::DEFAULT_INIT, {}, true);
+                     }
+                     catch (const std::exception &e)
+                     {
+                       logger.error() << "Cannot start " << switcher::DEFAULT_INIT.string() << ": " << e.what() << std::endl;
+                     }
+                     // without an init to hand over to, waiting beats the kernel panic of an exiting PID 1
+                     while (true)
+                       pause();
+                   },
+                   [](agent_cmd_t &cmd)
+                   {
+                     if (!cmd.jobs && !cmd.follow.has_value())
+                     {
+                       agent::server_t().run();
+                       return;
+                     }
+                     auto client = agent::connect();
+                     if (!client)
+                       throw std::runtime_error("No agent is running");
+                     if (cmd.jobs)
+                       client->request({"jobs"}, [](const std::vector<std::string> &fields)
+                                       {
+                                         std::cout << std::left << std::setw(6) << fields.at(0) << std::setw(11) << fields.at(1) << std::right;
+                                         for (size_t i = 2; i < fields.size(); i++)
+                                           std::cout << " " << fields[i];
+                                         std::cout << std::endl; });
+                     else
+                       client->request({"follow", std::to_string(cmd.follow.value())}, [](const std::vector<std::string> &fields)
+                                       { std::cout << (fields.empty() ? "" : fields[0]) << std::endl; });
+                   },
+                   [](stats_cmd_t &cmd)
+                   {
+                     if (!stats::enabled)
+                       std::cout << "Warning: this build of successor does not record statistics." << std::endl;
+                     for (std::string session : {"switch", "build", "remove"})
+                     {
+                       if (cmd.session.has_value() && cmd.session.value() != session)
+                         continue;
+                       auto ops = stats::load(session);
+                       std::cout << "Last " << session << ":" << std::endl;
+                       if (ops.empty())
+                       {
+                         std::cout << "  No data recorded." << std::endl;
+                         continue;
+                       }
+                       std::cout << "  " << std::left << std::setw(16) << "operation" << std::right
+                                 << std::setw(8) << "count" << std::setw(14) << "total (ms)"
+                                 << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)" << std::endl;
+                       for (auto &op : ops)
+                         std::cout << "  " << std::left << std::setw(16) << op.op << std::right << std::fixed << std::setprecision(3)
+                                   << std::setw(8) << op.count << std::setw(14) << op.total_ns / 1e6
+                                   << std::setw(12) << op.p50_ns / 1e3 << std::setw(12) << op.p99_ns / 1e3 << std::endl;
+                     }
                    },
                    [](help_cmd_t &cmd)
                    {
@@ -126,7 +539,25 @@ int main(int argc, char **argv)
   }
   catch (const std::exception &e)
   {
-    std::cout << "Successor failed because of " << e.what() << std::endl;
-    return 1;
+    std::cerr << "Successor failed because of " << e.what() << std::endl;
+    exit_code = 1;
+  }
+
+  if (update_metrics)
+  {
+    logging::tty_logger logger;
+    metrics::refresh(config, logger);
   }
+
+  if (!stats_session.empty())
+    try
+    {
+      stats::save(stats_session);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "Warning: cannot store statistics: " << e.what() << std::endl;
+    }
+
+  return exit_code;
 }
\ No newline at end of file
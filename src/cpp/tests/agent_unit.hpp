@@ -0,0 +1,60 @@
+#include "../core/agent.hpp"
+
+BOOST_AUTO_TEST_CASE(test_agent_escape_round_trip)
+{
+  for (std::string field : {"", "plain", "two words", "back\\slash", "multi\nline", "\\s literal", " \\\n "})
+  {
+    std::string escaped = agent::escape(field);
+    BOOST_CHECK(escaped.find(' ') == std::string::npos);
+    BOOST_CHECK(escaped.find('\n') == std::string::npos);
+    BOOST_CHECK_EQUAL(agent::unescape(escaped), field);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_agent_split)
+{
+  BOOST_CHECK(agent::split("").empty());
+  BOOST_CHECK(agent::split("list") == std::vector<std::string>({"list"}));
+  BOOST_CHECK(agent::split("resolve web 3") == std::vector<std::string>({"resolve", "web", "3"}));
+
+  std::vector<std::string> request = {"job", "/home/my dir", "build", "-n", "web", ""};
+  BOOST_CHECK(agent::split(agent::join(request)) == request);
+  BOOST_CHECK_EQUAL(agent::join(request, 2), "build -n web ");
+}
+
+BOOST_AUTO_TEST_CASE(test_agent_list_round_trip)
+{
+  std::vector<agent::image_info_t> images = {
+      {.name = "web", .versions = {{.entity = {"web", 1}, .archived = true}, {.entity = {"web", 2}, .current = true, .next = true}}},
+      {.name = "empty"},
+      {.name = "tools", .versions = {{.entity = {"tools", 4}, .lazy = true}}},
+  };
+  std::string reply = agent::encode_list(images);
+  BOOST_CHECK_EQUAL(reply, "> web 1 archived\n> web 2 current,next\n> empty - -\n> tools 4 lazy\n");
+
+  std::vector<agent::image_info_t> decoded;
+  std::istringstream is(reply);
+  std::string line;
+  while (std::getline(is, line))
+    agent::decode_list(agent::split(line.substr(2)), decoded);
+  BOOST_REQUIRE_EQUAL(decoded.size(), 3);
+  BOOST_CHECK_EQUAL(decoded[0].versions.size(), 2);
+  BOOST_CHECK(decoded[0].versions[0].archived && !decoded[0].versions[0].current);
+  BOOST_CHECK(decoded[0].versions[1].current && decoded[0].versions[1].next);
+  BOOST_CHECK(decoded[1].name == "empty" && decoded[1].versions.empty());
+  BOOST_CHECK(decoded[2].versions[0].lazy);
+  BOOST_CHECK_THROW(agent::decode_list({"web", "1"}, decoded), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_agent_resolve)
+{
+  std::vector<agent::image_info_t> images = {
+      {.name = "web", .versions = {{.entity = {"web", 1}}, {.entity = {"web", 3}}}},
+      {.name = "empty"},
+  };
+  BOOST_CHECK_EQUAL(agent::resolve(images, "web").version, 3);
+  BOOST_CHECK_EQUAL(agent::resolve(images, "web", "1").version, 1);
+  BOOST_CHECK_THROW(agent::resolve(images, "web", "2"), std::runtime_error);
+  BOOST_CHECK_THROW(agent::resolve(images, "empty"), std::runtime_error);
+  BOOST_CHECK_THROW(agent::resolve(images, "missing"), std::runtime_error);
+}
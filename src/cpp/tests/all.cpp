@@ -2,4 +2,13 @@
 #include <boost/test/included/unit_test.hpp>
 
 #include "system_unit.hpp"
-#include "log_smoke.hpp"
\ No newline at end of file
+#include "log_smoke.hpp"
+#include "stats_unit.hpp"
+#include "manifest_unit.hpp"
+#include "json_unit.hpp"
+#include "ingest_unit.hpp"
+#include "config_unit.hpp"
+#include "delta_unit.hpp"
+#include "agent_unit.hpp"
+#include "scheduler_unit.hpp"
+#include "optimize_unit.hpp"
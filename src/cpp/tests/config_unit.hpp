@@ -0,0 +1,27 @@
+#include "../interfaces/config.hpp"
+
+BOOST_AUTO_TEST_CASE(test_config_directories)
+{
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "successor_config_unit.yml";
+  std::ofstream(path) << "image: web\n"
+                      << "persistent_dirs:\n"
+                      << "  - /home\n"
+                      << "volatile_dirs: # on tmpfs\n"
+                      << "  - /tmp: 512M\n"
+                      << "  - /var/cache\n"
+                      << "executable: /sbin/init\n"
+                      << "  - /srv\n"
+                      << "prune_paths:\n"
+                      << "  - /usr/share/doc/*\n";
+
+  config_t config = load_config(path);
+  BOOST_CHECK_EQUAL(config.default_image_name.value(), "web");
+  BOOST_CHECK(config.persistent_directories == std::vector<std::string>({"/home", "/srv"}));
+  BOOST_REQUIRE_EQUAL(config.volatile_directories.size(), 2);
+  BOOST_CHECK_EQUAL(config.volatile_directories[0].path, "/tmp");
+  BOOST_CHECK_EQUAL(config.volatile_directories[0].size.value(), "512M");
+  BOOST_CHECK_EQUAL(config.volatile_directories[1].path, "/var/cache");
+  BOOST_CHECK(!config.volatile_directories[1].size.has_value());
+  BOOST_CHECK(config.prune_paths == std::vector<std::string>({"/usr/share/doc/*"}));
+  std::filesystem::remove(path);
+}
@@ -0,0 +1,25 @@
+#include "../core/delta.hpp"
+
+BOOST_AUTO_TEST_CASE(test_delta_relative_path)
+{
+  BOOST_CHECK_EQUAL(delta::relative_path("etc/passwd").string(), "etc/passwd");
+  BOOST_CHECK_EQUAL(delta::relative_path("./usr//bin").string(), "usr/bin");
+  for (std::string p : {"", "/", "/etc", ".", "..", "../etc", "usr/../../etc", "usr/.."})
+    BOOST_CHECK_THROW(delta::relative_path(p), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_delta_check_parents)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_delta_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "usr" / "bin");
+  std::filesystem::create_directory_symlink("/etc", root / "link");
+  std::ofstream(root / "file") << "x";
+
+  BOOST_CHECK_NO_THROW(delta::check_parents(root, "usr/bin/sh"));
+  BOOST_CHECK_NO_THROW(delta::check_parents(root, "link"));
+  BOOST_CHECK_NO_THROW(delta::check_parents(root, "missing/file"));
+  BOOST_CHECK_THROW(delta::check_parents(root, "link/passwd"), std::runtime_error);
+  BOOST_CHECK_THROW(delta::check_parents(root, "file/x"), std::runtime_error);
+  std::filesystem::remove_all(root);
+}
@@ -0,0 +1,51 @@
+#include "../core/ingest.hpp"
+
+BOOST_AUTO_TEST_CASE(test_ingest_matches_tar_extraction)
+{
+  std::filesystem::path base = std::filesystem::temp_directory_path() / "successor_ingest_unit";
+  std::filesystem::remove_all(base);
+  std::filesystem::path source = base / "source", target = base / "target";
+  std::string long_name(150, 'n');
+  std::filesystem::create_directories(source / "etc" / long_name);
+  std::ofstream(source / "etc" / "a") << "same";
+  std::ofstream(source / "etc" / "b") << "same";
+  std::ofstream(source / "etc" / long_name / "deep") << "deep";
+  {
+    std::ofstream large(source / "large");
+    for (int i = 0; i < 300000; i++)
+      large << i << "\n";
+  }
+  std::filesystem::create_symlink("etc/a", source / "link");
+  std::filesystem::create_hard_link(source / "etc" / "a", source / "hard");
+  std::filesystem::create_directories(target);
+
+  for (std::string format : {"gnu", "pax"})
+  {
+    std::filesystem::remove_all(target);
+    std::filesystem::create_directories(target);
+    std::filesystem::path archive = base / (format + ".tar");
+    BOOST_REQUIRE_EQUAL(sys::execute("tar", {"--format=" + format, "-C", source.string(), "-cf", archive.string(), "."}), 0);
+
+    int fd = open(archive.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd != -1);
+    auto result = ingest::extract(fd, target);
+    close(fd);
+
+    auto expected = manifest::generate(source);
+    auto actual = manifest::generate(target);
+    BOOST_REQUIRE_EQUAL(result.manifest.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+      BOOST_CHECK_EQUAL(actual[i].path, expected[i].path);
+      BOOST_CHECK(actual[i].same_content(expected[i]));
+      BOOST_CHECK_EQUAL(actual[i].mtime, expected[i].mtime);
+      // the hashes taken while streaming match a scan of the result
+      BOOST_CHECK_EQUAL(result.manifest[i].path, actual[i].path);
+      BOOST_CHECK_EQUAL(result.manifest[i].hash, actual[i].hash);
+    }
+  }
+
+  BOOST_CHECK_THROW(ingest::normalize("./etc/../../x"), std::runtime_error);
+  BOOST_CHECK_EQUAL(ingest::normalize("./etc//a/"), "etc/a");
+  std::filesystem::remove_all(base);
+}
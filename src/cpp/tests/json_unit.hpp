@@ -0,0 +1,15 @@
+#include "../interfaces/json.hpp"
+
+BOOST_AUTO_TEST_CASE(test_json_parse)
+{
+  auto value = json::parse(R"({"schemaVersion": 2, "manifests": [{"digest": "sha256:ab\"c", "platform": {"architecture": "amd64"}}, null, true], "x": "é"})");
+  BOOST_CHECK_EQUAL(value.at("schemaVersion").number, 2);
+  BOOST_REQUIRE_EQUAL(value.at("manifests").array.size(), 3);
+  BOOST_CHECK_EQUAL(value.at("manifests").array[0].get("digest"), "sha256:ab\"c");
+  BOOST_CHECK_EQUAL(value.at("manifests").array[0].at("platform").get("architecture"), "amd64");
+  BOOST_CHECK(value.at("manifests").array[1].type == json::value_t::JSON_NULL);
+  BOOST_CHECK(value.at("manifests").array[2].boolean);
+  BOOST_CHECK_EQUAL(value.get("x"), "\xc3\xa9");
+  BOOST_CHECK_EQUAL(value.get("missing", "fallback"), "fallback");
+  BOOST_CHECK_THROW(json::parse("{\"a\": }"), std::exception);
+}
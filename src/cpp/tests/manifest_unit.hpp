@@ -0,0 +1,84 @@
+#include "../core/manifest.hpp"
+
+BOOST_AUTO_TEST_CASE(test_manifest_hash_chunking)
+{
+  std::string data(1000, 'x');
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (char)(i * 31);
+
+  manifest::hasher_t whole;
+  whole.update(data.data(), data.size());
+
+  manifest::hasher_t pieces;
+  for (size_t i = 0; i < data.size(); i += 7)
+    pieces.update(data.data() + i, std::min<size_t>(7, data.size() - i));
+
+  manifest::hasher_t other;
+  other.update(data.data(), data.size() - 1);
+
+  std::string digest = whole.digest();
+  BOOST_CHECK_EQUAL(digest, pieces.digest());
+  BOOST_CHECK_NE(digest, other.digest());
+}
+
+BOOST_AUTO_TEST_CASE(test_manifest_hash_vectors)
+{
+  auto sha256 = [](const std::string &data)
+  {
+    manifest::hasher_t hasher;
+    hasher.update(data.data(), data.size());
+    return hasher.digest();
+  };
+  BOOST_CHECK_EQUAL(sha256(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  BOOST_CHECK_EQUAL(sha256("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  BOOST_CHECK_EQUAL(sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+                    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  BOOST_CHECK_EQUAL(sha256(std::string(1000000, 'a')), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+  // flipping the top bit of the same word twice cancelled out in the hash used before
+  std::string data(64, 0), flipped = data;
+  flipped[7] ^= 0x80;
+  flipped[39] ^= 0x80;
+  BOOST_CHECK_NE(sha256(data), sha256(flipped));
+}
+
+BOOST_AUTO_TEST_CASE(test_manifest_roundtrip_and_diff)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_manifest_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "etc");
+  std::ofstream(root / "etc" / "a") << "a";
+  std::ofstream(root / "etc" / "with\nnewline") << "b";
+  std::filesystem::create_symlink("etc/a", root / "link");
+
+  auto before = manifest::generate(root);
+  std::stringstream ss;
+  manifest::write(before, ss);
+  auto parsed = manifest::read(ss);
+  BOOST_REQUIRE_EQUAL(parsed.size(), before.size());
+  for (size_t i = 0; i < parsed.size(); i++)
+  {
+    BOOST_CHECK_EQUAL(parsed[i].path, before[i].path);
+    BOOST_CHECK(parsed[i].same_content(before[i]));
+  }
+
+  std::ofstream(root / "etc" / "a") << "changed";
+  std::filesystem::remove(root / "link");
+  std::ofstream(root / "new") << "new";
+  auto after = manifest::generate(root);
+
+  std::vector<std::string> added, removed, modified;
+  manifest::diff(
+      before, after,
+      [&](const manifest::entry_t &e)
+      { added.push_back(e.path); },
+      [&](const manifest::entry_t &e)
+      { removed.push_back(e.path); },
+      [&](const manifest::entry_t &, const manifest::entry_t &e)
+      { modified.push_back(e.path); });
+  BOOST_CHECK(added == std::vector<std::string>{"new"});
+  BOOST_CHECK(removed == std::vector<std::string>{"link"});
+  BOOST_CHECK(modified == std::vector<std::string>{"etc/a"});
+
+  std::filesystem::remove_all(root);
+}
@@ -0,0 +1,60 @@
+#include "../core/optimize.hpp"
+
+BOOST_AUTO_TEST_CASE(test_optimize_prune)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_optimize_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "usr" / "share" / "doc" / "bash");
+  std::filesystem::create_directories(root / "usr" / "bin");
+  std::ofstream(root / "usr" / "share" / "doc" / "bash" / "README") << "x";
+  std::ofstream(root / "usr" / "bin" / "bash") << "x";
+
+  optimize::report_t report;
+  auto kept = optimize::prune(root, manifest::generate(root), {"/usr/share/doc/*"}, report);
+  // the subtree goes with its directory, and is counted once
+  BOOST_CHECK_EQUAL(report.pruned, 1);
+  BOOST_CHECK(!std::filesystem::exists(root / "usr" / "share" / "doc" / "bash"));
+  BOOST_CHECK(std::filesystem::exists(root / "usr" / "share" / "doc"));
+  std::vector<std::string> paths;
+  for (auto &entry : kept)
+    paths.push_back(entry.path);
+  BOOST_CHECK((paths == std::vector<std::string>{"usr", "usr/bin", "usr/bin/bash", "usr/share", "usr/share/doc"}));
+  std::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(test_optimize_link_duplicates)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_optimize_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root);
+  for (std::string name : {"a", "b", "mode", "owner"})
+    std::ofstream(root / name) << "same";
+  std::ofstream(root / "other") << "diff";
+  chmod((root / "mode").c_str(), 0600);
+  bool as_root = geteuid() == 0;
+  if (as_root)
+    BOOST_REQUIRE_EQUAL(lchown((root / "owner").c_str(), 1234, 1234), 0);
+
+  auto entries = manifest::generate(root);
+  std::vector<size_t> rank(entries.size());
+  for (size_t i = 0; i < rank.size(); i++)
+    rank[i] = i;
+  std::set<size_t> skipped;
+  optimize::report_t report;
+  optimize::link_duplicates(root, entries, rank, skipped, report);
+
+  auto inode = [&](const std::string &name)
+  {
+    struct stat st;
+    lstat((root / name).c_str(), &st);
+    return st.st_ino;
+  };
+  BOOST_CHECK_EQUAL(report.linked, as_root ? 1 : 2);
+  BOOST_CHECK_EQUAL(inode("a"), inode("b"));
+  // sharing an inode would change the mode or owner of one of them
+  BOOST_CHECK_NE(inode("a"), inode("mode"));
+  if (as_root)
+    BOOST_CHECK_NE(inode("a"), inode("owner"));
+  BOOST_CHECK_NE(inode("a"), inode("other"));
+  std::filesystem::remove_all(root);
+}
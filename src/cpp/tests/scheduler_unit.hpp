@@ -0,0 +1,63 @@
+#include "../core/scheduler.hpp"
+
+BOOST_AUTO_TEST_CASE(test_scheduler_base_images)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_scheduler_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root);
+  std::ofstream(root / "Containerfile") << "# FROM commented\n"
+                                        << "FROM --platform=linux/amd64 registry.example.com/library/base:1.2 AS build\n"
+                                        << "RUN make\n"
+                                        << "from tools@sha256:0123\n"
+                                        << "FROM build\n";
+  BOOST_CHECK((scheduler::base_images(root / "Containerfile") == std::set<std::string>{"base", "tools", "build"}));
+  std::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(test_scheduler_load)
+{
+  std::filesystem::path root = std::filesystem::temp_directory_path() / "successor_scheduler_unit";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "web");
+  std::ofstream(root / "base.Containerfile") << "FROM debian:12\n";
+  std::ofstream(root / "web" / "Containerfile") << "FROM base:latest\n";
+  std::ofstream(root / "build.yml") << "base:\n"
+                                    << "  source: base.Containerfile\n"
+                                    << "web:\n"
+                                    << "  source: web/Containerfile\n"
+                                    << "  context: web\n"
+                                    << "tools:\n"
+                                    << "  oci: layouts/tools # ingested\n"
+                                    << "  after: base, web,\n";
+
+  auto jobs = scheduler::load(root / "build.yml");
+  BOOST_REQUIRE_EQUAL(jobs.size(), 3);
+  BOOST_CHECK(jobs[0].after.empty());
+  BOOST_CHECK_EQUAL(jobs[0].context, root);
+  // FROM an image of the manifest, images outside of it are pulled as usual
+  BOOST_CHECK((jobs[1].after == std::set<std::string>{"base"}));
+  BOOST_CHECK_EQUAL(jobs[1].context, root / "web");
+  BOOST_CHECK((jobs[2].after == std::set<std::string>{"base", "web"}));
+  BOOST_CHECK_EQUAL(jobs[2].oci_layout.value(), root / "layouts" / "tools");
+  BOOST_CHECK_NO_THROW(scheduler::check_cycles(jobs));
+
+  std::ofstream(root / "build.yml") << "base:\n"
+                                    << "  source: base.Containerfile\n"
+                                    << "  after: missing\n";
+  BOOST_CHECK_THROW(scheduler::load(root / "build.yml"), std::runtime_error);
+  std::ofstream(root / "build.yml") << "base:\n"
+                                    << "  source: base.Containerfile\n"
+                                    << "  oci: layouts/base\n";
+  BOOST_CHECK_THROW(scheduler::load(root / "build.yml"), std::runtime_error);
+  std::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(test_scheduler_cycles)
+{
+  std::vector<scheduler::job_t> jobs = {{.name = "a", .after = {"b"}}, {.name = "b", .after = {"c"}}, {.name = "c"}};
+  BOOST_CHECK_NO_THROW(scheduler::check_cycles(jobs));
+  jobs[2].after = {"a"};
+  BOOST_CHECK_THROW(scheduler::check_cycles(jobs), std::runtime_error);
+  jobs[2].after = {"c"};
+  BOOST_CHECK_THROW(scheduler::check_cycles(jobs), std::runtime_error);
+}
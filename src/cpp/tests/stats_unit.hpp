@@ -0,0 +1,38 @@
+#include "../interfaces/stats.hpp"
+
+BOOST_AUTO_TEST_CASE(test_stats_percentile)
+{
+  std::vector<uint64_t> sorted;
+  for (uint64_t i = 1; i <= 100; i++)
+    sorted.push_back(i);
+  BOOST_CHECK_EQUAL(stats::percentile(sorted, 50), 50);
+  BOOST_CHECK_EQUAL(stats::percentile(sorted, 99), 99);
+  BOOST_CHECK_EQUAL(stats::percentile({}, 50), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_stats_save_load)
+{
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "successor_stats_unit";
+  std::filesystem::remove_all(dir);
+
+  stats::reset();
+  stats::record("mount.bind", 1000);
+  stats::record("mount.bind", 3000);
+  stats::record("pivot_root", 500);
+  stats::save("switch", dir);
+
+  auto ops = stats::load("switch", dir);
+  if (stats::enabled)
+  {
+    BOOST_REQUIRE_EQUAL(ops.size(), 2);
+    BOOST_CHECK_EQUAL(ops[0].op, "mount.bind");
+    BOOST_CHECK_EQUAL(ops[0].count, 2);
+    BOOST_CHECK_EQUAL(ops[0].total_ns, 4000);
+    BOOST_CHECK_EQUAL(ops[1].op, "pivot_root");
+  }
+  else
+    BOOST_CHECK(ops.empty());
+
+  stats::reset();
+  std::filesystem::remove_all(dir);
+}
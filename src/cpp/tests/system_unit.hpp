@@ -11,3 +11,25 @@ BOOST_AUTO_TEST_CASE(test_binary_exists)
   BOOST_CHECK(sys::binary_exists("cat"));
   BOOST_CHECK(!sys::binary_exists("nonexistent"));
 }
+
+BOOST_AUTO_TEST_CASE(test_copy_tree)
+{
+  std::filesystem::path base = std::filesystem::temp_directory_path() / "successor_copy_tree";
+  std::filesystem::remove_all(base);
+  std::filesystem::create_directories(base / "from" / "etc");
+  std::filesystem::create_directories(base / "to");
+  std::ofstream(base / "from" / "etc" / "a") << std::string(100000, 'a');
+  std::filesystem::create_hard_link(base / "from" / "etc" / "a", base / "from" / "hard");
+  std::filesystem::create_symlink("etc/a", base / "from" / "link");
+  std::filesystem::permissions(base / "from" / "etc", std::filesystem::perms(0750));
+
+  sys::fs::copy_tree((base / "from").string(), (base / "to").string());
+
+  BOOST_CHECK_EQUAL(std::filesystem::file_size(base / "to" / "etc" / "a"), 100000);
+  BOOST_CHECK(std::filesystem::equivalent(base / "to" / "etc" / "a", base / "to" / "hard"));
+  BOOST_CHECK_EQUAL(std::filesystem::read_symlink(base / "to" / "link"), "etc/a");
+  BOOST_CHECK(std::filesystem::status(base / "to" / "etc").permissions() == std::filesystem::perms(0750));
+  BOOST_CHECK(std::filesystem::last_write_time(base / "to" / "etc") == std::filesystem::last_write_time(base / "from" / "etc"));
+  BOOST_CHECK_EQUAL(sys::fs::tree_size((base / "from").string()), sys::fs::tree_size((base / "to").string()));
+  std::filesystem::remove_all(base);
+}